@@ -9,9 +9,15 @@ out vec4 color;
 
 uniform sampler2D texture1;
 uniform bool hasTexture;
-uniform bool doWire;
-uniform vec3 lightColor;
-uniform vec3 wireColor;
+// Per-frame data, uploaded once per frame by Scene::Render (binding Shader::FRAME_DATA_BINDING)
+layout(std140) uniform FrameData {
+    mat4 ViewMtx;
+    mat4 ProjMtx;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 wireColor;
+    bool doWire;
+};
 uniform float gWireframeWidth = 0.001;
 //uniform vec3 viewPos;
 
@@ -36,10 +42,10 @@ void main()
     float specStr = 1.0;
 
     float diff = max(dot(norm, lightDir), 0.0);
-    vec3 diffuse = lightColor * diff;
-    vec3 ambient = lightColor * ambientStrength;
+    vec3 diffuse = lightColor.rgb * diff;
+    vec3 ambient = lightColor.rgb * ambientStrength;
     float spec = pow(max(dot(viewDir, reflectDir), 0.0), 32);
-    vec3 specular = specStr * spec * lightColor;
+    vec3 specular = specStr * spec * lightColor.rgb;
 
     vec3 result = (diffuse + ambient + specular) * vec3(color);
     if (doWire)
@@ -60,7 +66,7 @@ void main()
                 float x = d - gWireframeWidth;
                 mixVal = exp2(-2.0 * x * x);
             }
-            result = mix(result, wireColor, mixVal);
+            result = mix(result, wireColor.rgb, mixVal);
         }        
     }
 
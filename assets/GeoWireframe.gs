@@ -11,9 +11,20 @@ in vec2 TexCoord0[];
 in vec3 Normal0[];
 in vec3 LightPos0[];
 in vec3 VertPos0[];
-uniform mat4 ViewMtx; // Viewport matrix
+// Per-frame data, uploaded once per frame by Scene::Render (binding Shader::FRAME_DATA_BINDING)
+layout(std140) uniform FrameData {
+	mat4 ViewMtx;
+	mat4 ProjMtx;
+	vec4 lightPos;
+	vec4 lightColor;
+	vec4 wireColor;
+	bool doWire;
+};
+uniform bool gpuNormals; // Use the flat face normal instead of the per-vertex attribute (for deforming meshes)
 void main()
 {
+	// Face normal in view space. Same winding as Mesh::RecomputeNormals, so it faces the same way.
+	vec3 faceNormal = normalize(cross(VertPos0[1] - VertPos0[0], VertPos0[2] - VertPos0[0]));
 	// Transform each vertex into viewport space
 	vec3 p0 = vec3(ViewMtx * (gl_in[0].gl_Position / gl_in[0].gl_Position.w));
 	vec3 p1 = vec3(ViewMtx * (gl_in[1].gl_Position / gl_in[1].gl_Position.w));
@@ -29,21 +40,21 @@ void main()
 	float hc = abs( b * sin( alpha ) );
 	// Send the triangle along with the edge distances
 	GEdgeDistance = vec3( ha, 0, 0 );
-	Normal = Normal0[0];
+	Normal = gpuNormals ? faceNormal : Normal0[0];
 	FragPos = VertPos0[0];
 	TexCoord = TexCoord0[0];
 	LightPos = LightPos0[0];
 	gl_Position = gl_in[0].gl_Position;
 	EmitVertex();
 	GEdgeDistance = vec3( 0, hb, 0 );
-	Normal = Normal0[1];
+	Normal = gpuNormals ? faceNormal : Normal0[1];
 	FragPos = VertPos0[1];
 	TexCoord = TexCoord0[1];
 	LightPos = LightPos0[1];
 	gl_Position = gl_in[1].gl_Position;
 	EmitVertex();
 	GEdgeDistance = vec3( 0, 0, hc );
-	Normal = Normal0[2];
+	Normal = gpuNormals ? faceNormal : Normal0[2];
 	FragPos = VertPos0[2];
 	TexCoord = TexCoord0[2];
 	LightPos = LightPos0[2];
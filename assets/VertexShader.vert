@@ -2,6 +2,7 @@
 layout (location = 0) in vec3 position;
 layout (location = 1) in vec2 texCoord;
 layout (location = 2) in vec3 normal;
+layout (location = 3) in mat4 instanceMtx; // Per-instance model matrix, only read when instanced is set
 
 out vec2 TexCoord0;
 out vec3 Normal0;
@@ -11,14 +12,25 @@ out vec3 VertPos0;
 uniform mat4 MV;
 uniform mat4 MVP;
 uniform mat4 NormalMtx;
-uniform mat4 view;
-uniform vec3 lightPos;
+uniform bool instanced;
+// Per-frame data, uploaded once per frame by Scene::Render (binding Shader::FRAME_DATA_BINDING)
+layout(std140) uniform FrameData {
+    mat4 ViewMtx;
+    mat4 ProjMtx;
+    vec4 lightPos;
+    vec4 lightColor;
+    vec4 wireColor;
+    bool doWire;
+};
 
 void main()
 {
-    gl_Position = MVP * vec4(position, 1.0);
-    VertPos0 = vec3(MV * vec4(position, 1.0));
+    // Instances sit under the mesh model matrix, so MV/MVP/NormalMtx still carry it
+    vec4 localPos = instanced ? instanceMtx * vec4(position, 1.0) : vec4(position, 1.0);
+    vec3 localNormal = instanced ? transpose(inverse(mat3(instanceMtx))) * normal : normal;
+    gl_Position = MVP * localPos;
+    VertPos0 = vec3(MV * localPos);
     TexCoord0 = texCoord;
-    Normal0 = normalize(mat3(NormalMtx) * normal);
-    LightPos0 = lightPos;
+    Normal0 = normalize(mat3(NormalMtx) * localNormal);
+    LightPos0 = lightPos.xyz;
 }
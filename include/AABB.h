@@ -1,20 +1,30 @@
+#pragma once
 #include "Eigen/Geometry"
+#include <limits>
 
-
+// Axis aligned bounding box. A default constructed box is empty (min > max), so it can be grown with expand().
 class AABB
 {
 public:
 	AABB()
+		: min(Eigen::Vector3f::Constant(std::numeric_limits<float>::max())),
+		  max(Eigen::Vector3f::Constant(-std::numeric_limits<float>::max()))
 	{
-
 	};
+	AABB(const Eigen::Vector3f& _min, const Eigen::Vector3f& _max) : min(_min), max(_max) {};
 	~AABB() = default;
 
-	bool rayHit(Eigen::Vector2f& ray);
-
-	float width;
-	float height;
-	float depth;
+	void expand(const Eigen::Vector3f& point);
+	void expand(const AABB& other);
+	bool isEmpty() const;
+	Eigen::Vector3f center() const;
+	// Full size along each axis (width, height, depth)
+	Eigen::Vector3f size() const;
+	// Bounds of this box after an affine transform - conservative, but tight for rotations of the box itself
+	AABB transformed(const Eigen::Matrix4f& mtx) const;
+	// Slab test. On a hit tHit is the entry distance along dir, or 0 if the origin is inside the box.
+	bool rayHit(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tHit) const;
 
-	Eigen::Vector3f pos;
-};
\ No newline at end of file
+	Eigen::Vector3f min;
+	Eigen::Vector3f max;
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <mutex>
+
+// Identity of an on-disk asset: where it lives and what is in it. Two loads of the same file share one entry,
+// and editing the file changes the hash so the stale entry is never handed out again.
+struct AssetKey
+{
+	std::string canonicalPath;
+	uint64_t contentHash = 0;
+	std::string str() const;
+};
+
+namespace AssetHash
+{
+	// 64-bit FNV-1a. Not cryptographic, just a cheap content fingerprint.
+	uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull);
+	uint64_t hashFile(const std::string& path, bool& ok);
+	// Resolves the canonical path and content hash. The hash is memoized per (path, size, mtime),
+	// so asking again for an unchanged file does not read it again.
+	bool makeKey(const std::string& path, AssetKey& key);
+}
+
+// Reference counted registry of shared assets. Whoever holds the shared_ptr keeps the asset alive; the cache
+// holds one extra reference so a released asset can be picked up again for free, until it gets evicted.
+// Eviction is least-recently-used, only touches entries nobody else references, and runs whenever the
+// total size goes over the budget.
+template <typename T>
+class ResourceCache
+{
+public:
+	explicit ResourceCache(size_t budgetBytes = 256ull << 20) : m_budget(budgetBytes) {}
+
+	std::shared_ptr<T> find(const std::string& key)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (it == m_entries.end()) return nullptr;
+		m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+		return it->second.asset;
+	}
+
+	void insert(const std::string& key, const std::shared_ptr<T>& asset, size_t bytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_entries.find(key);
+		if (it != m_entries.end())
+		{
+			m_bytes -= it->second.bytes;
+			m_lru.erase(it->second.lruPos);
+			m_entries.erase(it);
+		}
+		m_lru.push_front(key);
+		m_entries[key] = Entry{ asset, bytes, m_lru.begin() };
+		m_bytes += bytes;
+		evictLocked();
+	}
+
+	void setBudget(size_t budgetBytes)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_budget = budgetBytes;
+		evictLocked();
+	}
+
+	// Drops unreferenced entries until we are under budget; call after releasing assets
+	void evict()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		evictLocked();
+	}
+
+	size_t getBytes() const { std::lock_guard<std::mutex> lock(m_mutex); return m_bytes; }
+	size_t getBudget() const { std::lock_guard<std::mutex> lock(m_mutex); return m_budget; }
+	size_t size() const { std::lock_guard<std::mutex> lock(m_mutex); return m_entries.size(); }
+
+private:
+	struct Entry
+	{
+		std::shared_ptr<T> asset;
+		size_t bytes;
+		typename std::list<std::string>::iterator lruPos;
+	};
+
+	void evictLocked()
+	{
+		for (auto it = m_lru.end(); it != m_lru.begin() && m_bytes > m_budget;)
+		{
+			--it;
+			auto entry = m_entries.find(*it);
+			if (entry->second.asset.use_count() > 1) continue; // still in use somewhere
+			m_bytes -= entry->second.bytes;
+			m_entries.erase(entry);
+			it = m_lru.erase(it);
+		}
+	}
+
+	std::unordered_map<std::string, Entry> m_entries;
+	std::list<std::string> m_lru; // front = most recently used
+	size_t m_bytes = 0;
+	size_t m_budget;
+	mutable std::mutex m_mutex;
+};
@@ -0,0 +1,53 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <atomic>
+#include "ThreadPool.h"
+
+class Mesh;
+class TextureManager;
+
+// Loads meshes and textures in the background. Parsing, content hashing and decoding run on the loader pool
+// (ThreadPool::background() by default); everything that touches GL is queued and executed on the render
+// thread by processUploads(), a few milliseconds per frame, so a big load never stalls a frame. A mesh shows up with placeholder textures as soon as its geometry is
+// uploaded, and its textures are swapped in as they finish decoding.
+class AssetLoader
+{
+public:
+	typedef std::function<void(std::shared_ptr<Mesh>)> MeshCallback;
+	typedef std::function<void(unsigned int)> TextureCallback;
+
+	explicit AssetLoader(std::shared_ptr<TextureManager> texMgr, ThreadPool& pool = ThreadPool::background());
+	~AssetLoader();
+	AssetLoader(const AssetLoader&) = delete;
+	AssetLoader& operator=(const AssetLoader&) = delete;
+
+	// onReady runs on the render thread, from processUploads, with nullptr if the file failed to load.
+	// prepare, if given, runs on the loader thread right after parsing, for CPU work such as LOD generation.
+	void loadMesh(const std::string& path, MeshCallback onReady, std::function<void(Mesh&)> prepare = nullptr);
+	// onReady gets a texture id holding one reference, or 0 on failure
+	void loadTexture(const std::string& path, TextureCallback onReady);
+	// Runs queued GL uploads until the queue is empty or budgetMs is spent (at least one upload always runs).
+	// Must be called on the thread that owns the GL context. Returns the number of uploads still queued.
+	size_t processUploads(double budgetMs = 2.0);
+	// Loads that have been started but whose callbacks have not run yet
+	size_t getNumPending() const;
+
+private:
+	// Shared with the in-flight tasks, so a task finishing after the loader is gone has somewhere safe to go
+	struct UploadQueue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+		bool closed = false;
+		std::atomic<size_t> pending{ 0 };
+		void push(std::function<void()> task);
+	};
+	void streamTextures(const std::shared_ptr<Mesh>& mesh);
+	std::shared_ptr<UploadQueue> m_uploads;
+	std::shared_ptr<TextureManager> m_texMgr;
+	ThreadPool& m_pool;
+};
@@ -0,0 +1,15 @@
+#pragma once
+#include <string>
+#include <ostream>
+#include <functional>
+
+// Whole-file writes that readers never see half done: the data goes to a temporary file next to the target,
+// which is renamed over it once everything is written. The temporary name carries the thread id and a random
+// part, so concurrent writers, in this process or in another one sharing the folder, never collide.
+namespace AtomicFile
+{
+	std::string makeTempPath(const std::string& path);
+	// fill writes the contents. Fails, leaving path as it was and no temporary file behind, if the stream
+	// fails or the rename does.
+	bool write(const std::string& path, const std::function<void(std::ostream&)>& fill);
+}
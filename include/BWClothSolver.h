@@ -48,7 +48,7 @@ public:
 		IMPLICIT
 	};
 	int integrator;
-	uint16_t vIters;
+	uint32_t vIters;
 
 private:
 	std::shared_ptr<Mesh> _mesh;
@@ -68,5 +68,5 @@ private:
 	Eigen::SparseLU< Eigen::SparseMatrix<float> > lu;
 	Eigen::BiCGSTAB<Eigen::SparseMatrix<float>, Eigen::IncompleteLUT<float>> bicg;
 	bool analyzed = false;
-	uint16_t n;
+	uint32_t n;
 };
\ No newline at end of file
@@ -0,0 +1,33 @@
+#pragma once
+#include "Eigen/Geometry"
+#include "AABB.h"
+
+// View frustum as six inward facing planes, pulled straight out of a projection * view matrix
+// (Gribb & Hartmann). Works in whatever space the matrix maps from, so passing proj * view * model
+// gives a frustum in that model's object space.
+class Frustum
+{
+public:
+	Frustum() = default;
+	explicit Frustum(const Eigen::Matrix4f& viewProj);
+
+	void update(const Eigen::Matrix4f& viewProj);
+	// Conservative: may say true for boxes just outside a frustum corner, never false for visible ones
+	bool intersects(const AABB& box) const;
+	bool intersects(const Eigen::Vector3f& center, float radius) const;
+
+	enum PLANE { LEFT = 0, RIGHT, BOTTOM, TOP, NEAR_PLANE, FAR_PLANE, NUM_PLANES };
+	// (nx, ny, nz, d) with unit normals, inside where n.p + d >= 0
+	Eigen::Vector4f planes[NUM_PLANES];
+};
+
+// Everything Mesh::Render culls against: the world space frustum for meshes and submeshes, and the
+// matrices it needs to cull clusters in object space
+struct CullView
+{
+	Frustum frustum;
+	Eigen::Matrix4f viewProj;
+	Eigen::Vector3f cameraPos;
+	// Also drop clusters facing away from the camera. Only valid for closed, single sided geometry.
+	bool coneCulling = false;
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+// OpenGL core context with no window and no display server behind it, for headless rendering into an
+// OffscreenTarget. Made through EGL directly, since GLFW 3.3 needs a display even for a hidden window:
+// Mesa's surfaceless platform first (llvmpipe on a bare CI box), then the default EGL display. The context
+// is made current without a surface where the driver allows it, else on a tiny pbuffer.
+// Needs EGL at build time (DKVIEWER_HAS_EGL); without it create() always fails.
+class HeadlessContext
+{
+public:
+	HeadlessContext() = default;
+	~HeadlessContext();
+	HeadlessContext(const HeadlessContext&) = delete;
+	HeadlessContext& operator=(const HeadlessContext&) = delete;
+
+	// Creates the context and makes it current on the calling thread
+	bool create(int major = 3, int minor = 3);
+	void destroy();
+	bool isValid() const { return m_context != nullptr; }
+	// GL entry points of the current context, for gladLoadGLLoader
+	static void* getProcAddress(const char* name);
+
+private:
+	// EGLDisplay, EGLSurface and EGLContext, kept opaque so EGL headers stay out of this one
+	void* m_display = nullptr;
+	void* m_surface = nullptr;
+	void* m_context = nullptr;
+};
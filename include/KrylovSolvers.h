@@ -0,0 +1,117 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+
+// Preconditioned Krylov solvers over any operator with multiply(x, y) (y = A x) and preconditioner with
+// apply(r, z) (z = P^-1 r), so the same code runs on an assembled BlockSparseMatrix3 or a matrix-free
+// operator. x holds the initial guess on entry. Both stop once |b - A x| <= tolerance * |b| and return the
+// number of iterations taken. Anything short of maxIterations means the tolerance was met; a return of
+// maxIterations means it was not, and x holds the last iterate.
+namespace Krylov
+{
+	// A must be symmetric positive definite
+	template <typename Op, typename Precond, typename Vector>
+	uint32_t conjugateGradient(const Op& A, const Precond& P, const Vector& b, Vector& x, uint32_t maxIterations,
+		typename Vector::Scalar tolerance)
+	{
+		typedef typename Vector::Scalar Scalar;
+		const Scalar threshold = tolerance * b.norm();
+		if (threshold == Scalar(0))
+		{
+			x.setZero();
+			return 0;
+		}
+		Vector r(b.size()), z(b.size()), Ap(b.size());
+		A.multiply(x, Ap);
+		r = b - Ap;
+		if (r.norm() <= threshold) return 0;
+		P.apply(r, z);
+		Vector p = z;
+		Scalar rz = r.dot(z);
+		for (uint32_t i = 0; i < maxIterations; i++)
+		{
+			A.multiply(p, Ap);
+			const Scalar pAp = p.dot(Ap);
+			// Only possible when A is not positive definite: give up without claiming convergence
+			if (pAp == Scalar(0)) return maxIterations;
+			const Scalar alpha = rz / pAp;
+			x += alpha * p;
+			r -= alpha * Ap;
+			if (r.norm() <= threshold) return i + 1;
+			P.apply(r, z);
+			const Scalar rzNext = r.dot(z);
+			p = z + (rzNext / rz) * p;
+			rz = rzNext;
+		}
+		return maxIterations;
+	}
+
+	// For general (nonsymmetric) A, preconditioned on the right
+	template <typename Op, typename Precond, typename Vector>
+	uint32_t biCGStab(const Op& A, const Precond& P, const Vector& b, Vector& x, uint32_t maxIterations,
+		typename Vector::Scalar tolerance)
+	{
+		typedef typename Vector::Scalar Scalar;
+		const Scalar threshold = tolerance * b.norm();
+		if (threshold == Scalar(0))
+		{
+			x.setZero();
+			return 0;
+		}
+		const auto size = b.size();
+		Vector r(size), v = Vector::Zero(size), p = Vector::Zero(size), y(size), s(size), z(size), t(size);
+		A.multiply(x, t);
+		r = b - t;
+		if (r.norm() <= threshold) return 0;
+		Vector r0 = r;
+		Scalar rho = 1, alpha = 1, omega = 1;
+		// Breakdown: restart from the current residual, x is kept
+		auto restart = [&]()
+		{
+			r0 = r;
+			rho = alpha = omega = 1;
+			v.setZero();
+			p.setZero();
+		};
+		for (uint32_t i = 0; i < maxIterations; i++)
+		{
+			const Scalar rhoNext = r0.dot(r);
+			if (rhoNext == Scalar(0))
+			{
+				restart();
+				continue;
+			}
+			p = r + (rhoNext / rho) * (alpha / omega) * (p - omega * v);
+			P.apply(p, y);
+			A.multiply(y, v);
+			const Scalar r0v = r0.dot(v);
+			if (r0v == Scalar(0))
+			{
+				restart();
+				continue;
+			}
+			alpha = rhoNext / r0v;
+			s = r - alpha * v;
+			if (s.norm() <= threshold)
+			{
+				x += alpha * y;
+				return i + 1;
+			}
+			P.apply(s, z);
+			A.multiply(z, t);
+			const Scalar tt = t.dot(t);
+			omega = tt > Scalar(0) ? t.dot(s) / tt : Scalar(0);
+			x += alpha * y + omega * z;
+			r = s - omega * t;
+			if (r.norm() <= threshold) return i + 1;
+			if (omega == Scalar(0))
+			{
+				// The next direction would divide by omega; r is still the true residual, so restart from it
+				restart();
+				continue;
+			}
+			rho = rhoNext;
+		}
+		return maxIterations;
+	}
+}
@@ -12,6 +12,8 @@
 #include "TextureManager.h"
 #include "Shader.h"
 #include "AABB.h"
+#include "Frustum.h"
+#include "RenderQueue.h"
 
 class Mesh
 {
@@ -35,7 +37,7 @@ public:
 		unsigned int MaterialIndex;
 	};
 	struct BasicMaterialEntry {
-		unsigned int texID;
+		unsigned int texID = 0;
 		std::string texturePath;
 	};
 	struct Edge { uint32_t a, b; };
@@ -52,26 +54,107 @@ public:
 	void ReserveSpace(unsigned int NumVertices, unsigned int NumIndices);
 	void InitAllMeshes(const aiScene* pScene);
 	void InitSingleMesh(const aiMesh* paiMesh);
-	void SetVertex(const Eigen::Vector3f& pos, uint16_t id);
+	void SetVertex(const Eigen::Vector3f& pos, uint32_t id);
 	bool InitMaterials(const aiScene* pScene, const std::string& Filename);
-	Eigen::Vector3f GetVertex(uint16_t id, bool worldSpace=false);
+	Eigen::Vector3f GetVertex(uint32_t id, bool worldSpace=false);
+	const std::vector<Eigen::Vector3f>& GetNormals() const { return m_normals; }
+	const std::vector<Eigen::Vector2f>& GetTexCoords() const { return m_texCoords; }
+	// Submesh entries index into this with their BaseIndex, relative to their BaseVertex
+	const std::vector<unsigned int>& GetIndices() const { return m_indices; }
+	// Bulk access to the object space positions as one flat xyzxyz... array of 3 * GetNumVerts() floats
+	void SetPositions(const Eigen::Ref<const Eigen::VectorXf>& positions);
+	Eigen::Map<const Eigen::VectorXf> GetPositions() const;
+	// Writable view over the same storage, so a solver can keep its state in place instead of copying
+	// it over every step. The view dangles once the mesh is cleared or reloaded.
+	Eigen::Map<Eigen::VectorXf> MapPositions();
 	std::shared_ptr<Shader> m_shader;
 	void Cleanup();
 	void PopulateBuffers();
+	// Uploads m_positions to the GPU, but only if they changed since the last upload
 	void UpdatePositionBuffer();
-	void Render();
+	// Must be called after writing through MapPositions(); SetVertex/SetPositions flag it themselves
+	void MarkPositionsDirty();
+	bool ArePositionsDirty() const;
+	// With a view, submeshes whose world bounds fall outside its frustum are skipped, and so are the
+	// invisible clusters of a clustered mesh. Returns the number of submeshes drawn.
+	// With a state, binds it already holds are skipped, and the VAO is left bound for the next draw.
+	uint32_t Render(const CullView* view = nullptr, RenderState* state = nullptr);
 	void Draw();
+	// Area weighted smooth normals, computed in parallel as a per-vertex gather over m_vertFaces
 	void RecomputeNormals();
 	void SetRecomputeNormals(bool recomp);
+	// When set, RecomputeNormals only touches faces around vertices that moved since the last call
+	void SetIncrementalNormals(bool incremental);
+	// Where the shading normals come from. With NORMALS_GPU_FLAT the geometry shader derives flat
+	// normals from the triangle, so a deforming mesh only has to upload its positions.
+	enum NormalSource {
+		NORMALS_CPU = 0,
+		NORMALS_GPU_FLAT = 1
+	};
+	void SetNormalSource(NormalSource source);
+	NormalSource GetNormalSource() const;
+	// Object space bounds of the current positions, computed from scratch
 	AABB ComputeAABB();
+	// Cached bounds, refreshed lazily after the positions, the model matrix or the instances change
+	const AABB& GetLocalBounds();
+	const AABB& GetSubmeshBounds(uint32_t meshEntry);
+	// World space, covering every instance
+	const AABB& GetWorldBounds();
+	const AABB& GetSubmeshWorldBounds(uint32_t meshEntry);
 	uint32_t GetNumVerts();
 	uint32_t GetNumEdges();
 	uint32_t GetNumTriangles();
-	int* GetTriIndices(const int triId);
+	// Approximate CPU + GPU footprint of the geometry, used to budget the asset cache
+	size_t GetMemoryUsage() const;
+	const unsigned int* GetTriIndices(const uint32_t triId);
 	Eigen::Matrix4f GetModelMtx();
 	void SetModelMtx(const Eigen::Matrix4f& mtx);
+	// A static mesh promises its positions stay put, so the scene may bake it into a shared world space
+	// batch (see RenderQueue). Moving it is still fine but rebuilds that batch, so keep it to the odd edit.
+	void SetStatic(bool isStatic);
+	bool IsStatic() const;
+	GLuint GetVAO() const { return m_VAO; }
+	// Instancing: once a mesh has instances it is drawn once per instance with a single instanced draw per
+	// submesh, at modelMtx * instanceMtx. The transforms live in the WORLD_MAT_VB per-instance buffer.
+	// Only rendering is instanced; GetVertex(id, true) and collisions still use the bare model matrix.
+	uint32_t AddInstance(const Eigen::Matrix4f& instanceMtx);
+	void SetInstanceMtx(uint32_t instanceId, const Eigen::Matrix4f& instanceMtx);
+	const Eigen::Matrix4f& GetInstanceMtx(uint32_t instanceId) const;
+	void ClearInstances();
+	uint32_t GetNumInstances() const;
+	// With updateGPUBuffers=false the load touches no GL state (and can run on a loader thread);
+	// call UploadToGPU on the GL thread afterwards.
 	bool LoadFileTinyObj(const std::string& Filename, bool updateGPUBuffers=true);
+	// Builds up to maxLevels simplified versions of every submesh, each with about `reduction` times the
+	// triangles of the previous one. They only add index ranges (m_lods) after the base ones in the same
+	// index buffer and reuse the vertices, so they also follow any deformation. Best done before UploadToGPU.
+	uint32_t GenerateLODs(uint32_t maxLevels = 4, float reduction = 0.5f, uint32_t minTriangles = 64);
+	uint32_t GetNumLODs() const;
+	// Object space error of a level (0 is the full mesh)
+	float GetLODError(uint32_t level) const;
+	// Picks the coarsest level whose error stays under thresholdPx on screen, given how many pixels one
+	// object space unit covers. Switching to a coarser level needs some margin, so a mesh sitting right at
+	// a threshold does not pop back and forth.
+	uint32_t SelectLOD(float pixelsPerUnit, float thresholdPx);
+	uint32_t GetCurrentLOD() const;
+	// Splits every submesh into clusters of up to maxTriangles connected triangles, each with a bounding
+	// sphere and a normal cone, by reordering the indices in place. Render then culls per cluster and
+	// submits what is left with one multi-draw per submesh. The bounds are not refreshed when the mesh
+	// deforms, so clustered culling switches itself off for meshes whose positions change.
+	uint32_t BuildClusters(uint32_t maxTriangles = 64);
+	uint32_t GetNumClusters() const;
+	// Clusters drawn and culled by the last Render
+	uint32_t GetNumVisibleClusters() const;
+	uint32_t GetNumCulledClusters() const;
+	// Creates the VAO and buffers if needed. With loadTextures=false the material textures are left for the
+	// caller to stream in through SetMaterialTexture, and draw with a placeholder until then.
+	bool UploadToGPU(bool loadTextures=true);
+	// Hands the mesh a texture reference for a material. Returns false, without taking the reference,
+	// if the material no longer refers to texturePath.
+	bool SetMaterialTexture(uint32_t materialId, const std::string& texturePath, unsigned int texID);
 	std::vector<BasicMeshEntry> m_meshes;
+	// m_lods[level - 1][i] is submesh i at that level of detail
+	std::vector<std::vector<BasicMeshEntry>> m_lods;
 	std::vector<BasicMaterialEntry> m_materials;
 	bool materials_loaded = false;
 private:
@@ -87,6 +170,20 @@ private:
 	Eigen::Matrix4f m_worldTransform;
 	GLuint m_VAO = 0;
 	GLuint m_buffers[NUM_BUFFERS] = { 0 };
+	// Ring of persistently mapped position buffers, used once a mesh starts deforming (needs GL 4.4 / ARB_buffer_storage).
+	// Each slot is fenced after it is drawn, so we never overwrite data the GPU is still reading.
+	static const int NUM_STREAM_BUFFERS = 3;
+	struct StreamSlot {
+		GLuint buffer = 0;
+		void* mapped = nullptr;
+		GLsync fence = nullptr;
+	};
+	StreamSlot m_posStream[NUM_STREAM_BUFFERS];
+	int m_posStreamSlot = -1;
+	bool m_posStreamInit = false;
+	bool m_positionsDirty = false;
+	void InitPositionStream();
+	void ReleasePositionStream();
 	struct Vertex {
 		Eigen::Vector3f* position;
 		Eigen::Vector2f* uv;
@@ -98,8 +195,52 @@ private:
 	std::vector<Eigen::Vector3f> m_normals;
 	std::vector<Eigen::Vector2f> m_texCoords;
 	Eigen::Matrix4f modelMtx;
+	std::vector<Eigen::Matrix4f> m_instanceMtx;
+	struct Cluster {
+		uint32_t firstIndex;
+		uint32_t numIndices;
+		Eigen::Vector3f center;
+		float radius;
+		Eigen::Vector3f coneAxis;
+		// Sine of the cone's half angle, 1 if the cone is too wide to ever cull
+		float coneCutoff;
+	};
+	// Clusters of submesh i are m_clusters[m_clusterOffsets[i] .. m_clusterOffsets[i+1])
+	std::vector<Cluster> m_clusters;
+	std::vector<uint32_t> m_clusterOffsets;
+	bool m_clustersStale = false;
+	bool m_isStatic = false;
+	uint32_t m_numVisibleClusters = 0;
+	uint32_t m_numCulledClusters = 0;
+	// Per-frame multi-draw arguments, kept around to avoid reallocating
+	std::vector<GLsizei> m_drawCounts;
+	std::vector<const void*> m_drawOffsets;
+	std::vector<GLint> m_drawBaseVertices;
+	std::vector<float> m_lodErrors;
+	uint32_t m_currentLOD = 0;
+	AABB m_localBounds;
+	AABB m_worldBounds;
+	std::vector<AABB> m_submeshBounds;
+	std::vector<AABB> m_submeshWorldBounds;
+	bool m_boundsDirty = true;
+	bool m_worldBoundsDirty = true;
+	void UpdateBounds();
+	bool m_instancesDirty = false;
+	void UpdateInstanceBuffer();
 	unsigned int m_numFaces;
 	bool doRecompNormals;
+	bool doIncrementalNormals = false;
+	NormalSource m_normalSource = NORMALS_CPU;
+	// Vertex -> face adjacency in CSR form: faces of vertex v are m_vertFaces[m_vertFaceOffsets[v] .. m_vertFaceOffsets[v+1])
+	std::vector<uint32_t> m_vertFaceOffsets;
+	std::vector<uint32_t> m_vertFaces;
+	// Per-face vertex ids with BaseVertex already applied, and the unnormalized face normals
+	std::vector<uint32_t> m_faceVerts;
+	std::vector<Eigen::Vector3f> m_faceNormals;
+	// Positions the normals were last computed from, for the incremental path
+	std::vector<Eigen::Vector3f> m_normalsSrcPos;
+	void BuildAdjacency();
+	void UploadNormals(size_t first, size_t count);
 	// The per-element indices. In most cases - the per-triangle indices
 	std::vector<unsigned int> m_indices;
 	std::shared_ptr<TextureManager> m_texMgr;
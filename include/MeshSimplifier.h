@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include "Eigen/Geometry"
+
+// Quadric error metric simplifier (Garland & Heckbert) using half-edge collapses: a vertex is always merged
+// into one of its neighbours, never moved, so every level indexes the original vertex buffer and LODs can
+// share it. simplify() can be called with decreasing targets to produce a whole chain in one pass.
+class MeshSimplifier
+{
+public:
+	// triangles are indices into positions. Locked vertices never collapse; on top of those, vertices on an
+	// open boundary of this triangle set are locked so silhouettes and submesh borders stay put.
+	MeshSimplifier(const std::vector<Eigen::Vector3f>& positions, const std::vector<unsigned int>& triangles,
+		const std::vector<uint8_t>& locked);
+
+	// Collapses until at most targetTriangles remain or nothing can collapse anymore. Returns the triangle count.
+	size_t simplify(size_t targetTriangles);
+	// sourceTris, if given, receives the input triangle each output triangle started out as
+	void getIndices(std::vector<unsigned int>& out, std::vector<uint32_t>* sourceTris = nullptr) const;
+	size_t getNumTriangles() const { return m_numLive; }
+	// Largest collapse error so far, as an object space distance
+	float getError() const;
+
+	// Maps every vertex to one representative among the vertices sharing its exact position. Meshes split
+	// at normal or UV seams are simplified on the representatives, so the split copies collapse together.
+	static void weldPositions(const std::vector<Eigen::Vector3f>& positions, std::vector<uint32_t>& welded);
+
+private:
+	typedef Eigen::Matrix4d Quadric;
+	struct Collapse
+	{
+		double cost;
+		uint32_t from, to;
+		uint32_t fromStamp, toStamp;
+		bool operator<(const Collapse& other) const { return cost > other.cost; } // min-heap
+	};
+	double collapseCost(uint32_t from, uint32_t to) const;
+	void pushCollapses(uint32_t vertex);
+	bool flipsTriangle(uint32_t from, uint32_t to) const;
+
+	const std::vector<Eigen::Vector3f>& m_positions;
+	std::vector<uint32_t> m_tris;
+	std::vector<uint8_t> m_triAlive;
+	std::vector<std::vector<uint32_t>> m_vertTris;
+	std::vector<Quadric> m_quadrics;
+	std::vector<uint8_t> m_locked;
+	std::vector<uint32_t> m_stamps;
+	std::priority_queue<Collapse> m_heap;
+	size_t m_numLive = 0;
+	double m_maxCost = 0.0;
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include "glad/glad.h"
+#include <vector>
+#include <string>
+#include <cstdint>
+
+// Framebuffer object to render the scene into without a visible window, plus a ring of pixel pack buffers
+// so frames can be read back without stalling: a readback is queued right after a frame is drawn and
+// collected a couple of frames later, once its fence says the GPU is done with it.
+class OffscreenTarget
+{
+public:
+	OffscreenTarget() = default;
+	~OffscreenTarget();
+	OffscreenTarget(const OffscreenTarget&) = delete;
+	OffscreenTarget& operator=(const OffscreenTarget&) = delete;
+
+	// RGBA8 colour + 24 bit depth. numReadbacks is how many frames can be in flight at once.
+	bool init(unsigned int width, unsigned int height, unsigned int numReadbacks = 3);
+	void release();
+	// Binds the framebuffer and sets the viewport to cover it
+	void bind();
+	void unbind();
+
+	// Queues a copy of the colour buffer into the next free pack buffer. Returns false, queueing nothing,
+	// if every buffer still holds a frame that has not been collected.
+	bool requestReadback(uint64_t frameId);
+	// Copies out the oldest queued frame, top row first, as width * height * 4 bytes. Without wait it returns
+	// false right away if the GPU has not finished that frame yet.
+	bool collectReadback(std::vector<unsigned char>& rgba, uint64_t& frameId, bool wait);
+	size_t getNumPending() const { return m_numPending; }
+	size_t getNumReadbackBuffers() const { return m_readbacks.size(); }
+
+	unsigned int getWidth() const { return m_width; }
+	unsigned int getHeight() const { return m_height; }
+
+	// Binary PPM, dropping alpha
+	static bool writePPM(const std::string& path, unsigned int width, unsigned int height, const std::vector<unsigned char>& rgba);
+
+private:
+	struct Readback
+	{
+		GLuint pbo = 0;
+		GLsync fence = nullptr;
+		uint64_t frameId = 0;
+	};
+	GLuint m_fbo = 0;
+	GLuint m_colorRB = 0;
+	GLuint m_depthRB = 0;
+	unsigned int m_width = 0;
+	unsigned int m_height = 0;
+	std::vector<Readback> m_readbacks;
+	size_t m_oldest = 0;
+	size_t m_numPending = 0;
+};
@@ -0,0 +1,89 @@
+#pragma once
+#include "glad/glad.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include "Eigen/Geometry"
+#include "AABB.h"
+
+class Mesh;
+class Shader;
+class Frustum;
+
+// The GL bindings made so far this frame, so draws sorted next to each other skip redundant binds,
+// plus a count of the binds and draw calls that did go out
+struct RenderState
+{
+	// Nothing is known about the current bindings; the first request of each kind always binds
+	static const GLuint UNKNOWN = 0xFFFFFFFF;
+	GLuint program = UNKNOWN;
+	GLuint texture = UNKNOWN;
+	GLuint vao = UNKNOWN;
+	uint32_t numShaderChanges = 0;
+	uint32_t numTextureChanges = 0;
+	uint32_t numVAOChanges = 0;
+	uint32_t numDrawCalls = 0;
+
+	// Returns true if the program changed, so per-shader uniforms have to be set again
+	bool useProgram(GLuint id);
+	// Always on texture unit 0
+	void bindTexture(GLuint id);
+	void bindVertexArray(GLuint id);
+	// Forgets the bindings and clears the counters. Call once per frame, since anything drawing outside the
+	// queue (ImGui, the grid) changes bindings behind its back.
+	void reset();
+	uint32_t getNumStateChanges() const { return numShaderChanges + numTextureChanges + numVAOChanges; }
+};
+
+// Static batching: meshes flagged static (see Mesh::SetStatic) are baked, in world space, into one vertex
+// and index arena per shader, with their submeshes grouped by texture. A whole arena then draws with one
+// program bind, one VAO bind and one multi-draw per texture, with per-submesh frustum culling.
+// Meshes with LODs, clusters, instances or GPU normals keep their own draws, as do meshes whose
+// textures are still streaming in; they join a batch once those have arrived.
+class RenderQueue
+{
+public:
+	RenderQueue() = default;
+	~RenderQueue();
+	RenderQueue(const RenderQueue&) = delete;
+	RenderQueue& operator=(const RenderQueue&) = delete;
+
+	// Sort key for the draws that are not batched: by program first, as it is the most expensive switch,
+	// then texture, then VAO
+	static uint64_t sortKey(GLuint program, GLuint texture, GLuint vao);
+	static bool isBatchable(Mesh& mesh);
+	// Rebuilds the arenas when the set of batchable meshes, or anything baked into them (model matrices,
+	// textures), changed since the last call. Cheap otherwise.
+	void updateBatches(const std::vector<std::shared_ptr<Mesh>>& models);
+	bool isBatched(const Mesh* mesh) const;
+	// numDrawn/numCulled are incremented per submesh, like Scene's own counters
+	void renderBatches(const Eigen::Matrix4f& viewMtx, const Eigen::Matrix4f& projMtx, const Frustum* frustum,
+		RenderState& state, uint32_t& numDrawn, uint32_t& numCulled);
+	void release();
+	size_t getNumBatches() const { return m_batches.size(); }
+	size_t getNumBatchedMeshes() const { return m_batchedMeshes.size(); }
+
+private:
+	struct Range
+	{
+		GLuint texture;
+		uint32_t firstIndex;
+		uint32_t numIndices;
+		AABB bounds;
+	};
+	struct Batch
+	{
+		std::shared_ptr<Shader> shader;
+		GLuint vao = 0;
+		GLuint buffers[4] = { 0 }; // positions, texcoords, normals, indices
+		// Sorted by texture, then by index range, so a fully visible texture group is one contiguous range
+		std::vector<Range> ranges;
+	};
+	void buildBatch(Batch& batch, const std::vector<Mesh*>& meshes);
+	std::vector<Batch> m_batches;
+	// Sorted, for binary search
+	std::vector<const Mesh*> m_batchedMeshes;
+	uint64_t m_signature = 0;
+	std::vector<GLsizei> m_drawCounts;
+	std::vector<const void*> m_drawOffsets;
+};
@@ -4,21 +4,39 @@
 #include <vector>
 #include <string>
 #include "Eigen/Geometry"
+#include "AssetCache.h"
+#include "AssetLoader.h"
+#include "RenderQueue.h"
 class Mesh;
 class Camera;
 class Shader;
 class TextureManager;
+class SimCacheReader;
 class Scene
 {
 public:
-    Scene();
+    Scene(unsigned int width = 2560, unsigned int height = 1440);
     ~Scene();
 
     std::shared_ptr<Camera> camera;
     std::vector<std::shared_ptr<Mesh>> models;
     std::vector<std::shared_ptr<Shader>> shaders;
     std::shared_ptr<TextureManager> texMgr;
-    std::shared_ptr<Mesh> LoadModel(const std::string& file_path);
+    // Models are shared through the asset cache: loading a file that is already loaded (same canonical path
+    // and content) hands back the existing Mesh. Use InstanceModel to place more copies of it, and pass
+    // shared=false for meshes that get deformed (e.g. simulated cloth) so they get their own copy.
+    std::shared_ptr<Mesh> LoadModel(const std::string& file_path, bool shared = true);
+    // Same as LoadModel, but parses on a loader thread and uploads over the next frames (see AssetLoader).
+    // The model is added to the scene and onReady is called on the render thread once its geometry is on
+    // the GPU; textures keep streaming in after that. A cache hit completes right away.
+    void LoadModelAsync(const std::string& file_path, bool shared = true, std::function<void(std::shared_ptr<Mesh>)> onReady = nullptr);
+    // Time per frame Render spends on pending GPU uploads
+    void SetUploadBudget(double ms);
+    size_t GetNumPendingLoads() const;
+    // Runs uploads until every async load has completed, for batch rendering where nothing may pop in
+    void WaitForLoads();
+    // Unreferenced cached meshes are evicted once the cache grows past this
+    void SetMeshCacheBudget(size_t bytes);
     void DrawGrid();
     void SetupGrid();
     void Render(const Eigen::Matrix4f& viewMtx);
@@ -26,6 +44,8 @@ public:
     void RotateModel(const int model_id, Eigen::Matrix3f& rotation);
     void ScaleModel(const int model_id, Eigen::Vector3f& scale);
     void TransformModel(const int model_id, Eigen::Matrix4f& transform);
+    // Places another copy of a loaded model; all copies share its buffers and draw in one instanced call
+    uint32_t InstanceModel(const int model_id, const Eigen::Matrix4f& transform);
     void SetGridShader(std::shared_ptr<Shader> _gridShader);
     void SetShowGrid(bool state);
     bool IsGridVisible();
@@ -33,8 +53,50 @@ public:
     uint32_t GetNumEdges();
     void ShowWireframe();
     void HideWireframe();
-    const unsigned int SCR_WIDTH;
-    const unsigned int SCR_HEIGHT;
+    void SetWireColor(const Eigen::Vector3f& color);
+    // Models and submeshes outside the camera frustum are skipped before any per-draw work
+    void SetFrustumCulling(bool state);
+    bool IsFrustumCulling();
+    // Meshes with more triangles than this get a LOD chain at load; 0 turns that off
+    void SetAutoLODTriangles(uint32_t numTriangles);
+    // Largest screen space error, in pixels, a level of detail may have to be picked
+    void SetLODThreshold(float pixels);
+    float GetLODThreshold();
+    // Meshes with more triangles than this are split into culling clusters at load; 0 turns that off
+    void SetAutoClusterTriangles(uint32_t numTriangles);
+    // Backface culling of whole clusters by their normal cones. Off by default: the viewer draws
+    // double sided, so it is only right for closed meshes.
+    void SetClusterConeCulling(bool state);
+    bool IsClusterConeCulling();
+    // Clusters drawn and skipped by the last Render
+    uint32_t GetNumClustersDrawn();
+    uint32_t GetNumClustersCulled();
+    // Submesh draws issued and skipped by the last Render
+    uint32_t GetNumDrawn();
+    uint32_t GetNumCulled();
+    // Static meshes are merged into shared batches (see RenderQueue); everything else is drawn sorted by
+    // shader, texture and VAO so consecutive draws skip the binds they share
+    void SetStaticBatching(bool state);
+    bool IsStaticBatching();
+    uint32_t GetNumBatchedMeshes();
+    // Shader, texture and VAO binds, and draw calls, issued by the last Render
+    uint32_t GetNumStateChanges();
+    uint32_t GetNumDrawCalls();
+    // Plays a baked sim cache (see SimCacheWriter) on a model instead of simulating it: every Render advances
+    // one frame and decodes it straight into the model's positions. The cache must match the vertex count.
+    bool PlaySimCache(const std::string& file_path, const int model_id);
+    void StopSimCache();
+    bool HasSimCache();
+    uint32_t GetSimCacheNumFrames();
+    // Scrubbing: any frame is ready within one chunk of decoding
+    void SetSimCacheFrame(uint32_t frame);
+    uint32_t GetSimCacheFrame();
+    void SetSimCachePaused(bool state);
+    bool IsSimCachePaused();
+    // Resizes the render area (window framebuffer or offscreen target) and updates the camera to match
+    void SetViewportSize(unsigned int width, unsigned int height);
+    unsigned int SCR_WIDTH;
+    unsigned int SCR_HEIGHT;
     const char* title;
     float MIX_VALUE;
     float TIME_STATE_MULT;
@@ -43,6 +105,38 @@ private:
     GLuint m_gridVBO = 0;
     std::vector<Eigen::Vector3f> m_gridVerts;
     std::shared_ptr<Shader> gridShader;
+    ResourceCache<Mesh> m_meshCache;
+    std::unique_ptr<AssetLoader> m_loader;
+    double m_uploadBudgetMs = 2.0;
     bool m_doGrid = true;
     bool m_doWire = true;
+    bool m_doCulling = true;
+    uint32_t m_autoLODTriangles = 20000;
+    float m_lodThresholdPx = 1.0f;
+    uint32_t m_autoClusterTriangles = 20000;
+    bool m_doConeCulling = false;
+    uint32_t m_numClustersDrawn = 0;
+    uint32_t m_numClustersCulled = 0;
+    // CPU side post-processing of a freshly parsed mesh; static so loader threads can run it too
+    static void PrepareMesh(Mesh& mesh, uint32_t autoLODTriangles, uint32_t autoClusterTriangles);
+    void SelectLOD(Mesh& mesh);
+    uint32_t m_numDrawn = 0;
+    uint32_t m_numCulled = 0;
+    RenderQueue m_renderQueue;
+    RenderState m_renderState;
+    bool m_doBatching = true;
+    // Sort key and mesh of every draw that survived culling, reused across frames
+    std::vector<std::pair<uint64_t, Mesh*>> m_drawList;
+    std::unique_ptr<SimCacheReader> m_simCache;
+    std::shared_ptr<Mesh> m_simCacheMesh;
+    uint32_t m_simCacheFrame = 0;
+    int64_t m_simCacheShown = -1;
+    // Frame asked for by SetSimCacheFrame, applied by the next UpdateSimCache in place of advancing
+    int64_t m_simCacheScrub = -1;
+    bool m_simCachePaused = false;
+    void UpdateSimCache();
+    Eigen::Vector3f m_wireColor = Eigen::Vector3f::Ones();
+    // Uniform buffer behind the FrameData block every shader shares (see Shader::FRAME_DATA_BINDING)
+    GLuint m_frameUBO = 0;
+    void UpdateFrameData(const Eigen::Matrix4f& viewMtx);
 };
\ No newline at end of file
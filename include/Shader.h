@@ -6,6 +6,8 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <unordered_map>
+#include <algorithm>
 
 class Shader
 {
@@ -59,7 +61,7 @@ public:
         errorHandler(vertexShader, "PROGRAM");
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
-
+        reflectUniforms();
 	}
 
     Shader(const char* vertexShaderPath, const char* fragShaderPath, const char* geomShaderPath)
@@ -124,10 +126,15 @@ public:
         errorHandler(vertexShader, "PROGRAM");
         glDeleteShader(vertexShader);
         glDeleteShader(fragmentShader);
-
+        reflectUniforms();
     }
     ~Shader(){};
     unsigned int ID;
+    // Uniform buffer binding point of the std140 FrameData block (camera, light and wireframe state), see Scene::Render
+    static const GLuint FRAME_DATA_BINDING = 0;
+    // Uniforms set for every object drawn; resolved once at link time so the draw loops index a table
+    // instead of building and hashing a string per call
+    enum ObjectUniform { U_MVP, U_MV, U_NORMAL_MTX, U_GPU_NORMALS, U_INSTANCED, NUM_OBJECT_UNIFORMS };
     void use() {
         glUseProgram(ID);
     }
@@ -135,25 +142,80 @@ public:
         glDeleteProgram(ID);
     }
 
+    // Locations come from the table built at link time, so setting a uniform never round-trips to the driver.
+    // Unknown names map to -1, which GL silently ignores - same as glGetUniformLocation did.
+    GLint getUniformLocation(const std::string& name) const
+    {
+        auto it = m_uniformLocations.find(name);
+        return it != m_uniformLocations.end() ? it->second : -1;
+    }
+    GLint getUniformLocation(ObjectUniform uniform) const
+    {
+        return m_objectUniforms[uniform];
+    }
     void setBool(const std::string& name, bool value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), (int)value);
+        setBool(getUniformLocation(name), value);
+    }
+    void setBool(GLint location, bool value) const
+    {
+        glUniform1i(location, (int)value);
     }
     void setInt(const std::string& name, int value) const
     {
-        glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1i(getUniformLocation(name), value);
     }
     void setFloat(const std::string& name, float value) const
     {
-        glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+        glUniform1f(getUniformLocation(name), value);
     }
     void setMat4(const std::string& name, const float *value) const
     {
-        glUniformMatrix4fv( glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, value);
+        setMat4(getUniformLocation(name), value);
+    }
+    void setMat4(GLint location, const float* value) const
+    {
+        glUniformMatrix4fv(location, 1, GL_FALSE, value);
     }
     void setVec3(const std::string& name, const float* value) const
     {
-        glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, value);
+        glUniform3fv(getUniformLocation(name), 1, value);
+    }
+
+    void reflectUniforms()
+    {
+        m_uniformLocations.clear();
+        GLint count = 0, maxLength = 0;
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+        glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+        std::vector<char> name(std::max(maxLength, 1));
+        for (GLint i = 0; i < count; i++)
+        {
+            GLsizei length = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(ID, GLuint(i), GLsizei(name.size()), &length, &size, &type, name.data());
+            std::string uniformName(name.data(), length);
+            // Block members have no location, they are fed through their uniform buffer
+            GLint location = glGetUniformLocation(ID, uniformName.c_str());
+            if (location < 0) continue;
+            m_uniformLocations[uniformName] = location;
+            // Arrays are reported as "name[0]", but are usually set by their bare name
+            if (uniformName.size() > 3 && uniformName.compare(uniformName.size() - 3, 3, "[0]") == 0)
+            {
+                m_uniformLocations[uniformName.substr(0, uniformName.size() - 3)] = location;
+            }
+        }
+        static const char* const objectUniformNames[NUM_OBJECT_UNIFORMS] = { "MVP", "MV", "NormalMtx", "gpuNormals", "instanced" };
+        for (int i = 0; i < NUM_OBJECT_UNIFORMS; i++)
+        {
+            m_objectUniforms[i] = getUniformLocation(objectUniformNames[i]);
+        }
+        GLuint frameBlock = glGetUniformBlockIndex(ID, "FrameData");
+        if (frameBlock != GL_INVALID_INDEX)
+        {
+            glUniformBlockBinding(ID, frameBlock, FRAME_DATA_BINDING);
+        }
     }
 
     void errorHandler(unsigned int shader, std::string type)
@@ -178,4 +240,8 @@ public:
             }
         }
     }
+
+private:
+    std::unordered_map<std::string, GLint> m_uniformLocations;
+    GLint m_objectUniforms[NUM_OBJECT_UNIFORMS] = { -1, -1, -1, -1, -1 };
 };
\ No newline at end of file
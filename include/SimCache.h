@@ -0,0 +1,136 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// On-disk format and frame codec of the simulation cache (see SimCacheWriter / SimCacheReader).
+//
+// File layout, all little endian:
+//   FileHeader
+//   frame records, grouped in chunks that each start with a keyframe
+//   IndexEntry per frame
+//   Footer
+// A record is a FrameHeader, then for keyframes one Grid per channel, then the payload. Records can also be
+// walked front to back without the index, so a file whose writer died before writing the footer still plays.
+//
+// Every channel (positions, and optionally velocities) is quantized onto a per-chunk grid stored in the
+// keyframe: the keyframe's own range grown by a margin, so the motion in the following frames stays on it.
+// A frame that leaves the grid simply starts a new chunk. Residuals are taken against a prediction on the
+// quantized values, so the error never accumulates: keyframes predict each value from the previous vertex,
+// delta frames extrapolate linearly from the two frames before. Residuals are zigzag varint coded and,
+// when that makes the frame smaller, rANS coded on top.
+namespace SimCache
+{
+	const char FILE_MAGIC[8] = { 'D', 'K', 'S', 'I', 'M', 'C', 'H', '1' };
+	const char FOOTER_MAGIC[4] = { 'D', 'K', 'I', 'X' };
+	const uint32_t VERSION = 1;
+
+	enum FileFlags : uint32_t
+	{
+		HAS_VELOCITIES = 1
+	};
+	enum FrameFlags : uint32_t
+	{
+		KEYFRAME = 1,
+		ENTROPY_CODED = 2
+	};
+
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t flags;
+		uint32_t numVerts;
+		uint32_t keyframeInterval;
+		uint32_t positionBits;
+		uint32_t velocityBits;
+		float timeStep;
+		uint32_t reserved[7];
+	};
+	struct FrameHeader
+	{
+		uint32_t frameIndex;
+		uint32_t flags;
+		uint32_t payloadSize;
+		// Size of the varint stream before entropy coding
+		uint32_t rawSize;
+	};
+	// value = min + q * step, per axis
+	struct Grid
+	{
+		float min[3];
+		float step[3];
+	};
+	struct IndexEntry
+	{
+		uint64_t offset;
+		uint32_t size;
+		uint32_t flags;
+	};
+	struct Footer
+	{
+		uint64_t indexOffset;
+		uint32_t numFrames;
+		char magic[4];
+	};
+	static_assert(sizeof(FileHeader) == 64 && sizeof(FrameHeader) == 16 && sizeof(Grid) == 24 &&
+		sizeof(IndexEntry) == 16 && sizeof(Footer) == 16, "SimCache structs are written to disk as-is");
+
+	// Size of a whole record given its header
+	size_t recordSize(const FrameHeader& header, int numChannels);
+
+	// Byte-wise static rANS with a 12 bit frequency table, stored sparsely in front of the data.
+	// decode returns false on malformed input.
+	void ransEncode(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+	bool ransDecode(const uint8_t* data, size_t size, uint8_t* out, size_t outSize);
+
+	// Turns frames (numChannels arrays of 3 * numVerts floats) into records. Stateful: each frame is
+	// predicted from the ones before it.
+	class FrameEncoder
+	{
+	public:
+		FrameEncoder(uint32_t numVerts, int numChannels, const uint32_t bits[2], uint32_t keyframeInterval, bool entropyCoding);
+		// Appends the record of the next frame to out. Returns the frame flags (KEYFRAME if it started a chunk).
+		uint32_t encode(const float* const* channels, std::vector<uint8_t>& out);
+		// Whether the next frame will be a keyframe on account of the interval (it can also become one by
+		// leaving the grid)
+		bool nextIsKeyframe() const;
+		uint32_t getNumFrames() const { return m_frameIndex; }
+
+	private:
+		uint32_t m_numVerts;
+		int m_numChannels;
+		uint32_t m_bits[2];
+		uint32_t m_keyframeInterval;
+		bool m_entropyCoding;
+		uint32_t m_frameIndex = 0;
+		uint32_t m_framesSinceKey = 0;
+		Grid m_grids[2];
+		// Quantized values of the last two frames, all channels back to back
+		std::vector<int32_t> m_prev, m_prev2, m_current;
+		std::vector<uint8_t> m_varints;
+		std::vector<uint8_t> m_entropy;
+	};
+
+	// The reverse. Delta frames can only be decoded right after the frame before them, so random access
+	// means decoding forward from the closest keyframe at or before the wanted frame.
+	class FrameDecoder
+	{
+	public:
+		FrameDecoder(uint32_t numVerts, int numChannels);
+		// channels receives 3 * numVerts floats per channel; entries may be null to skip a channel
+		bool decode(const uint8_t* record, size_t size, float* const* channels);
+		// Frame index of the last successful decode, or -1
+		int64_t getLastFrame() const { return m_lastFrame; }
+		void reset() { m_lastFrame = -1; }
+
+	private:
+		uint32_t m_numVerts;
+		int m_numChannels;
+		int64_t m_lastFrame = -1;
+		uint32_t m_framesSinceKey = 0;
+		Grid m_grids[2];
+		std::vector<int32_t> m_prev, m_prev2, m_current;
+		std::vector<uint8_t> m_varints;
+	};
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <future>
+#include <atomic>
+#include "SimCache.h"
+#include "ThreadPool.h"
+
+// Plays back a sim-cache file (see SimCacheWriter). The file is memory mapped and frames are decoded on
+// demand; any frame is reached by decoding forward from the keyframe before it, so scrubbing costs at most
+// one chunk of decoding, however long the cache is. prefetch() decodes the frames ahead of the playhead on
+// a worker thread of its own, so steady playback only copies out of the decoded-frame cache.
+class SimCacheReader
+{
+public:
+	SimCacheReader() = default;
+	~SimCacheReader();
+	SimCacheReader(const SimCacheReader&) = delete;
+	SimCacheReader& operator=(const SimCacheReader&) = delete;
+
+	// Files without a frame index (writer killed mid-run) are indexed by walking their records
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const { return m_data != nullptr; }
+	uint32_t getNumFrames() const { return uint32_t(m_index.size()); }
+	uint32_t getNumVerts() const { return m_header.numVerts; }
+	float getTimeStep() const { return m_header.timeStep; }
+	bool hasVelocities() const { return (m_header.flags & SimCache::HAS_VELOCITIES) != 0; }
+
+	// positions and velocities hold 3 * getNumVerts() floats; velocities may be null, and is zeroed if
+	// the cache has none
+	bool readFrame(uint32_t frame, float* positions, float* velocities = nullptr);
+	// Starts decoding [frame, frame + count) in the background, unless a prefetch is already running or
+	// the last one still covers more than half of that window. Cheap enough to call every frame.
+	void prefetch(uint32_t frame, uint32_t count);
+
+private:
+	struct Decoded
+	{
+		uint32_t frame;
+		std::vector<float> data; // positions, then velocities if any
+	};
+	bool buildIndex();
+	uint32_t keyframeBefore(uint32_t frame) const;
+	// Decodes frame into data with decoder, continuing from where the decoder stopped when that is on the way
+	bool decodeFrame(SimCache::FrameDecoder& decoder, uint32_t frame, std::vector<float>& data);
+	bool findCached(uint32_t frame, float* positions, float* velocities);
+	void storeCached(uint32_t frame, const std::vector<float>& data);
+
+	const uint8_t* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	void* m_fileHandle = nullptr;
+	void* m_mappingHandle = nullptr;
+#else
+	int m_fd = -1;
+#endif
+	SimCache::FileHeader m_header = {};
+	int m_numChannels = 1;
+	std::vector<SimCache::IndexEntry> m_index;
+	std::unique_ptr<SimCache::FrameDecoder> m_decoder;
+	std::unique_ptr<SimCache::FrameDecoder> m_prefetchDecoder;
+	std::vector<float> m_scratch;
+	// Decoded frames, oldest first, shared with the prefetch task
+	std::mutex m_cacheMutex;
+	std::deque<Decoded> m_cache;
+	size_t m_cacheCapacity = 64;
+	std::future<void> m_prefetch;
+	uint32_t m_prefetchBegin = 0;
+	uint32_t m_prefetchEnd = 0;
+	std::atomic<bool> m_cancel{ false };
+	// Last, so it is joined before anything the prefetch task touches goes away
+	ThreadPool m_prefetchWorker{ 1 };
+};
@@ -0,0 +1,71 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstdio>
+#include "SimCache.h"
+
+// Records a simulation to a sim-cache file (format in SimCache.h), one appendFrame per solver step.
+// appendFrame only copies the frame into one of a few reusable buffers; quantizing, coding and writing all
+// happen on a dedicated I/O thread, which writes a whole chunk at a time. When the I/O thread falls behind,
+// appendFrame waits for a free buffer, so memory stays bounded on arbitrarily long runs.
+class SimCacheWriter
+{
+public:
+	struct Options
+	{
+		// Frames per chunk; scrubbing decodes at most this many frames
+		uint32_t keyframeInterval = 30;
+		uint32_t positionBits = 16;
+		uint32_t velocityBits = 12;
+		bool velocities = false;
+		bool entropyCoding = true;
+		// Frames that may wait for the I/O thread before appendFrame blocks
+		size_t maxQueuedFrames = 8;
+	};
+
+	SimCacheWriter() = default;
+	~SimCacheWriter();
+	SimCacheWriter(const SimCacheWriter&) = delete;
+	SimCacheWriter& operator=(const SimCacheWriter&) = delete;
+
+	// timeStep is stored for playback
+	bool open(const std::string& path, uint32_t numVerts, float timeStep, const Options& options);
+	bool open(const std::string& path, uint32_t numVerts, float timeStep) { return open(path, numVerts, timeStep, Options()); }
+	// positions (and velocities, if recording them) are 3 * numVerts floats
+	bool appendFrame(const float* positions, const float* velocities = nullptr);
+	// Writes out everything queued, then the frame index. Returns false if any write failed.
+	bool close();
+	bool isOpen() const { return m_thread.joinable(); }
+	// Frames handed to appendFrame so far
+	uint32_t getNumFrames() const { return m_numAppended; }
+	uint64_t getBytesWritten() const { return m_bytesWritten; }
+
+private:
+	void ioLoop();
+	bool flushChunk();
+
+	Options m_options;
+	uint32_t m_numVerts = 0;
+	size_t m_frameFloats = 0;
+	FILE* m_file = nullptr;
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_queueCV;
+	std::condition_variable m_freeCV;
+	std::deque<std::vector<float>> m_queue;
+	std::vector<std::vector<float>> m_free;
+	size_t m_numBuffers = 0;
+	bool m_closing = false;
+	uint32_t m_numAppended = 0;
+	// I/O thread only
+	std::vector<uint8_t> m_chunk;
+	std::vector<SimCache::IndexEntry> m_index;
+	uint64_t m_chunkOffset = 0;
+	std::atomic<uint64_t> m_bytesWritten{ 0 };
+	std::atomic<bool> m_failed{ false };
+};
@@ -1,83 +1,286 @@
 #pragma once
 #include "Mesh.h"
+#include "SimCacheWriter.h"
+#include "SymbolicCache.h"
+#include "BlockSparseMatrix.h"
 #include "Eigen/SparseCore"
 #include "Eigen/SparseLU"
 #include "unsupported/Eigen/IterativeSolvers"
 #include <vector>
 #include <set>
+#include <memory>
 
-class SpringSolver {
+// The solver core is templated on its scalar type: float is the fast default, double keeps stiff setups
+// stable at larger steps. Both are instantiated in SpringSolver.cpp. Meshes always store float positions, so
+// a double solver keeps its own copy and writes the meshes back after each step.
+template <typename Scalar>
+class SpringSolverT {
 public:
+	typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+	typedef Eigen::Matrix<Scalar, 3, 1> Vector3;
+	typedef Eigen::Matrix<Scalar, 3, 3> Matrix3;
+	typedef Eigen::SparseMatrix<Scalar> SparseMatrix;
+	// a and b index the global vertex vector, so a spring can also join two different meshes
 	struct Spring
 	{
-		Spring(const Mesh::Edge& e) : edge(&e){}
-		const Mesh::Edge* edge;
-		float l0;
+		uint32_t a, b;
+		Scalar l0;
 	};
-	SpringSolver()
+	// A registered mesh: its vertices live at [vertexOffset, vertexOffset + numVerts) of the global vectors
+	struct Body
 	{
-		k = 30.0f;
-		dt = 0.001f;
-		mass = 1.0f;
-		beta_s = 0.05f;
-		beta_g = 0.005f;
-		globalScale = 1.0f;
+		std::shared_ptr<Mesh> mesh;
+		uint32_t vertexOffset;
+		uint32_t numVerts;
+		bool ownsPositions;
+		uint32_t island;
+	};
+	SpringSolverT()
+	{
+		k = Scalar(30.0f);
+		dt = Scalar(0.001f);
+		mass = Scalar(1.0f);
+		beta_s = Scalar(0.05f);
+		beta_g = Scalar(0.005f);
+		globalScale = Scalar(1.0f);
 		doSim = false;
 		doCollisions = false;
-		colTol = 0.01f;
+		colTol = Scalar(0.01f);
 		vIters = 20;
 		integrator = SolverType::IMPLICIT;
-		totalE = 0.0f;
+		totalE = Scalar(0.0f);
+		linearSolver = LinearSolverType::SPARSE_LU;
+		mixedPrecision = false;
+		maxRefinements = 4;
+		refinementTol = Scalar(1e-10);
+		maxIterations = 200;
+		iterativeTol = Scalar(1e-5);
+		maxNewtonIterations = 30;
+		newtonTol = Scalar(1e-3);
 		n = 0;
 	}
-	~SpringSolver() = default;
-	void accumulateForces();
-	void accumulatedFdX();
-	void accumulatedFdV();
+	~SpringSolverT() = default;
 	void step();
-	void sparseSetup();
 	void reset();
-	void symplecticSolver();
-	void implicitSolver();
-	bool setup(const std::shared_ptr<Mesh> m);
+	// With ownPositions the solver simulates a private copy of the positions and only reads the mesh
+	// (topology and rest shape), so many solvers can share one mesh across threads.
+	// Clears the system and registers m as its only body, with nothing pinned.
+	bool setup(const std::shared_ptr<Mesh> m, bool ownPositions = false);
+	// Same, with the given vertices of m held in place
+	bool setup(const std::shared_ptr<Mesh> m, const std::vector<uint32_t>& pinned, bool ownPositions = false);
+	// Registers another mesh in the same system and returns its body id. Each edge becomes a spring; pinned
+	// vertices (indices into the mesh) never move.
+	uint32_t addMesh(const std::shared_ptr<Mesh> m, const std::vector<uint32_t>& pinned, bool ownPositions = false);
+	// Couples two bodies with a spring between one vertex of each. A negative rest length takes the current
+	// distance. Bodies that are not coupled, directly or through others, are solved as separate islands in
+	// parallel, each with its own factorization; coupled ones share a system.
+	// Returns false for an unknown body or vertex.
+	bool addAttachment(uint32_t bodyA, uint32_t vertA, uint32_t bodyB, uint32_t vertB, Scalar restLength = Scalar(-1));
+	void clear();
 	void detectCollisions();
 	void addCollider(const std::shared_ptr<Mesh> m);
-	float k;
-	float dt;
-	float mass;
-	float beta_s;
-	float beta_g;
-	float totalE;
-	float globalScale;
+	// Every step from now on is appended to the recorder (nullptr stops recording)
+	void setRecorder(std::shared_ptr<SimCacheWriter> writer);
+	// Checkpoints hold the complete state (positions, velocities, spring rest lengths and order, masses and
+	// parameters), so stepping on from a restored checkpoint gives bit-identical results to never having
+	// stopped. Loading needs the same meshes, pinned vertices and attachments to have been registered first,
+	// and a solver of the same scalar type. Files are written under a temporary name and renamed, so a crash mid-save leaves
+	// the previous checkpoint intact.
+	void saveCheckpoint(std::vector<uint8_t>& out) const;
+	bool loadCheckpoint(const uint8_t* data, size_t size);
+	bool saveCheckpoint(const std::string& path) const;
+	bool loadCheckpoint(const std::string& path);
+	const std::shared_ptr<SimCacheWriter>& getRecorder() const { return recorder; }
+	uint32_t getNumVerts() const { return n; }
+	const std::vector<Body>& getBodies() const { return bodies; }
+	uint32_t getNumIslands() const { return uint32_t(islands.size()); }
+	Eigen::Map<const Vector> getPositions() const { return Eigen::Map<const Vector>(currPos.data(), currPos.size()); }
+	// Largest relative elongation l / l0 - 1 over all springs
+	Scalar getMaxStretch() const;
+	// Iterations the iterative solvers took in the last step (the last Newton iteration's, for NEWTON), the
+	// most over all islands. maxIterations means some island stopped short of iterativeTol
+	uint32_t getLastIterations() const;
+	uint32_t getLastNewtonIterations() const;
+	Scalar k;
+	Scalar dt;
+	Scalar mass;
+	Scalar beta_s;
+	Scalar beta_g;
+	Scalar totalE;
+	Scalar globalScale;
 	bool doSim;
 	bool doCollisions;
-	float colTol;
+	Scalar colTol;
+	// IMPLICIT takes one linearized backward Euler step. NEWTON minimizes the backward Euler incremental
+	// potential instead: each iteration solves the linearized system at the current iterate with the chosen
+	// linearSolver, then backtracks along it until the potential decreases enough. It stops once a step moves
+	// the velocities by less than newtonTol, or after maxNewtonIterations, and stays stable at steps many
+	// times larger than IMPLICIT can take.
 	enum SolverType
 	{
 		SYMPLECTIC,
-		IMPLICIT
+		IMPLICIT,
+		NEWTON
 	};
 	int integrator;
-	uint16_t vIters;
+	uint32_t maxNewtonIterations;
+	Scalar newtonTol;
+	uint32_t vIters;
+	// How implicit steps solve their system. LDLT is a symmetric factorization with an AMD ordering, about
+	// half the work of SPARSE_LU. The system is only symmetric without the part of the spring damping
+	// derivative that depends on the relative velocity, so LDLT leaves that term out, as Baraff & Witkin do.
+	// Its symbolic analysis runs once per topology, and the AMD ordering, the costly part of it, is kept in
+	// SymbolicCache so the next start skips that too.
+	// The BLOCK_ solvers are iterative and never factorize: the system is assembled as a BlockSparseMatrix3
+	// of 3x3 vertex blocks and solved with block Jacobi preconditioning, warm started from the previous step.
+	// BLOCK_CG needs the symmetric system, so like LDLT it leaves out the relative velocity damping term, and
+	// a positive definite one, so it also drops the negative transverse stiffness of compressed springs;
+	// BLOCK_BICGSTAB solves the full system. They stop at iterativeTol relative to the right hand side, or
+	// after maxIterations.
+	// MATRIX_FREE_CG runs the same CG without ever forming the system: each product is gathered per vertex from
+	// one 3x3 block per spring, so memory stays linear in the vertices and springs and very large cloths fit.
+	enum LinearSolverType
+	{
+		SPARSE_LU,
+		LDLT,
+		BLOCK_CG,
+		BLOCK_BICGSTAB,
+		MATRIX_FREE_CG
+	};
+	int linearSolver;
+	uint32_t maxIterations;
+	Scalar iterativeTol;
+	// Implicit solves factorize a float copy of the system and then refine the solution with residuals taken
+	// in Scalar precision, until the residual drops below refinementTol relative to the right hand side or
+	// maxRefinements rounds have run. Float factorizations are about twice as fast and half the memory. Has no
+	// effect on a float solver or the iterative solvers.
+	bool mixedPrecision;
+	uint32_t maxRefinements;
+	Scalar refinementTol;
 
 private:
-	std::shared_ptr<Mesh> _mesh;
+	// A set of coupled bodies. Its vertices and springs are contiguous in the global vectors, so it is solved
+	// on segments of them, independently of every other island.
+	struct Island
+	{
+		uint32_t index;
+		uint32_t firstVertex, numVerts;
+		uint32_t firstSpring, numSprings;
+		Scalar energy = Scalar(0);
+		// Only the direct solvers use LHS, which gets its pattern on first use
+		SparseMatrix LHS;
+		bool patternReady = false;
+		Eigen::SparseLU<SparseMatrix> lu;
+		bool analyzed = false;
+		CachedLDLT<SparseMatrix> ldlt;
+		bool ldltAnalyzed = false;
+		// Float copy of LHS for mixedPrecision
+		Eigen::SparseMatrix<float> lowLHS;
+		Eigen::SparseLU< Eigen::SparseMatrix<float> > lowLu;
+		bool lowAnalyzed = false;
+		CachedLDLT< Eigen::SparseMatrix<float> > lowLdlt;
+		bool lowLdltAnalyzed = false;
+		// Block form of LHS for the BLOCK_ solvers, built on first use
+		BlockSparseMatrix3<Scalar> blockLHS;
+		BlockJacobi<Scalar> blockJacobi;
+		// Per spring, the blocks it adds to: (a, a), (b, b), (a, b), (b, a)
+		std::vector<uint32_t> springBlocks;
+		bool blocksReady = false;
+		uint32_t iterations = 0;
+		// MATRIX_FREE_CG: one block per spring, the springs of each vertex, and the diagonal blocks
+		std::vector<Matrix3> springHessians;
+		std::vector<uint32_t> vertexSpringStart;
+		std::vector<uint32_t> vertexSprings;
+		// Whether each spring has a pinned end
+		std::vector<uint8_t> springPinned;
+		bool adjacencyReady = false;
+		std::vector<Matrix3> diagonalBlocks;
+		// NEWTON: the state at the start of the step, and the spring directions the damping acts along
+		Vector startPos, startVel;
+		std::vector<Vector3> startDirections;
+		uint32_t newtonIterations = 0;
+	};
+	// The system of an island as an operator for Krylov::conjugateGradient
+	struct MatrixFreeOperator
+	{
+		const SpringSolverT& solver;
+		const Island& island;
+		void multiply(const Vector& x, Vector& y) const { solver.multiplySystem(island, x, y); }
+	};
+	void accumulateForces(Island& island);
+	void accumulatedFdX(Island& island);
+	void accumulatedFdV(Island& island);
+	void buildPattern(const Island& island, SparseMatrix& LHS) const;
+	// Drops the systems of an island after its springs changed; they are rebuilt on first use
+	void resetSystem(Island& island);
+	void blockSetup(Island& island);
+	void addSpringBlock(Island& island, uint32_t s, const Matrix3& K);
+	void adjacencySetup(Island& island);
+	void computeSpringBlocks(Island& island);
+	void multiplySystem(const Island& island, const Vector& x, Vector& y) const;
+	bool usesBlocks() const { return linearSolver == LinearSolverType::BLOCK_CG || linearSolver == LinearSolverType::BLOCK_BICGSTAB; }
+	// Whether the solve needs a symmetric LHS
+	bool symmetricSystem() const
+	{
+		return linearSolver == LinearSolverType::LDLT || linearSolver == LinearSolverType::BLOCK_CG || linearSolver == LinearSolverType::MATRIX_FREE_CG;
+	}
+	void symplecticSolver(Island& island);
+	void implicitSolver(Island& island);
+	void newtonSolver(Island& island);
+	// Incremental potential at step velocity v over dt^2, and the force at the matching positions
+	Scalar newtonObjective(const Island& island, const Vector& v, Vector& force) const;
+	// Fills the island's system for the current positions and velocities, and solves it for dv
+	void assembleSystem(Island& island);
+	void solveSystem(Island& island, const Vector& RHS);
+	// Factor of the spring stiffness across the spring direction
+	Scalar transverseStiffness(Scalar l, Scalar l0) const;
+	// Added to the mass on the diagonal of the system
+	Scalar drag() const;
+	// Factor on the spring stiffness and damping blocks of the system
+	Scalar hessianScale() const;
+	void decouplePinned(Island& island);
+	bool isPinned(uint32_t vertex) const;
+	void solveMixed(Island& island, const Vector& rhs, Eigen::Ref<Vector> x);
+	// v holds the vertices from firstVertex on
+	void zeroPinned(const Island& island, Eigen::Ref<Vector> v, uint32_t firstVertex = 0) const;
+	// Regroups the bodies into islands and moves the state to the new layout
+	void rebuildLayout(const Vector& positions);
+	// Copies the positions back into meshes whose storage is not aliased
+	void syncMeshes();
+	// Whether currPos aliases the storage of the only body
+	bool aliasesMesh() const;
+
+	std::vector<Body> bodies;
+	std::vector<std::unique_ptr<Island>> islands;
 	std::vector<std::shared_ptr<Mesh>> colliders;
 	std::vector<Spring> springs;
-	Eigen::VectorXf currPos;
-	Eigen::VectorXf lastPos;
-	Eigen::VectorXf defaultPos;
-	Eigen::VectorXf currVel;
-	Eigen::VectorXf lastVel;
-	Eigen::VectorXf F;
-	Eigen::MatrixXf M;
-	Eigen::MatrixXf M_inv;
-	Eigen::MatrixXf dFdX;
-	Eigen::MatrixXf dFdV;
-	Eigen::VectorXf dv;
-	Eigen::SparseMatrix<float> LHS;
-	Eigen::SparseLU< Eigen::SparseMatrix<float> > lu;
-	Eigen::BiCGSTAB<Eigen::SparseMatrix<float>, Eigen::IncompleteLUT<float>> bicg;
-	bool analyzed = false;
-	uint16_t n;
-};
\ No newline at end of file
+	// Global vertex ids, sorted
+	std::vector<uint32_t> pinned;
+	std::shared_ptr<SimCacheWriter> recorder;
+	// Float copies handed to the recorder by solvers of other scalar types
+	Eigen::VectorXf recordPos, recordVel;
+	// With a single float body that does not own its positions this aliases the mesh position storage (see
+	// Mesh::MapPositions), so every update lands in the mesh directly. Otherwise it maps ownedPos.
+	Eigen::Map<Vector> currPos{ nullptr, 0 };
+	Vector ownedPos;
+	Vector lastPos;
+	Vector defaultPos;
+	Vector currVel;
+	Vector lastVel;
+	Vector F;
+	// Lumped masses, stored as the diagonal only so memory stays linear in the vertex count
+	Vector M;
+	Vector M_inv;
+	Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> dFdX;
+	Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> dFdV;
+	Vector dv;
+	// Identifies the LHS sparsity patterns, which is all the LU symbolic analysis depends on
+	uint64_t patternHash() const;
+	uint32_t n;
+};
+
+extern template class SpringSolverT<float>;
+extern template class SpringSolverT<double>;
+
+typedef SpringSolverT<float> SpringSolver;
+typedef SpringSolverT<double> SpringSolverD;
@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include "ThreadPool.h"
+
+class Mesh;
+template <typename Scalar>
+class SpringSolverT;
+
+// Runs many independent cloth simulations over one mesh, one per point of a parameter grid, spread over the
+// thread pool. The mesh is only read: every run gets its own SpringSolver that simulates a private copy of the
+// positions (see SpringSolver::setup), created when the run starts and freed when it ends, so runs share
+// nothing writable and memory stays at one solver per thread however large the sweep is.
+class SweepRunner
+{
+public:
+	// Scalar type a run is solved in. MIXED is a double solver that factorizes in float and refines the
+	// result in double (see SpringSolverT::mixedPrecision), so sweeping it next to the pure modes compares
+	// their cost and stability on the same parameters.
+	enum Precision
+	{
+		FLOAT,
+		DOUBLE,
+		MIXED
+	};
+	struct Parameters
+	{
+		float k;
+		float beta_s;
+		float beta_g;
+		float mass;
+		float dt;
+		Precision precision = FLOAT;
+	};
+	// Values to try per parameter; an empty list keeps the solver default
+	struct Grid
+	{
+		std::vector<float> k, beta_s, beta_g, mass, dt;
+		std::vector<Precision> precision;
+	};
+	struct Result
+	{
+		Parameters params;
+		uint32_t steps = 0;
+		// Spring energy after the last step
+		float energy = 0.0f;
+		// Peak l / l0 - 1 over every spring and step
+		float maxStretch = 0.0f;
+		double wallMs = 0.0;
+		// False if the run blew up (non-finite positions); it stops at that step
+		bool stable = true;
+	};
+
+	explicit SweepRunner(std::shared_ptr<Mesh> cloth, ThreadPool& pool = ThreadPool::global());
+	// Colliders are shared by all runs and only read
+	void addCollider(std::shared_ptr<Mesh> collider);
+	// Vertices of the cloth held in place in every run
+	void setPinned(const std::vector<uint32_t>& pinned);
+
+	// Every combination of the grid values, k varying slowest and precision fastest, so the precisions of one
+	// parameter set end up next to each other
+	static std::vector<Parameters> expandGrid(const Grid& grid);
+	// "k=10,30,50 dt=0.001:0.01:4 precision=float,mixed" - comma separated values, or first:last:count for an
+	// even range. Precisions are float, double or mixed.
+	static bool parseGrid(const std::string& spec, Grid& grid);
+	static const char* precisionName(Precision precision);
+
+	// Blocks until every run is done. progress, if given, is called from the worker threads.
+	std::vector<Result> run(const std::vector<Parameters>& points, uint32_t numSteps,
+		std::function<void(size_t done, size_t total)> progress = nullptr);
+	// Makes run() skip the runs that have not started yet
+	void cancel() { m_cancel = true; }
+
+	static bool writeCSV(const std::string& path, const std::vector<Result>& results);
+
+private:
+	Result runOne(const Parameters& params, uint32_t numSteps) const;
+	template <typename Scalar>
+	void simulate(SpringSolverT<Scalar>& solver, uint32_t numSteps, Result& result) const;
+	std::shared_ptr<Mesh> m_cloth;
+	std::vector<std::shared_ptr<Mesh>> m_colliders;
+	std::vector<uint32_t> m_pinned;
+	ThreadPool& m_pool;
+	std::atomic<bool> m_cancel{ false };
+};
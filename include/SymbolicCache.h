@@ -0,0 +1,98 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Eigen/SparseCore"
+#include "Eigen/SparseCholesky"
+
+// On-disk cache of the fill-reducing (AMD) ordering of sparse LDLT factorizations. It only depends on the
+// sparsity pattern and is by far the most expensive part of the symbolic analysis, so it is computed once per
+// topology and every later factorization of that pattern, in this run or the next, skips it.
+namespace SymbolicCache
+{
+	struct Analysis
+	{
+		// Inverse permutation as returned by the ordering
+		std::vector<int> ordering;
+	};
+
+	// Files are named by the hash of the pattern, so a changed topology never hits a stale entry. Defaults to a
+	// folder in the system temp directory.
+	void setCacheDirectory(const std::string& dir);
+	std::string getCachePath(uint64_t patternHash);
+	// Written under a randomized temporary name and renamed, so concurrent writers of the same pattern are
+	// safe, across threads and across processes sharing the folder.
+	bool write(const std::string& path, uint64_t patternHash, const Analysis& analysis);
+	// Fails on a missing or damaged file, or one for another pattern or size
+	bool read(const std::string& path, uint64_t patternHash, size_t size, Analysis& analysis);
+}
+
+// Sparse LDLT of the lower triangle with an AMD ordering that can be taken out and put back, so it can go
+// through SymbolicCache instead of being recomputed. The ordering lives here, not in Eigen: the matrix is
+// permuted before Eigen sees it, and Eigen runs with NaturalOrdering on the (upper stored) permuted copy,
+// which it then uses in place. Nothing but Eigen's public API is touched.
+template <typename MatrixType>
+class CachedLDLT
+{
+public:
+	typedef typename MatrixType::Scalar Scalar;
+	typedef typename MatrixType::StorageIndex StorageIndex;
+	typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+	void analyzePattern(const MatrixType& a)
+	{
+		// The ordering wants the full symmetric pattern
+		MatrixType full;
+		full = a.template selfadjointView<Eigen::Lower>();
+		Eigen::AMDOrdering<StorageIndex>()(full, m_Pinv);
+		m_P = m_Pinv.inverse();
+		permute(a);
+		m_ldlt.analyzePattern(m_permuted);
+	}
+
+	// Only valid after analyzePattern() or setSymbolic()
+	void getSymbolic(SymbolicCache::Analysis& out) const
+	{
+		const auto& ordering = m_Pinv.indices();
+		out.ordering.assign(ordering.data(), ordering.data() + ordering.size());
+	}
+
+	// Stands in for analyzePattern(a). The analysis must come from a matrix with the same pattern as a.
+	bool setSymbolic(const SymbolicCache::Analysis& in, const MatrixType& a)
+	{
+		if (in.ordering.size() != size_t(a.rows())) return false;
+		typedef Eigen::Matrix<StorageIndex, Eigen::Dynamic, 1> Indices;
+		m_Pinv.indices() = Eigen::Map<const Indices>(in.ordering.data(), Eigen::Index(in.ordering.size()));
+		m_P = m_Pinv.inverse();
+		permute(a);
+		m_ldlt.analyzePattern(m_permuted);
+		return m_ldlt.info() == Eigen::Success;
+	}
+
+	void factorize(const MatrixType& a)
+	{
+		permute(a);
+		m_ldlt.factorize(m_permuted);
+	}
+
+	Eigen::ComputationInfo info() const { return m_ldlt.info(); }
+
+	template <typename Rhs>
+	Vector solve(const Eigen::MatrixBase<Rhs>& b) const
+	{
+		Vector x = m_P * b;
+		x = m_ldlt.solve(x);
+		return m_Pinv * x;
+	}
+
+private:
+	void permute(const MatrixType& a)
+	{
+		m_permuted.resize(a.rows(), a.cols());
+		m_permuted.template selfadjointView<Eigen::Upper>() = a.template selfadjointView<Eigen::Lower>().twistedBy(m_P);
+	}
+
+	Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, StorageIndex> m_P, m_Pinv;
+	MatrixType m_permuted;
+	Eigen::SimplicialLDLT<MatrixType, Eigen::Upper, Eigen::NaturalOrdering<StorageIndex>> m_ldlt;
+};
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+struct TextureImage;
+
+// Block compression for textures, plus the on-disk cache of transcoded mip chains.
+// Formats by channel count: 1 -> BC4 (RGTC1), 2 -> BC5 (RGTC2), 3 -> BC1 (DXT1), 4 -> BC3 (DXT5).
+// The encoders are simple bounding-box / principal-axis fits: a lot faster than a real offline compressor
+// and a bit lower quality, which is fine for viewer textures. The result is cached, so it is paid once per file.
+namespace TextureCompression
+{
+	// S3TC is an extension, not core GL, so the tokens are not in glad's core header
+	const uint32_t FORMAT_BC1_RGB = 0x83F0;  // GL_COMPRESSED_RGB_S3TC_DXT1_EXT
+	const uint32_t FORMAT_BC3_RGBA = 0x83F3; // GL_COMPRESSED_RGBA_S3TC_DXT5_EXT
+	const uint32_t FORMAT_BC4_R = 0x8DBB;    // GL_COMPRESSED_RED_RGTC1
+	const uint32_t FORMAT_BC5_RG = 0x8DBD;   // GL_COMPRESSED_RG_RGTC2
+
+	uint32_t formatForChannels(int nChannels);
+	int channelsForFormat(uint32_t format);
+	size_t blockBytes(uint32_t format);
+	size_t compressedSize(uint32_t format, int width, int height);
+	// Encodes one tightly packed level with nChannels per pixel. Sizes need not be multiples of 4.
+	void compressLevel(const unsigned char* pixels, int width, int height, int nChannels, std::vector<unsigned char>& out);
+	// The reverse, for drivers without S3TC and for tests. Writes nChannels per pixel.
+	void decompressLevel(const unsigned char* blocks, int width, int height, uint32_t format, std::vector<unsigned char>& out);
+	// Compresses every level of a raw image in place
+	void compressImage(TextureImage& image);
+	void decompressImage(TextureImage& image);
+
+	// KTX 1.1 container holding a compressed mip chain
+	bool writeKTX(const std::string& path, const TextureImage& image);
+	bool readKTX(const std::string& path, TextureImage& image);
+	// Where the transcoded copy of a texture lives, named by its content hash so an edited source never hits
+	// a stale entry. Defaults to a folder in the system temp directory.
+	void setCacheDirectory(const std::string& dir);
+	std::string getCachePath(uint64_t contentHash, uint32_t format);
+}
@@ -1,16 +1,73 @@
 #pragma once
 #include <unordered_set>
+#include <unordered_map>
 #include <stack>
 #include <string>
+#include <vector>
+#include <cstdint>
+
+struct AssetKey;
+
+// CPU side texture payload: the base level followed by its full mip chain, tightly packed
+struct TextureImage
+{
+	int width = 0;
+	int height = 0;
+	int nChannels = 0;
+	// GL internal format of the levels when they hold compressed blocks, 0 for raw pixels
+	uint32_t compressedFormat = 0;
+	std::vector<std::vector<unsigned char>> levels;
+};
 
 class TextureManager
 {
 public:
-	TextureManager() {};
+	// Needs a current GL context, to check for S3TC support
+	TextureManager();
 	~TextureManager();
 
+	// Every successful call takes one reference. The same file (by canonical path and content hash) is only
+	// decoded and uploaded once; later calls hand back the same texture id.
 	bool loadTexture(const std::string& texture_path, unsigned int& id);
+	// The two halves of loadTexture, so decoding can run on a loader thread. decodeTexture touches no GL
+	// and no TextureManager state; uploadTexture must run on the GL thread and takes one reference.
+	// With compress set the result is block compressed (see TextureCompression.h) and comes from, or goes
+	// into, the on-disk transcode cache.
+	static bool decodeTexture(const std::string& texture_path, TextureImage& image, bool compress = false);
+	bool uploadTexture(const std::string& texture_path, const TextureImage& image, unsigned int& id);
+	// Same, with the key already computed by AssetHash::makeKey (on a loader thread), so the GL thread never
+	// hashes the file. An empty key.canonicalPath marks a file that could not be keyed; it is never shared.
+	bool uploadTexture(const std::string& texture_path, const AssetKey& key, const TextureImage& image, unsigned int& id);
+	// Takes a reference only if the texture is already resident. The path variant may have to hash the file.
+	bool acquireTexture(const std::string& texture_path, unsigned int& id);
+	bool acquireTexture(const AssetKey& key, unsigned int& id);
+	// One more reference to a texture the caller already holds one to
+	bool retainTexture(unsigned int id);
+	// Shared grey stand-in for textures that are still loading. Not reference counted.
+	unsigned int getPlaceholderTexture();
+	// Drops a reference taken by loadTexture. Unreferenced textures stay resident (so reloading is free)
+	// until the memory budget forces them out.
+	void releaseTexture(unsigned int id);
+	void setBudget(size_t bytes);
+	// Block compression for textures loaded from now on. On by default where the driver supports S3TC.
+	void setCompression(bool enable);
+	bool getCompression() const { return m_compress; }
+	size_t getResidentBytes() const { return m_bytes; }
 
 private:
-	std::vector<unsigned int> m_allTextureIDs;
-};
\ No newline at end of file
+	struct TextureEntry {
+		std::string key;
+		unsigned int refCount = 0;
+		size_t bytes = 0;
+		uint64_t lastUse = 0;
+	};
+	void evictUnused();
+	std::unordered_map<std::string, unsigned int> m_keyToId;
+	std::unordered_map<unsigned int, TextureEntry> m_textures;
+	size_t m_budget = 512ull << 20;
+	size_t m_bytes = 0;
+	uint64_t m_useCounter = 0;
+	unsigned int m_placeholderID = 0;
+	bool m_s3tcSupported = false;
+	bool m_compress = false;
+};
@@ -0,0 +1,56 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+// A small fixed-size worker pool. Shared by the CPU heavy bits of the viewer (normals, loading, sims)
+// so we never oversubscribe the machine with several ad-hoc thread sets.
+class ThreadPool
+{
+public:
+	// numThreads == 0 picks hardware_concurrency() - 1 workers (the caller of parallelFor is the last thread)
+	explicit ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Process wide pool, created on first use
+	static ThreadPool& global();
+	// Two workers for long, mostly I/O bound jobs (asset loading, cache prefetch), kept off global() so they
+	// never sit in front of the chunks of a render thread parallelFor
+	static ThreadPool& background();
+
+	template <typename F>
+	auto enqueue(F&& task) -> std::future<decltype(task())>
+	{
+		using Ret = decltype(task());
+		auto packaged = std::make_shared<std::packaged_task<Ret()>>(std::forward<F>(task));
+		std::future<Ret> result = packaged->get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.emplace_back([packaged]() { (*packaged)(); });
+		}
+		m_cv.notify_one();
+		return result;
+	}
+
+	// Splits [begin, end) into contiguous chunks of at least minChunk items and runs body(chunkBegin, chunkEnd)
+	// on the workers and the calling thread. Returns when every chunk is done. Safe to call from inside a task;
+	// the caller only helps with the chunks of this call, never with unrelated queued tasks.
+	void parallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)>& body, size_t minChunk = 1024);
+
+	unsigned int size() const { return static_cast<unsigned int>(m_workers.size()); }
+
+private:
+	void workerLoop();
+	std::vector<std::thread> m_workers;
+	std::deque<std::function<void()>> m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cv;
+	bool m_stop = false;
+};
@@ -1,6 +1,65 @@
 #include "AABB.h"
+#include <algorithm>
+#include <cmath>
 
-bool AABB::rayHit(Eigen::Vector2f& ray)
+void AABB::expand(const Eigen::Vector3f& point)
 {
-    return false;
+    min = min.cwiseMin(point);
+    max = max.cwiseMax(point);
+}
+
+void AABB::expand(const AABB& other)
+{
+    min = min.cwiseMin(other.min);
+    max = max.cwiseMax(other.max);
+}
+
+bool AABB::isEmpty() const
+{
+    return (min.array() > max.array()).any();
+}
+
+Eigen::Vector3f AABB::center() const
+{
+    return 0.5f * (min + max);
+}
+
+Eigen::Vector3f AABB::size() const
+{
+    return max - min;
+}
+
+AABB AABB::transformed(const Eigen::Matrix4f& mtx) const
+{
+    if (isEmpty()) return AABB();
+    // Arvo: the new half extents are |M| times the old ones, no need to transform all 8 corners
+    const Eigen::Matrix3f linear = mtx.block<3, 3>(0, 0);
+    const Eigen::Vector3f newCenter = linear * center() + mtx.block<3, 1>(0, 3);
+    const Eigen::Vector3f newHalf = linear.cwiseAbs() * (0.5f * size());
+    return AABB(newCenter - newHalf, newCenter + newHalf);
+}
+
+bool AABB::rayHit(const Eigen::Vector3f& origin, const Eigen::Vector3f& dir, float& tHit) const
+{
+    if (isEmpty()) return false;
+    float tNear = 0.0f;
+    float tFar = std::numeric_limits<float>::max();
+    for (int axis = 0; axis < 3; axis++)
+    {
+        if (std::abs(dir(axis)) < 1e-12f)
+        {
+            // Parallel to this slab, so we have to start inside it
+            if (origin(axis) < min(axis) || origin(axis) > max(axis)) return false;
+            continue;
+        }
+        const float invDir = 1.0f / dir(axis);
+        float t0 = (min(axis) - origin(axis)) * invDir;
+        float t1 = (max(axis) - origin(axis)) * invDir;
+        if (t0 > t1) std::swap(t0, t1);
+        tNear = std::max(tNear, t0);
+        tFar = std::min(tFar, t1);
+        if (tNear > tFar) return false;
+    }
+    tHit = tNear;
+    return true;
 }
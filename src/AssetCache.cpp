@@ -0,0 +1,75 @@
+#include "AssetCache.h"
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <cstdio>
+
+std::string AssetKey::str() const
+{
+	char hash[17];
+	std::snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)contentHash);
+	return canonicalPath + "#" + hash;
+}
+
+uint64_t AssetHash::hashBytes(const void* data, size_t size, uint64_t seed)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	uint64_t hash = seed;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+uint64_t AssetHash::hashFile(const std::string& path, bool& ok)
+{
+	std::ifstream file(path, std::ios::binary);
+	ok = static_cast<bool>(file);
+	uint64_t hash = 0xcbf29ce484222325ull;
+	std::vector<char> buffer(1 << 16);
+	while (file)
+	{
+		file.read(buffer.data(), buffer.size());
+		hash = hashBytes(buffer.data(), size_t(file.gcount()), hash);
+	}
+	return hash;
+}
+
+bool AssetHash::makeKey(const std::string& path, AssetKey& key)
+{
+	struct Stamp
+	{
+		uintmax_t size;
+		std::filesystem::file_time_type mtime;
+		uint64_t hash;
+	};
+	static std::unordered_map<std::string, Stamp> s_stamps;
+	static std::mutex s_mutex;
+
+	std::error_code ec;
+	std::filesystem::path canonical = std::filesystem::canonical(path, ec);
+	if (ec) return false;
+	key.canonicalPath = canonical.string();
+	uintmax_t size = std::filesystem::file_size(canonical, ec);
+	if (ec) return false;
+	auto mtime = std::filesystem::last_write_time(canonical, ec);
+	if (ec) return false;
+
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		auto it = s_stamps.find(key.canonicalPath);
+		if (it != s_stamps.end() && it->second.size == size && it->second.mtime == mtime)
+		{
+			key.contentHash = it->second.hash;
+			return true;
+		}
+	}
+	bool ok = false;
+	key.contentHash = hashFile(key.canonicalPath, ok);
+	if (!ok) return false;
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_stamps[key.canonicalPath] = Stamp{ size, mtime, key.contentHash };
+	return true;
+}
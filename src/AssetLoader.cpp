@@ -0,0 +1,140 @@
+#include "AssetLoader.h"
+#include "Mesh.h"
+#include "TextureManager.h"
+#include "AssetCache.h"
+#include <chrono>
+#include <map>
+#include <vector>
+
+void AssetLoader::UploadQueue::push(std::function<void()> task)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	if (closed) return; // the loader is gone, and with it whoever would have run this
+	tasks.push_back(std::move(task));
+}
+
+AssetLoader::AssetLoader(std::shared_ptr<TextureManager> texMgr, ThreadPool& pool)
+	: m_uploads(std::make_shared<UploadQueue>()), m_texMgr(texMgr), m_pool(pool)
+{
+}
+
+AssetLoader::~AssetLoader()
+{
+	std::deque<std::function<void()>> dropped;
+	{
+		std::lock_guard<std::mutex> lock(m_uploads->mutex);
+		m_uploads->closed = true;
+		dropped.swap(m_uploads->tasks);
+	}
+	// Queued uploads die here, on the render thread, along with any mesh they were the last owner of
+}
+
+void AssetLoader::loadMesh(const std::string& path, MeshCallback onReady, std::function<void(Mesh&)> prepare)
+{
+	std::shared_ptr<UploadQueue> uploads = m_uploads;
+	std::shared_ptr<TextureManager> texMgr = m_texMgr;
+	uploads->pending++;
+	m_pool.enqueue([this, uploads, texMgr, path, onReady, prepare]() {
+		std::shared_ptr<Mesh> mesh = texMgr ? std::make_shared<Mesh>(texMgr) : std::make_shared<Mesh>();
+		// Parsing, adjacency and normals; nothing here touches GL
+		if (!mesh->LoadFileTinyObj(path, false)) mesh.reset();
+		else if (prepare) prepare(*mesh);
+		uploads->push([this, uploads, mesh, onReady]() {
+			uploads->pending--;
+			if (mesh)
+			{
+				mesh->UploadToGPU(false);
+				streamTextures(mesh);
+			}
+			if (onReady) onReady(mesh);
+		});
+	});
+}
+
+void AssetLoader::loadTexture(const std::string& path, TextureCallback onReady)
+{
+	std::shared_ptr<UploadQueue> uploads = m_uploads;
+	std::shared_ptr<TextureManager> texMgr = m_texMgr;
+	uploads->pending++;
+	const bool compress = texMgr && texMgr->getCompression();
+	ThreadPool* pool = &m_pool;
+	// Even the key can mean reading the whole file, so it is computed here and only looked up on the render thread
+	m_pool.enqueue([uploads, texMgr, path, onReady, compress, pool]() {
+		AssetKey key;
+		if (!AssetHash::makeKey(path, key)) key.canonicalPath.clear();
+		uploads->push([uploads, texMgr, path, onReady, compress, pool, key]() {
+			unsigned int id = 0;
+			if (texMgr && texMgr->acquireTexture(key, id))
+			{
+				uploads->pending--;
+				if (onReady) onReady(id);
+				return;
+			}
+			pool->enqueue([uploads, texMgr, path, onReady, compress, key]() {
+				auto image = std::make_shared<TextureImage>();
+				const bool decoded = TextureManager::decodeTexture(path, *image, compress);
+				uploads->push([uploads, texMgr, path, onReady, image, decoded, key]() {
+					uploads->pending--;
+					unsigned int id = 0;
+					if (!decoded || !texMgr || !texMgr->uploadTexture(path, key, *image, id)) id = 0;
+					if (onReady) onReady(id);
+				});
+			});
+		});
+	});
+}
+
+void AssetLoader::streamTextures(const std::shared_ptr<Mesh>& mesh)
+{
+	// Materials sharing a file only decode it once
+	std::map<std::string, std::vector<uint32_t>> pathToMaterials;
+	for (uint32_t i = 0; i < uint32_t(mesh->m_materials.size()); i++)
+	{
+		const Mesh::BasicMaterialEntry& material = mesh->m_materials[i];
+		if (material.texID == 0 && !material.texturePath.empty()) pathToMaterials[material.texturePath].push_back(i);
+	}
+	std::weak_ptr<Mesh> weakMesh = mesh;
+	for (auto& it : pathToMaterials)
+	{
+		const std::string path = it.first;
+		const std::vector<uint32_t> materialIds = it.second;
+		loadTexture(path, [this, weakMesh, path, materialIds](unsigned int id) {
+			if (id == 0) return;
+			std::shared_ptr<Mesh> mesh = weakMesh.lock();
+			// We are handed one reference; every material that takes one after that needs its own
+			bool holdingRef = true;
+			for (uint32_t materialId : materialIds)
+			{
+				if (!mesh) break;
+				if (!holdingRef && !m_texMgr->retainTexture(id)) break;
+				holdingRef = !mesh->SetMaterialTexture(materialId, path, id);
+			}
+			if (holdingRef) m_texMgr->releaseTexture(id);
+		});
+	}
+}
+
+size_t AssetLoader::processUploads(double budgetMs)
+{
+	const auto start = std::chrono::steady_clock::now();
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::lock_guard<std::mutex> lock(m_uploads->mutex);
+			if (m_uploads->tasks.empty()) return 0;
+			task = std::move(m_uploads->tasks.front());
+			m_uploads->tasks.pop_front();
+		}
+		task();
+		const double elapsedMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		if (elapsedMs >= budgetMs) break;
+	}
+	std::lock_guard<std::mutex> lock(m_uploads->mutex);
+	return m_uploads->tasks.size();
+}
+
+size_t AssetLoader::getNumPending() const
+{
+	return m_uploads->pending.load();
+}
@@ -0,0 +1,32 @@
+#include "AtomicFile.h"
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
+
+std::string AtomicFile::makeTempPath(const std::string& path)
+{
+	char suffix[48];
+	std::snprintf(suffix, sizeof(suffix), ".%llx.%08x.tmp",
+		(unsigned long long)std::hash<std::thread::id>()(std::this_thread::get_id()), unsigned(std::random_device()()));
+	return path + suffix;
+}
+
+bool AtomicFile::write(const std::string& path, const std::function<void(std::ostream&)>& fill)
+{
+	const std::string tmpPath = makeTempPath(path);
+	bool written;
+	{
+		std::ofstream file(tmpPath, std::ios::binary);
+		if (!file) return false;
+		fill(file);
+		file.flush();
+		written = bool(file);
+	}
+	std::error_code ec;
+	if (written) std::filesystem::rename(tmpPath, path, ec);
+	if (written && !ec) return true;
+	std::filesystem::remove(tmpPath, ec);
+	return false;
+}
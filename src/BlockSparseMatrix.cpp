@@ -0,0 +1,125 @@
+#include "BlockSparseMatrix.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cmath>
+
+template <typename Scalar>
+void BlockSparseMatrix3<Scalar>::setPattern(uint32_t numBlockRows, std::vector<std::pair<uint32_t, uint32_t>> blocks)
+{
+	for (uint32_t i = 0; i < numBlockRows; i++) blocks.emplace_back(i, i);
+	std::sort(blocks.begin(), blocks.end());
+	blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+	m_numBlockRows = numBlockRows;
+	m_rowStart.assign(size_t(numBlockRows) + 1, 0);
+	m_cols.resize(blocks.size());
+	m_diag.resize(numBlockRows);
+	for (size_t i = 0; i < blocks.size(); i++)
+	{
+		const uint32_t row = blocks[i].first, col = blocks[i].second;
+		m_rowStart[row + 1]++;
+		m_cols[i] = col;
+		if (row == col) m_diag[row] = uint32_t(i);
+	}
+	for (uint32_t row = 0; row < numBlockRows; row++) m_rowStart[row + 1] += m_rowStart[row];
+	m_values.assign(9 * blocks.size(), Scalar(0));
+}
+
+template <typename Scalar>
+int64_t BlockSparseMatrix3<Scalar>::findBlock(uint32_t row, uint32_t col) const
+{
+	if (row >= m_numBlockRows) return -1;
+	const auto begin = m_cols.begin() + m_rowStart[row], end = m_cols.begin() + m_rowStart[row + 1];
+	const auto it = std::lower_bound(begin, end, col);
+	return it != end && *it == col ? int64_t(it - m_cols.begin()) : -1;
+}
+
+template <typename Scalar>
+void BlockSparseMatrix3<Scalar>::setZero()
+{
+	std::fill(m_values.begin(), m_values.end(), Scalar(0));
+}
+
+template <typename Scalar>
+void BlockSparseMatrix3<Scalar>::multiply(const Vector& x, Vector& y) const
+{
+	y.resize(3 * Eigen::Index(m_numBlockRows));
+	ThreadPool::global().parallelFor(0, m_numBlockRows, [&](size_t begin, size_t end) {
+		for (size_t row = begin; row < end; row++)
+		{
+			Eigen::Matrix<Scalar, 3, 1> sum = Eigen::Matrix<Scalar, 3, 1>::Zero();
+			for (uint32_t i = m_rowStart[row]; i < m_rowStart[row + 1]; i++)
+				sum.noalias() += block(i) * x.template segment<3>(3 * Eigen::Index(m_cols[i]));
+			y.template segment<3>(3 * Eigen::Index(row)) = sum;
+		}
+	}, 1024);
+}
+
+template <typename Scalar>
+void BlockSparseMatrix3<Scalar>::getBlockDiagonal(std::vector<Block>& out) const
+{
+	out.resize(m_numBlockRows);
+	for (uint32_t row = 0; row < m_numBlockRows; row++) out[row] = block(m_diag[row]);
+}
+
+template <typename Scalar>
+Eigen::SparseMatrix<Scalar> BlockSparseMatrix3<Scalar>::toSparse() const
+{
+	std::vector<Eigen::Triplet<Scalar>> triplets;
+	triplets.reserve(m_values.size());
+	for (uint32_t row = 0; row < m_numBlockRows; row++)
+	{
+		for (uint32_t i = m_rowStart[row]; i < m_rowStart[row + 1]; i++)
+		{
+			const Eigen::Map<const Block> b = block(i);
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					triplets.emplace_back(3 * Eigen::Index(row) + r, 3 * Eigen::Index(m_cols[i]) + c, b(r, c));
+		}
+	}
+	Eigen::SparseMatrix<Scalar> out(3 * Eigen::Index(m_numBlockRows), 3 * Eigen::Index(m_numBlockRows));
+	out.setFromTriplets(triplets.begin(), triplets.end());
+	return out;
+}
+
+template <typename Scalar>
+void BlockJacobi<Scalar>::compute(const BlockSparseMatrix3<Scalar>& A)
+{
+	std::vector<Block> diagonal;
+	A.getBlockDiagonal(diagonal);
+	compute(diagonal);
+}
+
+template <typename Scalar>
+void BlockJacobi<Scalar>::compute(const std::vector<Block>& diagonal)
+{
+	m_inverse.resize(9 * diagonal.size());
+	for (size_t row = 0; row < diagonal.size(); row++)
+	{
+		const Block& d = diagonal[row];
+		Eigen::Map<Block> inverse(&m_inverse[9 * row]);
+		bool invertible = false;
+		Scalar determinant;
+		d.computeInverseAndDetWithCheck(inverse, determinant, invertible);
+		if (invertible) continue;
+		// Singular block: fall back to the scalar diagonal, skipping zeros
+		inverse.setZero();
+		for (int i = 0; i < 3; i++) inverse(i, i) = d(i, i) != Scalar(0) ? Scalar(1) / d(i, i) : Scalar(1);
+	}
+}
+
+template <typename Scalar>
+void BlockJacobi<Scalar>::apply(const Vector& r, Vector& z) const
+{
+	z.resize(r.size());
+	const size_t numBlocks = m_inverse.size() / 9;
+	for (size_t row = 0; row < numBlocks; row++)
+	{
+		z.template segment<3>(3 * Eigen::Index(row)).noalias() =
+			Eigen::Map<const Block>(&m_inverse[9 * row]) * r.template segment<3>(3 * Eigen::Index(row));
+	}
+}
+
+template class BlockSparseMatrix3<float>;
+template class BlockSparseMatrix3<double>;
+template class BlockJacobi<float>;
+template class BlockJacobi<double>;
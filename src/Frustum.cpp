@@ -0,0 +1,49 @@
+#include "Frustum.h"
+
+Frustum::Frustum(const Eigen::Matrix4f& viewProj)
+{
+    update(viewProj);
+}
+
+void Frustum::update(const Eigen::Matrix4f& viewProj)
+{
+    // A point is inside when -w <= x, y, z <= w in clip space, and each of those is a plane in the source space
+    const Eigen::Vector4f row0 = viewProj.row(0).transpose();
+    const Eigen::Vector4f row1 = viewProj.row(1).transpose();
+    const Eigen::Vector4f row2 = viewProj.row(2).transpose();
+    const Eigen::Vector4f row3 = viewProj.row(3).transpose();
+    planes[LEFT] = row3 + row0;
+    planes[RIGHT] = row3 - row0;
+    planes[BOTTOM] = row3 + row1;
+    planes[TOP] = row3 - row1;
+    planes[NEAR_PLANE] = row3 + row2;
+    planes[FAR_PLANE] = row3 - row2;
+    for (auto& plane : planes)
+    {
+        plane /= plane.head<3>().norm();
+    }
+}
+
+bool Frustum::intersects(const AABB& box) const
+{
+    if (box.isEmpty()) return false;
+    for (const auto& plane : planes)
+    {
+        // The corner furthest along the plane normal; if even that is outside, the whole box is
+        const Eigen::Vector3f positive(
+            plane(0) >= 0.0f ? box.max(0) : box.min(0),
+            plane(1) >= 0.0f ? box.max(1) : box.min(1),
+            plane(2) >= 0.0f ? box.max(2) : box.min(2));
+        if (plane.head<3>().dot(positive) + plane(3) < 0.0f) return false;
+    }
+    return true;
+}
+
+bool Frustum::intersects(const Eigen::Vector3f& center, float radius) const
+{
+    for (const auto& plane : planes)
+    {
+        if (plane.head<3>().dot(center) + plane(3) < -radius) return false;
+    }
+    return true;
+}
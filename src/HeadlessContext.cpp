@@ -0,0 +1,156 @@
+#include "HeadlessContext.h"
+#include <iostream>
+#include <cstring>
+
+#ifdef DKVIEWER_HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+namespace
+{
+    bool hasExtension(const char* extensions, const char* name)
+    {
+        if (!extensions) return false;
+        const size_t length = std::strlen(name);
+        for (const char* p = std::strstr(extensions, name); p; p = std::strstr(p + length, name))
+        {
+            // Whole words only: EGL_KHR_foo must not match EGL_KHR_foo_bar
+            if ((p == extensions || p[-1] == ' ') && (p[length] == ' ' || p[length] == '\0')) return true;
+        }
+        return false;
+    }
+
+    EGLDisplay openDisplay()
+    {
+        // Client extensions are queried without a display; EGL 1.4 implementations may return null here
+        const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+        if (hasExtension(clientExtensions, "EGL_MESA_platform_surfaceless") && hasExtension(clientExtensions, "EGL_EXT_platform_base"))
+        {
+            auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+            if (getPlatformDisplay)
+            {
+                EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+                if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) return display;
+            }
+        }
+        EGLDisplay display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display != EGL_NO_DISPLAY && eglInitialize(display, nullptr, nullptr)) return display;
+        return EGL_NO_DISPLAY;
+    }
+}
+
+HeadlessContext::~HeadlessContext()
+{
+    destroy();
+}
+
+bool HeadlessContext::create(int major, int minor)
+{
+    destroy();
+    EGLDisplay display = openDisplay();
+    if (display == EGL_NO_DISPLAY)
+    {
+        std::cout << "No EGL display available" << std::endl;
+        return false;
+    }
+    m_display = display;
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cout << "EGL driver has no desktop OpenGL" << std::endl;
+        destroy();
+        return false;
+    }
+
+    // Rendering goes into an FBO, so the config only needs a pbuffer for drivers without surfaceless contexts
+    const bool surfaceless = hasExtension(eglQueryString(display, EGL_EXTENSIONS), "EGL_KHR_surfaceless_context");
+    EGLint configAttribs[] = {
+        EGL_SURFACE_TYPE, surfaceless ? 0 : EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    if (!eglChooseConfig(display, configAttribs, &config, 1, &numConfigs) || numConfigs == 0)
+    {
+        std::cout << "No EGL config for OpenGL rendering" << std::endl;
+        destroy();
+        return false;
+    }
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, major,
+        EGL_CONTEXT_MINOR_VERSION_KHR, minor,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK_KHR, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT_KHR,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (context == EGL_NO_CONTEXT)
+    {
+        std::cout << "Failed to create an OpenGL " << major << "." << minor << " core context through EGL" << std::endl;
+        destroy();
+        return false;
+    }
+    m_context = context;
+    EGLSurface surface = EGL_NO_SURFACE;
+    if (!surfaceless)
+    {
+        const EGLint pbufferAttribs[] = { EGL_WIDTH, 16, EGL_HEIGHT, 16, EGL_NONE };
+        surface = eglCreatePbufferSurface(display, config, pbufferAttribs);
+        if (surface == EGL_NO_SURFACE)
+        {
+            std::cout << "Failed to create an EGL pbuffer" << std::endl;
+            destroy();
+            return false;
+        }
+        m_surface = surface;
+    }
+    if (!eglMakeCurrent(display, surface, surface, context))
+    {
+        std::cout << "Failed to make the EGL context current" << std::endl;
+        destroy();
+        return false;
+    }
+    return true;
+}
+
+void HeadlessContext::destroy()
+{
+    if (!m_display) return;
+    eglMakeCurrent(m_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    if (m_context) eglDestroyContext(m_display, m_context);
+    if (m_surface) eglDestroySurface(m_display, m_surface);
+    eglTerminate(m_display);
+    m_display = m_surface = m_context = nullptr;
+}
+
+void* HeadlessContext::getProcAddress(const char* name)
+{
+    return reinterpret_cast<void*>(eglGetProcAddress(name));
+}
+
+#else
+
+HeadlessContext::~HeadlessContext()
+{
+}
+
+bool HeadlessContext::create(int, int)
+{
+    std::cout << "Built without EGL, no headless context available" << std::endl;
+    return false;
+}
+
+void HeadlessContext::destroy()
+{
+}
+
+void* HeadlessContext::getProcAddress(const char*)
+{
+    return nullptr;
+}
+
+#endif
@@ -1,8 +1,15 @@
 #define TINYOBJLOADER_IMPLEMENTATION
 #include "Mesh.h"
+#include "ThreadPool.h"
+#include "MeshSimplifier.h"
 #include <filesystem>
 #include <map>
 #include <unordered_map>
+#include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+#include <limits>
 
 #define SAFE_DELETE(p) if (p) { delete p; p = NULL; }
 #define ARRAY_SIZE_IN_ELEMENTS(a) (sizeof(a)/sizeof(a[0]))
@@ -11,6 +18,7 @@
 #define POSITION_LOCATION  0
 #define TEX_COORD_LOCATION 1
 #define NORMAL_LOCATION    2
+#define INSTANCE_LOCATION  3 // A mat4 attribute, so it takes locations 3 to 6
 
 Mesh::Mesh()
 {
@@ -36,17 +44,42 @@ void Mesh::Clear()
         SAFE_DELETE(m_Textures[i]);
     }*/
 
+    ReleasePositionStream();
+
     if (m_buffers[0] != 0) {
         glDeleteBuffers(ARRAY_SIZE_IN_ELEMENTS(m_buffers), m_buffers);
+        std::fill(std::begin(m_buffers), std::end(m_buffers), 0);
     }
 
     if (m_VAO != 0) {
         glDeleteVertexArrays(1, &m_VAO);
         m_VAO = 0;
     }
+    // Hand our references back so the TextureManager can evict textures nobody uses anymore
+    if (m_texMgr)
+    {
+        for (auto& material : m_materials)
+        {
+            if (material.texID != 0) m_texMgr->releaseTexture(material.texID);
+        }
+    }
     m_materials.clear();
     m_meshes.clear();
+    m_lods.clear();
+    m_lodErrors.clear();
+    m_currentLOD = 0;
+    m_clusters.clear();
+    m_clusterOffsets.clear();
+    m_clustersStale = false;
     m_edges.clear();
+    m_vertFaceOffsets.clear();
+    m_vertFaces.clear();
+    m_faceVerts.clear();
+    m_faceNormals.clear();
+    m_normalsSrcPos.clear();
+    m_boundsDirty = true;
+    // The instance transforms survive a reload, but need uploading into the new buffers
+    m_instancesDirty = true;
 }
 
 void Mesh::Draw()
@@ -68,16 +101,28 @@ uint32_t Mesh::GetNumEdges()
 
 uint32_t Mesh::GetNumTriangles()
 {
-    return uint32_t(m_indices.size()/3);
+    // Full detail only; LOD ranges live after these in m_indices
+    size_t numIndices = 0;
+    for (const auto& entry : m_meshes) numIndices += entry.NumIndices;
+    return uint32_t(numIndices / 3);
 }
 
-int* Mesh::GetTriIndices(const int triId)
+size_t Mesh::GetMemoryUsage() const
 {
-    int* triInds = new int[3];
-    triInds[0] = m_indices[3 * triId];
-    triInds[1] = m_indices[3 * triId + 1];
-    triInds[2] = m_indices[3 * triId + 2];
-    return triInds;
+    const size_t vertexBytes = m_positions.size() * sizeof(Eigen::Vector3f)
+        + m_normals.size() * sizeof(Eigen::Vector3f)
+        + m_texCoords.size() * sizeof(Eigen::Vector2f);
+    const size_t indexBytes = m_indices.size() * sizeof(unsigned int);
+    const size_t adjacencyBytes = (m_vertFaceOffsets.size() + m_vertFaces.size() + m_faceVerts.size()) * sizeof(uint32_t)
+        + m_faceNormals.size() * sizeof(Eigen::Vector3f);
+    // Vertex and index data are mirrored on the GPU
+    return 2 * (vertexBytes + indexBytes) + adjacencyBytes;
+}
+
+const unsigned int* Mesh::GetTriIndices(const uint32_t triId)
+{
+    // Points straight into the index buffer, so there is nothing to free
+    return &m_indices[3 * size_t(triId)];
 }
 
 Eigen::Matrix4f Mesh::GetModelMtx()
@@ -88,6 +133,68 @@ Eigen::Matrix4f Mesh::GetModelMtx()
 void Mesh::SetModelMtx(const Eigen::Matrix4f& mtx)
 {
     modelMtx = mtx;
+    m_worldBoundsDirty = true;
+}
+
+void Mesh::SetStatic(bool isStatic)
+{
+    m_isStatic = isStatic;
+}
+
+bool Mesh::IsStatic() const
+{
+    return m_isStatic;
+}
+
+uint32_t Mesh::AddInstance(const Eigen::Matrix4f& instanceMtx)
+{
+    m_instanceMtx.push_back(instanceMtx);
+    m_instancesDirty = true;
+    m_worldBoundsDirty = true;
+    return uint32_t(m_instanceMtx.size() - 1);
+}
+
+void Mesh::SetInstanceMtx(uint32_t instanceId, const Eigen::Matrix4f& instanceMtx)
+{
+    m_instanceMtx[instanceId] = instanceMtx;
+    m_instancesDirty = true;
+    m_worldBoundsDirty = true;
+}
+
+const Eigen::Matrix4f& Mesh::GetInstanceMtx(uint32_t instanceId) const
+{
+    return m_instanceMtx[instanceId];
+}
+
+void Mesh::ClearInstances()
+{
+    m_instanceMtx.clear();
+    m_instancesDirty = true;
+    m_worldBoundsDirty = true;
+}
+
+uint32_t Mesh::GetNumInstances() const
+{
+    return uint32_t(m_instanceMtx.size());
+}
+
+void Mesh::UpdateInstanceBuffer()
+{
+    if (!m_instancesDirty || m_VAO == 0) return;
+    m_instancesDirty = false;
+    if (m_instanceMtx.empty()) return;
+
+    glBindVertexArray(m_VAO);
+    glBindBuffer(GL_ARRAY_BUFFER, m_buffers[WORLD_MAT_VB]);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(m_instanceMtx[0]) * m_instanceMtx.size(), m_instanceMtx.data(), GL_DYNAMIC_DRAW);
+    // A mat4 attribute is fed as four vec4 columns that advance once per instance
+    for (int col = 0; col < 4; col++)
+    {
+        glEnableVertexAttribArray(INSTANCE_LOCATION + col);
+        glVertexAttribPointer(INSTANCE_LOCATION + col, 4, GL_FLOAT, GL_FALSE, sizeof(m_instanceMtx[0]), (void*)(sizeof(float) * 4 * col));
+        glVertexAttribDivisor(INSTANCE_LOCATION + col, 1);
+    }
+    glBindVertexArray(0);
 }
 
 bool Mesh::LoadFile(const std::string& Filename)
@@ -137,6 +244,8 @@ bool Mesh::InitFromScene(const aiScene* pScene, const std::string& Filename)
 
     materials_loaded = InitMaterials(pScene, Filename);
 
+    BuildAdjacency();
+
     PopulateBuffers();
 
     return GLCheckError();
@@ -205,7 +314,7 @@ void Mesh::InitSingleMesh(const aiMesh* paiMesh)
     for (unsigned int i = 0; i < m_numFaces; i++) {
         const aiFace& Face = paiMesh->mFaces[i];
         assert(Face.mNumIndices > 1);
-        for (uint16_t i = 0; i < Face.mNumIndices; i++)
+        for (unsigned int i = 0; i < Face.mNumIndices; i++)
         {
             uint32_t v0 = Face.mIndices[i];
             uint32_t v1 = (i == Face.mNumIndices - 1) ? Face.mIndices[0] : Face.mIndices[i + 1];
@@ -216,29 +325,130 @@ void Mesh::InitSingleMesh(const aiMesh* paiMesh)
     }
 }
 
-void Mesh::RecomputeNormals()
+void Mesh::BuildAdjacency()
 {
-    std::fill(m_normals.begin(), m_normals.end(), Eigen::Vector3f::Zero());
-    for (int i = 0; i < (m_indices.size() / 3); i++)
+    const size_t numVerts = m_positions.size();
+    m_faceVerts.clear();
+    m_faceVerts.reserve(m_indices.size());
+    for (const auto& entry : m_meshes)
+    {
+        for (unsigned int i = 0; i < entry.NumIndices; i++)
+        {
+            m_faceVerts.push_back(m_indices[size_t(entry.BaseIndex) + i] + entry.BaseVertex);
+        }
+    }
+    const size_t numFaces = m_faceVerts.size() / 3;
+
+    // Counting sort of the face corners by vertex gives the CSR layout without any per-vertex allocations
+    m_vertFaceOffsets.assign(numVerts + 1, 0);
+    for (uint32_t v : m_faceVerts) m_vertFaceOffsets[v + 1]++;
+    for (size_t v = 0; v < numVerts; v++) m_vertFaceOffsets[v + 1] += m_vertFaceOffsets[v];
+    m_vertFaces.resize(m_faceVerts.size());
+    std::vector<uint32_t> cursor(m_vertFaceOffsets.begin(), m_vertFaceOffsets.end() - 1);
+    for (size_t f = 0; f < numFaces; f++)
     {
-        auto v1 = m_positions[m_indices[i * 3]];
-        auto v2 = m_positions[m_indices[i * 3 + 1]];
-        auto v3 = m_positions[m_indices[i * 3 + 2]];
-
-        auto wNorm = (v2 - v1).cross(v3 - v1);
-        m_normals[m_indices[i * 3]] += wNorm;
-        m_normals[m_indices[i * 3 + 1]] += wNorm;
-        m_normals[m_indices[i * 3 + 2]] += wNorm;
-        //std::cout << "i=" << i << std::endl;
-    }
-    // Normalize the normals
-    for (auto& norm : m_normals)
+        for (int c = 0; c < 3; c++)
+        {
+            m_vertFaces[cursor[m_faceVerts[3 * f + c]]++] = uint32_t(f);
+        }
+    }
+    m_faceNormals.assign(numFaces, Eigen::Vector3f::Zero());
+    m_normalsSrcPos.clear();
+    m_boundsDirty = true;
+}
+
+void Mesh::RecomputeNormals()
+{
+    if (m_vertFaceOffsets.size() != m_positions.size() + 1) BuildAdjacency();
+    if (m_normals.size() != m_positions.size()) m_normals.resize(m_positions.size());
+
+    ThreadPool& pool = ThreadPool::global();
+    const size_t numVerts = m_positions.size();
+    const size_t numFaces = m_faceNormals.size();
+    auto faceNormal = [this](size_t f) {
+        const Eigen::Vector3f& v1 = m_positions[m_faceVerts[3 * f]];
+        const Eigen::Vector3f& v2 = m_positions[m_faceVerts[3 * f + 1]];
+        const Eigen::Vector3f& v3 = m_positions[m_faceVerts[3 * f + 2]];
+        return Eigen::Vector3f((v2 - v1).cross(v3 - v1));
+    };
+
+    if (!doIncrementalNormals || m_normalsSrcPos.size() != numVerts)
     {
-        norm.normalize();
+        pool.parallelFor(0, numFaces, [&](size_t begin, size_t end) {
+            for (size_t f = begin; f < end; f++) m_faceNormals[f] = faceNormal(f);
+        });
+        // Each vertex gathers its own faces, so no two threads ever write the same normal
+        pool.parallelFor(0, numVerts, [&](size_t begin, size_t end) {
+            for (size_t v = begin; v < end; v++)
+            {
+                Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+                for (uint32_t i = m_vertFaceOffsets[v]; i < m_vertFaceOffsets[v + 1]; i++) sum += m_faceNormals[m_vertFaces[i]];
+                m_normals[v] = sum;
+            }
+            // Normalize the whole chunk at once; as a 3xN map Eigen vectorizes this along the rows
+            Eigen::Map<Eigen::Matrix3Xf> chunk(reinterpret_cast<float*>(&m_normals[begin]), 3, Eigen::Index(end - begin));
+            Eigen::ArrayXf len = chunk.colwise().norm().transpose().array();
+            Eigen::ArrayXf invLen = (len > 0.0f).select(len.inverse(), 0.0f);
+            chunk.array().rowwise() *= invLen.transpose();
+        });
+        if (doIncrementalNormals) m_normalsSrcPos = m_positions;
+        UploadNormals(0, numVerts);
+        return;
     }
+
+    // Incremental path: flag moved vertices, refresh the faces touching them, then re-gather only around those faces
+    std::vector<uint8_t> moved(numVerts, 0);
+    std::vector<uint8_t> faceDirty(numFaces, 0);
+    pool.parallelFor(0, numVerts, [&](size_t begin, size_t end) {
+        for (size_t v = begin; v < end; v++)
+        {
+            if (m_positions[v] != m_normalsSrcPos[v])
+            {
+                moved[v] = 1;
+                m_normalsSrcPos[v] = m_positions[v];
+            }
+        }
+    });
+    pool.parallelFor(0, numFaces, [&](size_t begin, size_t end) {
+        for (size_t f = begin; f < end; f++)
+        {
+            if (moved[m_faceVerts[3 * f]] | moved[m_faceVerts[3 * f + 1]] | moved[m_faceVerts[3 * f + 2]])
+            {
+                m_faceNormals[f] = faceNormal(f);
+                faceDirty[f] = 1;
+            }
+        }
+    });
+    std::atomic<size_t> firstDirty(numVerts), lastDirty(0);
+    pool.parallelFor(0, numVerts, [&](size_t begin, size_t end) {
+        size_t lo = numVerts, hi = 0;
+        for (size_t v = begin; v < end; v++)
+        {
+            bool touched = false;
+            for (uint32_t i = m_vertFaceOffsets[v]; i < m_vertFaceOffsets[v + 1] && !touched; i++) touched = faceDirty[m_vertFaces[i]] != 0;
+            if (!touched) continue;
+            Eigen::Vector3f sum = Eigen::Vector3f::Zero();
+            for (uint32_t i = m_vertFaceOffsets[v]; i < m_vertFaceOffsets[v + 1]; i++) sum += m_faceNormals[m_vertFaces[i]];
+            float len = sum.norm();
+            m_normals[v] = len > 0.0f ? Eigen::Vector3f(sum / len) : Eigen::Vector3f::Zero();
+            lo = std::min(lo, v);
+            hi = std::max(hi, v + 1);
+        }
+        size_t cur = firstDirty.load();
+        while (lo < cur && !firstDirty.compare_exchange_weak(cur, lo)) {}
+        cur = lastDirty.load();
+        while (hi > cur && !lastDirty.compare_exchange_weak(cur, hi)) {}
+    });
+    if (lastDirty > firstDirty) UploadNormals(firstDirty, lastDirty - firstDirty);
+}
+
+void Mesh::UploadNormals(size_t first, size_t count)
+{
+    // CPU-only meshes (e.g. loaded without GPU buffers) have nothing to upload to
+    if (m_buffers[NORMAL_VB] == 0 || count == 0) return;
+    // The buffer was sized in PopulateBuffers, so we only ever update it in place
     glBindBuffer(GL_ARRAY_BUFFER, m_buffers[NORMAL_VB]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(m_normals[0]) * m_normals.size(), nullptr, GL_DYNAMIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(m_normals[0]) * m_normals.size(), &m_normals[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(m_normals[0]) * first, sizeof(m_normals[0]) * count, &m_normals[first]);
 }
 
 void Mesh::SetRecomputeNormals(bool recomp)
@@ -246,32 +456,138 @@ void Mesh::SetRecomputeNormals(bool recomp)
     doRecompNormals = recomp;
 }
 
+void Mesh::SetIncrementalNormals(bool incremental)
+{
+    doIncrementalNormals = incremental;
+    m_normalsSrcPos.clear();
+}
+
+void Mesh::SetNormalSource(NormalSource source)
+{
+    // The CPU normals went stale while the GPU was deriving them, so refresh them on the next update
+    if (source == NORMALS_CPU && m_normalSource != NORMALS_CPU)
+    {
+        m_normalsSrcPos.clear();
+        m_positionsDirty = true;
+    }
+    m_normalSource = source;
+}
+
+Mesh::NormalSource Mesh::GetNormalSource() const
+{
+    return m_normalSource;
+}
+
 AABB Mesh::ComputeAABB()
 {
     AABB meshAABB;
-    float minX, maxX = m_positions[0](0);
-    float minY, maxY = m_positions[0](1);
-    float minZ, maxZ = m_positions[0](2);
-    // Find the boundaries
     for (auto& pos : m_positions)
     {
-        if (pos(0) < minX) minX = pos(0);
-        if (pos(0) > maxX) maxX = pos(0);
-        if (pos(1) < minY) minY = pos(1);
-        if (pos(1) > maxY) maxY = pos(1);
-        if (pos(2) < minZ) minZ = pos(2);
-        if (pos(2) > maxZ) maxZ = pos(2);
+        meshAABB.expand(pos);
     }
-    meshAABB.width = maxX - minX;
-    meshAABB.depth = maxY - minY;
-    meshAABB.height = maxZ - minZ;
-
     return meshAABB;
 }
 
-void Mesh::SetVertex(const Eigen::Vector3f& pos, uint16_t id)
+void Mesh::UpdateBounds()
+{
+    if (m_boundsDirty)
+    {
+        m_localBounds = ComputeAABB();
+        m_submeshBounds.assign(m_meshes.size(), AABB());
+        // Only worth the extra pass when the submeshes can be culled separately
+        if (m_meshes.size() > 1)
+        {
+            for (size_t i = 0; i < m_meshes.size(); i++)
+            {
+                const BasicMeshEntry& entry = m_meshes[i];
+                for (unsigned int j = 0; j < entry.NumIndices; j++)
+                {
+                    m_submeshBounds[i].expand(m_positions[m_indices[size_t(entry.BaseIndex) + j] + entry.BaseVertex]);
+                }
+            }
+        }
+        else if (m_meshes.size() == 1)
+        {
+            m_submeshBounds[0] = m_localBounds;
+        }
+        m_boundsDirty = false;
+        m_worldBoundsDirty = true;
+    }
+    if (m_worldBoundsDirty)
+    {
+        m_submeshWorldBounds.resize(m_submeshBounds.size());
+        for (size_t i = 0; i < m_submeshBounds.size(); i++)
+        {
+            m_submeshWorldBounds[i] = m_submeshBounds[i].transformed(modelMtx);
+        }
+        if (m_instanceMtx.empty())
+        {
+            m_worldBounds = m_localBounds.transformed(modelMtx);
+        }
+        else
+        {
+            m_worldBounds = AABB();
+            for (const auto& instanceMtx : m_instanceMtx)
+            {
+                m_worldBounds.expand(m_localBounds.transformed(modelMtx * instanceMtx));
+            }
+        }
+        m_worldBoundsDirty = false;
+    }
+}
+
+const AABB& Mesh::GetLocalBounds()
+{
+    UpdateBounds();
+    return m_localBounds;
+}
+
+const AABB& Mesh::GetSubmeshBounds(uint32_t meshEntry)
+{
+    UpdateBounds();
+    return m_submeshBounds[meshEntry];
+}
+
+const AABB& Mesh::GetWorldBounds()
+{
+    UpdateBounds();
+    return m_worldBounds;
+}
+
+const AABB& Mesh::GetSubmeshWorldBounds(uint32_t meshEntry)
+{
+    UpdateBounds();
+    return m_submeshWorldBounds[meshEntry];
+}
+
+void Mesh::SetVertex(const Eigen::Vector3f& pos, uint32_t id)
 {
     m_positions[id] = pos;
+    m_positionsDirty = true;
+    m_boundsDirty = true;
+    m_clustersStale = true;
+}
+
+// Eigen::Vector3f is not padded, so m_positions is one contiguous run of 3 * N floats
+static_assert(sizeof(Eigen::Vector3f) == 3 * sizeof(float), "Vector3f must be tightly packed");
+
+void Mesh::SetPositions(const Eigen::Ref<const Eigen::VectorXf>& positions)
+{
+    assert(positions.size() == 3 * Eigen::Index(m_positions.size()));
+    Eigen::Map<Eigen::VectorXf>(reinterpret_cast<float*>(m_positions.data()), positions.size()) = positions;
+    m_positionsDirty = true;
+    m_boundsDirty = true;
+    m_clustersStale = true;
+}
+
+Eigen::Map<const Eigen::VectorXf> Mesh::GetPositions() const
+{
+    return Eigen::Map<const Eigen::VectorXf>(reinterpret_cast<const float*>(m_positions.data()), 3 * Eigen::Index(m_positions.size()));
+}
+
+Eigen::Map<Eigen::VectorXf> Mesh::MapPositions()
+{
+    return Eigen::Map<Eigen::VectorXf>(reinterpret_cast<float*>(m_positions.data()), 3 * Eigen::Index(m_positions.size()));
 }
 
 bool Mesh::InitMaterials(const aiScene* pScene, const std::string& Filename)
@@ -326,7 +642,7 @@ bool Mesh::InitMaterials(const aiScene* pScene, const std::string& Filename)
     return Ret;
 }
 
-Eigen::Vector3f Mesh::GetVertex(uint16_t id, bool worldSpace)
+Eigen::Vector3f Mesh::GetVertex(uint32_t id, bool worldSpace)
 {
     Eigen::Vector3f out = m_positions[id];
     if (worldSpace)
@@ -353,38 +669,216 @@ void Mesh::PopulateBuffers()
 
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[INDEX_BUFFER]);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(m_indices[0]) * m_indices.size(), &m_indices[0], GL_STATIC_DRAW);
+    m_positionsDirty = false;
+}
+
+void Mesh::MarkPositionsDirty()
+{
+    m_positionsDirty = true;
+    m_boundsDirty = true;
+    m_clustersStale = true;
+}
+
+bool Mesh::ArePositionsDirty() const
+{
+    return m_positionsDirty;
+}
+
+void Mesh::InitPositionStream()
+{
+    m_posStreamInit = true;
+    // Persistent mapping is a GL 4.4 feature. Without it we keep orphaning the regular POS_VB.
+    if (!glBufferStorage || m_positions.empty()) return;
+
+    const GLsizeiptr size = sizeof(m_positions[0]) * m_positions.size();
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    for (auto& slot : m_posStream)
+    {
+        glGenBuffers(1, &slot.buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, slot.buffer);
+        glBufferStorage(GL_ARRAY_BUFFER, size, &m_positions[0], flags);
+        slot.mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+        if (!slot.mapped)
+        {
+            std::cout << "Failed to persistently map the position stream, falling back to buffer orphaning" << std::endl;
+            ReleasePositionStream();
+            m_posStreamInit = true;
+            return;
+        }
+    }
+}
+
+void Mesh::ReleasePositionStream()
+{
+    for (auto& slot : m_posStream)
+    {
+        if (slot.fence) glDeleteSync(slot.fence);
+        if (slot.buffer)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, slot.buffer);
+            glUnmapBuffer(GL_ARRAY_BUFFER);
+            glDeleteBuffers(1, &slot.buffer);
+        }
+        slot = StreamSlot();
+    }
+    m_posStreamSlot = -1;
+    m_posStreamInit = false;
 }
 
 void Mesh::UpdatePositionBuffer()
 {
-    glBindBuffer(GL_ARRAY_BUFFER, m_buffers[POS_VB]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(m_positions[0]) * m_positions.size(), nullptr, GL_DYNAMIC_DRAW);
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(m_positions[0]) * m_positions.size(), &m_positions[0]);
-    if (doRecompNormals) RecomputeNormals();
+    // Static meshes (and deforming ones that did not move this frame) cost nothing here
+    if (!m_positionsDirty || m_VAO == 0) return;
+    m_positionsDirty = false;
+
+    if (!m_posStreamInit) InitPositionStream();
+
+    const GLsizeiptr size = sizeof(m_positions[0]) * m_positions.size();
+    if (m_posStream[0].buffer)
+    {
+        const int next = (m_posStreamSlot + 1) % NUM_STREAM_BUFFERS;
+        StreamSlot& slot = m_posStream[next];
+        if (slot.fence)
+        {
+            // Only blocks if the GPU is still NUM_STREAM_BUFFERS frames behind
+            while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(slot.fence);
+            slot.fence = nullptr;
+        }
+        std::memcpy(slot.mapped, &m_positions[0], size);
+        // Point the VAO's position attribute at the freshly written slot
+        glBindVertexArray(m_VAO);
+        glBindBuffer(GL_ARRAY_BUFFER, slot.buffer);
+        glVertexAttribPointer(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, 0, 0);
+        glBindVertexArray(0);
+        m_posStreamSlot = next;
+    }
+    else
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, m_buffers[POS_VB]);
+        glBufferData(GL_ARRAY_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        glBufferSubData(GL_ARRAY_BUFFER, 0, size, &m_positions[0]);
+    }
+    if (doRecompNormals && m_normalSource == NORMALS_CPU) RecomputeNormals();
 }
 
-void Mesh::Render()
+uint32_t Mesh::Render(const CullView* view, RenderState* state)
 {
-    glBindVertexArray(m_VAO);
+    m_numVisibleClusters = 0;
+    m_numCulledClusters = 0;
+    // Nothing to draw until the geometry has been uploaded
+    if (m_VAO == 0) return 0;
+    UpdateInstanceBuffer();
+    const GLsizei numInstances = GLsizei(m_instanceMtx.size());
+    // Instances share one draw per submesh, so only the whole-mesh test applies to them
+    const bool cullSubmeshes = view && numInstances == 0 && m_meshes.size() > 1;
+    // Clusters only cover the full detail ranges, and their bounds go stale once the mesh deforms
+    const bool cullClusters = view && numInstances == 0 && m_currentLOD == 0 && !m_clusters.empty() && !m_clustersStale;
+    Frustum objectFrustum;
+    Eigen::Vector3f objectCameraPos;
+    if (cullClusters)
+    {
+        // Cull in object space, so the cluster bounds never need transforming
+        objectFrustum.update(view->viewProj * modelMtx);
+        objectCameraPos = (modelMtx.inverse() * view->cameraPos.homogeneous()).head<3>();
+    }
+    uint32_t numDrawn = 0;
+    // Without a caller's state every bind goes through, as before
+    RenderState localState;
+    RenderState& gl = state ? *state : localState;
+    gl.bindVertexArray(m_VAO);
 
     for (unsigned int i = 0; i < m_meshes.size(); i++) {
-        unsigned int MaterialIndex = m_meshes[i].MaterialIndex;
+        if (cullSubmeshes && !view->frustum.intersects(GetSubmeshWorldBounds(i))) continue;
+        if (cullClusters)
+        {
+            // Collect the visible clusters, merging neighbours into one range since they are contiguous
+            m_drawCounts.clear();
+            m_drawOffsets.clear();
+            m_drawBaseVertices.clear();
+            uint32_t rangeEnd = 0xFFFFFFFF;
+            for (uint32_t c = m_clusterOffsets[i]; c < m_clusterOffsets[i + 1]; c++)
+            {
+                const Cluster& cluster = m_clusters[c];
+                bool visible = objectFrustum.intersects(cluster.center, cluster.radius);
+                if (visible && view->coneCulling)
+                {
+                    const Eigen::Vector3f toCluster = cluster.center - objectCameraPos;
+                    visible = toCluster.dot(cluster.coneAxis) < cluster.coneCutoff * toCluster.norm() + cluster.radius;
+                }
+                if (!visible)
+                {
+                    m_numCulledClusters++;
+                    continue;
+                }
+                m_numVisibleClusters++;
+                if (cluster.firstIndex == rangeEnd)
+                {
+                    m_drawCounts.back() += GLsizei(cluster.numIndices);
+                }
+                else
+                {
+                    m_drawCounts.push_back(GLsizei(cluster.numIndices));
+                    m_drawOffsets.push_back((const void*)(sizeof(unsigned int) * cluster.firstIndex));
+                    m_drawBaseVertices.push_back(GLint(m_meshes[i].BaseVertex));
+                }
+                rangeEnd = cluster.firstIndex + cluster.numIndices;
+            }
+            if (m_drawCounts.empty()) continue;
+        }
+        numDrawn++;
+        // A level of detail only swaps the index range; the vertices and bounds are shared
+        const BasicMeshEntry& entry = m_currentLOD == 0 ? m_meshes[i] : m_lods[m_currentLOD - 1][i];
+        unsigned int MaterialIndex = entry.MaterialIndex;
 
         assert(MaterialIndex < m_materials.size());
 
         BasicMaterialEntry* material = &m_materials[MaterialIndex];
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, material->texID);
+        GLuint texID = material->texID;
+        // Textures that are still loading show the grey placeholder
+        if (texID == 0 && !material->texturePath.empty() && m_texMgr) texID = m_texMgr->getPlaceholderTexture();
+        gl.bindTexture(texID);
+        gl.numDrawCalls++;
+
+        if (cullClusters)
+        {
+            glMultiDrawElementsBaseVertex(GL_TRIANGLES,
+                m_drawCounts.data(),
+                GL_UNSIGNED_INT,
+                m_drawOffsets.data(),
+                GLsizei(m_drawCounts.size()),
+                m_drawBaseVertices.data());
+            continue;
+        }
 
+        if (numInstances > 0)
+        {
+            glDrawElementsInstancedBaseVertex(GL_TRIANGLES,
+                entry.NumIndices,
+                GL_UNSIGNED_INT,
+                (void*)(sizeof(unsigned int) * entry.BaseIndex),
+                numInstances,
+                entry.BaseVertex);
+            continue;
+        }
         glDrawElementsBaseVertex(GL_TRIANGLES,
-            m_meshes[i].NumIndices,
+            entry.NumIndices,
             GL_UNSIGNED_INT,
-            (void*)(sizeof(unsigned int) * m_meshes[i].BaseIndex),
-            m_meshes[i].BaseVertex);
+            (void*)(sizeof(unsigned int) * entry.BaseIndex),
+            entry.BaseVertex);
     }
 
     // Make sure the VAO is not changed from the outside
-    glBindVertexArray(0);
+    if (!state) glBindVertexArray(0);
+
+    // Fence the stream slot we just drew from so it is not overwritten while still in flight
+    if (m_posStreamSlot >= 0)
+    {
+        StreamSlot& slot = m_posStream[m_posStreamSlot];
+        if (slot.fence) glDeleteSync(slot.fence);
+        slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    return numDrawn;
 }
 
 bool Mesh::LoadFileTinyObj(const std::string& Filename, bool updateGPUBuffers)
@@ -418,17 +912,13 @@ bool Mesh::LoadFileTinyObj(const std::string& Filename, bool updateGPUBuffers)
         return false;
     }
 
-    // Process materials
+    // Process materials. Only the texture paths are recorded here, UploadToGPU loads them.
     for (const auto& mat : materials) {
         BasicMaterialEntry material;
         if (!mat.diffuse_texname.empty()) {
             std::string fullPath = base_dir + mat.diffuse_texname;
             if (std::filesystem::exists(fullPath)) {
                 material.texturePath = fullPath;
-                unsigned int id;
-                if (m_texMgr && m_texMgr->loadTexture(fullPath, id)) {
-                    material.texID = id;
-                }
             }
             else {
                 std::cout << "Texture not found: " << fullPath << std::endl;
@@ -573,7 +1063,275 @@ bool Mesh::LoadFileTinyObj(const std::string& Filename, bool updateGPUBuffers)
     }
 
     materials_loaded = true;
+    BuildAdjacency();
     if (updateGPUBuffers)
+    {
+        return UploadToGPU();
+    }
+
+    return true;
+}
+
+uint32_t Mesh::GenerateLODs(uint32_t maxLevels, float reduction, uint32_t minTriangles)
+{
+    if (m_meshes.empty()) return 0;
+    // Start over from the full detail ranges
+    size_t baseIndices = 0;
+    for (const auto& entry : m_meshes) baseIndices = std::max(baseIndices, size_t(entry.BaseIndex) + entry.NumIndices);
+    m_indices.resize(baseIndices);
+    m_lods.clear();
+    m_lodErrors.assign(1, 0.0f);
+    m_currentLOD = 0;
+
+    // Simplify on position-welded vertices, so copies split at normal or UV seams move together. Vertices
+    // on a UV seam are locked though, remapping their copies could smear the texture across the seam.
+    std::vector<uint32_t> welded;
+    MeshSimplifier::weldPositions(m_positions, welded);
+    std::vector<uint8_t> locked(m_positions.size(), 0);
+    std::vector<uint32_t> copyOffsets(m_positions.size() + 1, 0);
+    for (uint32_t v = 0; v < welded.size(); v++)
+    {
+        copyOffsets[welded[v] + 1]++;
+        if (!m_texCoords.empty() && !m_texCoords[v].isApprox(m_texCoords[welded[v]], 1e-6f)) locked[welded[v]] = 1;
+    }
+    for (size_t v = 0; v < m_positions.size(); v++) copyOffsets[v + 1] += copyOffsets[v];
+    std::vector<uint32_t> copies(m_positions.size());
+    {
+        std::vector<uint32_t> cursor(copyOffsets.begin(), copyOffsets.end() - 1);
+        for (uint32_t v = 0; v < welded.size(); v++) copies[cursor[welded[v]]++] = v;
+    }
+    // The copy of welded vertex w that best matches the attributes of original vertex o
+    auto closestCopy = [&](uint32_t w, uint32_t o) {
+        uint32_t best = w;
+        float bestScore = std::numeric_limits<float>::max();
+        for (uint32_t c = copyOffsets[w]; c < copyOffsets[w + 1]; c++)
+        {
+            const uint32_t v = copies[c];
+            float score = 0.0f;
+            if (!m_normals.empty()) score += 1.0f - m_normals[v].dot(m_normals[o]);
+            if (!m_texCoords.empty()) score += (m_texCoords[v] - m_texCoords[o]).squaredNorm();
+            if (score < bestScore) { bestScore = score; best = v; }
+        }
+        return best;
+    };
+
+    std::vector<MeshSimplifier> simplifiers;
+    std::vector<std::vector<unsigned int>> sourceIndices(m_meshes.size());
+    simplifiers.reserve(m_meshes.size());
+    for (size_t i = 0; i < m_meshes.size(); i++)
+    {
+        const BasicMeshEntry& entry = m_meshes[i];
+        sourceIndices[i].assign(m_indices.begin() + entry.BaseIndex, m_indices.begin() + entry.BaseIndex + entry.NumIndices);
+        std::vector<unsigned int> triangles(sourceIndices[i]);
+        for (auto& index : sourceIndices[i]) index += entry.BaseVertex;
+        for (auto& index : triangles) index = welded[index + entry.BaseVertex];
+        simplifiers.emplace_back(m_positions, triangles, locked);
+    }
+
+    size_t prevTriangles = GetNumTriangles();
+    std::vector<unsigned int> levelIndices;
+    std::vector<uint32_t> sourceTris;
+    for (uint32_t level = 1; level <= maxLevels; level++)
+    {
+        std::vector<BasicMeshEntry> entries(m_meshes.size());
+        size_t numTriangles = 0;
+        float error = m_lodErrors.back();
+        for (size_t i = 0; i < m_meshes.size(); i++)
+        {
+            const size_t target = size_t(float(simplifiers[i].getNumTriangles()) * reduction);
+            simplifiers[i].simplify(target);
+            simplifiers[i].getIndices(levelIndices, &sourceTris);
+            entries[i].MaterialIndex = m_meshes[i].MaterialIndex;
+            entries[i].BaseVertex = m_meshes[i].BaseVertex;
+            entries[i].BaseIndex = (unsigned int)m_indices.size();
+            entries[i].NumIndices = (unsigned int)levelIndices.size();
+            for (size_t t = 0; t < sourceTris.size(); t++)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    // Back from welded ids to real vertices, keeping the corner's original normal / UV where we can
+                    const uint32_t original = sourceIndices[i][3 * size_t(sourceTris[t]) + c];
+                    const uint32_t w = levelIndices[3 * t + c];
+                    const uint32_t v = welded[original] == w ? original : closestCopy(w, original);
+                    m_indices.push_back(v - m_meshes[i].BaseVertex);
+                }
+            }
+            numTriangles += levelIndices.size() / 3;
+            error = std::max(error, simplifiers[i].getError());
+        }
+        // Stop once the locked vertices keep us from getting meaningfully smaller
+        if (float(numTriangles) > 0.9f * float(prevTriangles))
+        {
+            m_indices.resize(entries[0].BaseIndex);
+            break;
+        }
+        m_lods.push_back(entries);
+        m_lodErrors.push_back(error);
+        prevTriangles = numTriangles;
+        if (numTriangles <= minTriangles) break;
+    }
+
+    if (m_VAO != 0)
+    {
+        glBindVertexArray(m_VAO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[INDEX_BUFFER]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(m_indices[0]) * m_indices.size(), &m_indices[0], GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+    return uint32_t(m_lods.size());
+}
+
+uint32_t Mesh::GetNumLODs() const
+{
+    return uint32_t(m_lods.size());
+}
+
+float Mesh::GetLODError(uint32_t level) const
+{
+    return level < m_lodErrors.size() ? m_lodErrors[level] : 0.0f;
+}
+
+uint32_t Mesh::SelectLOD(float pixelsPerUnit, float thresholdPx)
+{
+    // Coarser levels have to beat the threshold by this fraction before we switch to them
+    const float hysteresis = 0.25f;
+    uint32_t level = m_currentLOD;
+    // Refine while the current level is visibly wrong
+    while (level > 0 && m_lodErrors[level] * pixelsPerUnit > thresholdPx) level--;
+    // Coarsen while the next level would still be comfortably under the threshold
+    while (level < m_lods.size() && m_lodErrors[level + 1] * pixelsPerUnit < thresholdPx * (1.0f - hysteresis)) level++;
+    m_currentLOD = level;
+    return level;
+}
+
+uint32_t Mesh::GetCurrentLOD() const
+{
+    return m_currentLOD;
+}
+
+uint32_t Mesh::BuildClusters(uint32_t maxTriangles)
+{
+    m_clusters.clear();
+    m_clusterOffsets.assign(1, 0);
+    m_clustersStale = false;
+    if (m_faceVerts.size() / 3 != GetNumTriangles()) BuildAdjacency();
+
+    std::vector<uint8_t> assigned(m_faceVerts.size() / 3, 0);
+    std::vector<uint32_t> clusterFaces;
+    std::vector<uint32_t> frontier;
+    std::vector<unsigned int> reordered;
+    uint32_t faceBase = 0;
+    for (const auto& entry : m_meshes)
+    {
+        const uint32_t numFaces = entry.NumIndices / 3;
+        const uint32_t faceEnd = faceBase + numFaces;
+        reordered.clear();
+        reordered.reserve(entry.NumIndices);
+        for (uint32_t seed = faceBase; seed < faceEnd; seed++)
+        {
+            if (assigned[seed]) continue;
+            // Grow breadth first over faces sharing a vertex, which keeps clusters compact and connected
+            clusterFaces.clear();
+            frontier.assign(1, seed);
+            assigned[seed] = 1;
+            for (size_t next = 0; next < frontier.size(); next++)
+            {
+                const uint32_t f = frontier[next];
+                if (clusterFaces.size() == maxTriangles)
+                {
+                    assigned[f] = 0; // did not fit, it seeds or joins a later cluster
+                    continue;
+                }
+                clusterFaces.push_back(f);
+                for (int c = 0; c < 3; c++)
+                {
+                    const uint32_t v = m_faceVerts[3 * size_t(f) + c];
+                    for (uint32_t k = m_vertFaceOffsets[v]; k < m_vertFaceOffsets[v + 1]; k++)
+                    {
+                        const uint32_t nf = m_vertFaces[k];
+                        if (nf < faceBase || nf >= faceEnd || assigned[nf]) continue;
+                        assigned[nf] = 1;
+                        frontier.push_back(nf);
+                    }
+                }
+            }
+
+            Cluster cluster;
+            cluster.firstIndex = entry.BaseIndex + (unsigned int)reordered.size();
+            cluster.numIndices = uint32_t(3 * clusterFaces.size());
+            AABB box;
+            Eigen::Vector3f normalSum = Eigen::Vector3f::Zero();
+            for (uint32_t f : clusterFaces)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    reordered.push_back(m_indices[size_t(entry.BaseIndex) + 3 * size_t(f - faceBase) + c]);
+                    box.expand(m_positions[m_faceVerts[3 * size_t(f) + c]]);
+                }
+                const Eigen::Vector3f& p0 = m_positions[m_faceVerts[3 * size_t(f)]];
+                normalSum += (m_positions[m_faceVerts[3 * size_t(f) + 1]] - p0).cross(m_positions[m_faceVerts[3 * size_t(f) + 2]] - p0);
+            }
+            cluster.center = box.center();
+            cluster.radius = 0.0f;
+            for (uint32_t f : clusterFaces)
+            {
+                for (int c = 0; c < 3; c++)
+                {
+                    cluster.radius = std::max(cluster.radius, (m_positions[m_faceVerts[3 * size_t(f) + c]] - cluster.center).norm());
+                }
+            }
+            // Normal cone: the average normal, widened to cover every face
+            cluster.coneCutoff = 1.0f;
+            cluster.coneAxis = Eigen::Vector3f::UnitZ();
+            if (normalSum.norm() > 1e-12f)
+            {
+                cluster.coneAxis = normalSum.normalized();
+                float minDot = 1.0f;
+                for (uint32_t f : clusterFaces)
+                {
+                    const Eigen::Vector3f& p0 = m_positions[m_faceVerts[3 * size_t(f)]];
+                    const Eigen::Vector3f n = (m_positions[m_faceVerts[3 * size_t(f) + 1]] - p0).cross(m_positions[m_faceVerts[3 * size_t(f) + 2]] - p0);
+                    if (n.norm() > 1e-20f) minDot = std::min(minDot, cluster.coneAxis.dot(n.normalized()));
+                }
+                if (minDot > 0.0f) cluster.coneCutoff = std::sqrt(1.0f - minDot * minDot);
+            }
+            m_clusters.push_back(cluster);
+        }
+        std::copy(reordered.begin(), reordered.end(), m_indices.begin() + entry.BaseIndex);
+        m_clusterOffsets.push_back(uint32_t(m_clusters.size()));
+        faceBase = faceEnd;
+    }
+    // The face order changed
+    BuildAdjacency();
+
+    if (m_VAO != 0)
+    {
+        glBindVertexArray(m_VAO);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_buffers[INDEX_BUFFER]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(m_indices[0]) * m_indices.size(), &m_indices[0], GL_STATIC_DRAW);
+        glBindVertexArray(0);
+    }
+    return uint32_t(m_clusters.size());
+}
+
+uint32_t Mesh::GetNumClusters() const
+{
+    return uint32_t(m_clusters.size());
+}
+
+uint32_t Mesh::GetNumVisibleClusters() const
+{
+    return m_numVisibleClusters;
+}
+
+uint32_t Mesh::GetNumCulledClusters() const
+{
+    return m_numCulledClusters;
+}
+
+bool Mesh::UploadToGPU(bool loadTextures)
+{
+    if (m_VAO == 0)
     {
         // Create the VAO
         glGenVertexArrays(1, &m_VAO);
@@ -583,8 +1341,27 @@ bool Mesh::LoadFileTinyObj(const std::string& Filename, bool updateGPUBuffers)
         glGenBuffers(ARRAY_SIZE_IN_ELEMENTS(m_buffers), m_buffers);
         PopulateBuffers();
         glBindVertexArray(0);
-        return GLCheckError();
     }
+    if (loadTextures && m_texMgr)
+    {
+        for (auto& material : m_materials)
+        {
+            if (material.texID != 0 || material.texturePath.empty()) continue;
+            unsigned int id;
+            if (m_texMgr->loadTexture(material.texturePath, id)) {
+                material.texID = id;
+            }
+        }
+    }
+    return GLCheckError();
+}
 
+bool Mesh::SetMaterialTexture(uint32_t materialId, const std::string& texturePath, unsigned int texID)
+{
+    // The mesh may have been reloaded while the texture was in flight
+    if (materialId >= m_materials.size() || m_materials[materialId].texturePath != texturePath) return false;
+    BasicMaterialEntry& material = m_materials[materialId];
+    if (material.texID != 0 && m_texMgr) m_texMgr->releaseTexture(material.texID);
+    material.texID = texID;
     return true;
 }
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "MeshSimplifier.h"
+#include <algorithm>
+#include <numeric>
+#include <unordered_map>
+#include <cmath>
+
+MeshSimplifier::MeshSimplifier(const std::vector<Eigen::Vector3f>& positions, const std::vector<unsigned int>& triangles,
+    const std::vector<uint8_t>& locked)
+    : m_positions(positions), m_tris(triangles.begin(), triangles.end())
+{
+    const size_t numVerts = positions.size();
+    const size_t numTris = m_tris.size() / 3;
+    m_locked = locked;
+    m_locked.resize(numVerts, 0);
+    m_vertTris.resize(numVerts);
+    m_quadrics.assign(numVerts, Quadric::Zero());
+    m_stamps.assign(numVerts, 0);
+    m_triAlive.assign(numTris, 1);
+
+    for (size_t t = 0; t < numTris; t++)
+    {
+        const uint32_t a = m_tris[3 * t], b = m_tris[3 * t + 1], c = m_tris[3 * t + 2];
+        if (a == b || b == c || c == a)
+        {
+            m_triAlive[t] = 0;
+            continue;
+        }
+        m_numLive++;
+        m_vertTris[a].push_back(uint32_t(t));
+        m_vertTris[b].push_back(uint32_t(t));
+        m_vertTris[c].push_back(uint32_t(t));
+
+        // Plane quadric, unweighted, so the cost is a sum of squared distances to the original planes
+        Eigen::Vector3d n = (positions[b] - positions[a]).cross(positions[c] - positions[a]).cast<double>();
+        const double len = n.norm();
+        if (len < 1e-20) continue;
+        n /= len;
+        Eigen::Vector4d plane;
+        plane << n, -n.dot(positions[a].cast<double>());
+        const Quadric K = plane * plane.transpose();
+        m_quadrics[a] += K;
+        m_quadrics[b] += K;
+        m_quadrics[c] += K;
+    }
+
+    // Open boundary edges, found on position-welded ids so seams do not count as boundaries
+    std::vector<uint32_t> welded;
+    weldPositions(positions, welded);
+    std::unordered_map<uint64_t, uint32_t> edgeCount;
+    auto edgeKey = [&](uint32_t u, uint32_t v) {
+        u = welded[u]; v = welded[v];
+        if (u > v) std::swap(u, v);
+        return (uint64_t)u << 32 | v;
+    };
+    for (size_t t = 0; t < numTris; t++)
+    {
+        if (!m_triAlive[t]) continue;
+        for (int e = 0; e < 3; e++) edgeCount[edgeKey(m_tris[3 * t + e], m_tris[3 * t + (e + 1) % 3])]++;
+    }
+    for (size_t t = 0; t < numTris; t++)
+    {
+        if (!m_triAlive[t]) continue;
+        for (int e = 0; e < 3; e++)
+        {
+            const uint32_t u = m_tris[3 * t + e], v = m_tris[3 * t + (e + 1) % 3];
+            if (edgeCount[edgeKey(u, v)] == 1) m_locked[u] = m_locked[v] = 1;
+        }
+    }
+
+    for (size_t v = 0; v < numVerts; v++)
+    {
+        if (!m_vertTris[v].empty()) pushCollapses(uint32_t(v));
+    }
+}
+
+void MeshSimplifier::weldPositions(const std::vector<Eigen::Vector3f>& positions, std::vector<uint32_t>& welded)
+{
+    std::vector<uint32_t> order(positions.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](uint32_t i, uint32_t j) {
+        const Eigen::Vector3f& p = positions[i];
+        const Eigen::Vector3f& q = positions[j];
+        return p.x() != q.x() ? p.x() < q.x() : (p.y() != q.y() ? p.y() < q.y() : p.z() < q.z());
+    });
+    welded.resize(positions.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        welded[order[i]] = (i > 0 && positions[order[i]] == positions[order[i - 1]]) ? welded[order[i - 1]] : order[i];
+    }
+}
+
+double MeshSimplifier::collapseCost(uint32_t from, uint32_t to) const
+{
+    Eigen::Vector4d p;
+    p << m_positions[to].cast<double>(), 1.0;
+    return p.dot((m_quadrics[from] + m_quadrics[to]) * p);
+}
+
+void MeshSimplifier::pushCollapses(uint32_t vertex)
+{
+    for (uint32_t t : m_vertTris[vertex])
+    {
+        if (!m_triAlive[t]) continue;
+        for (int c = 0; c < 3; c++)
+        {
+            const uint32_t other = m_tris[3 * size_t(t) + c];
+            if (other == vertex) continue;
+            if (!m_locked[vertex]) m_heap.push(Collapse{ collapseCost(vertex, other), vertex, other, m_stamps[vertex], m_stamps[other] });
+            if (!m_locked[other]) m_heap.push(Collapse{ collapseCost(other, vertex), other, vertex, m_stamps[other], m_stamps[vertex] });
+        }
+    }
+}
+
+bool MeshSimplifier::flipsTriangle(uint32_t from, uint32_t to) const
+{
+    for (uint32_t t : m_vertTris[from])
+    {
+        if (!m_triAlive[t]) continue;
+        const uint32_t* tri = &m_tris[3 * size_t(t)];
+        if (tri[0] == to || tri[1] == to || tri[2] == to) continue; // goes away with the collapse
+        Eigen::Vector3f corners[3];
+        for (int c = 0; c < 3; c++) corners[c] = m_positions[tri[c]];
+        const Eigen::Vector3f before = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+        for (int c = 0; c < 3; c++)
+        {
+            if (tri[c] == from) corners[c] = m_positions[to];
+        }
+        const Eigen::Vector3f after = (corners[1] - corners[0]).cross(corners[2] - corners[0]);
+        // Flipped, or squashed into a sliver at a steep angle to where it was
+        if (after.dot(before) <= 0.2f * after.norm() * before.norm()) return true;
+    }
+    return false;
+}
+
+size_t MeshSimplifier::simplify(size_t targetTriangles)
+{
+    while (m_numLive > targetTriangles && !m_heap.empty())
+    {
+        const Collapse collapse = m_heap.top();
+        m_heap.pop();
+        const uint32_t from = collapse.from, to = collapse.to;
+        if (collapse.fromStamp != m_stamps[from] || collapse.toStamp != m_stamps[to] || m_locked[from]) continue;
+        // The edge must still exist
+        bool connected = false;
+        for (uint32_t t : m_vertTris[from])
+        {
+            if (!m_triAlive[t]) continue;
+            const uint32_t* tri = &m_tris[3 * size_t(t)];
+            if (tri[0] == to || tri[1] == to || tri[2] == to) { connected = true; break; }
+        }
+        if (!connected || flipsTriangle(from, to)) continue;
+
+        m_maxCost = std::max(m_maxCost, collapse.cost);
+        for (uint32_t t : m_vertTris[from])
+        {
+            if (!m_triAlive[t]) continue;
+            uint32_t* tri = &m_tris[3 * size_t(t)];
+            if (tri[0] == to || tri[1] == to || tri[2] == to)
+            {
+                m_triAlive[t] = 0;
+                m_numLive--;
+                continue;
+            }
+            for (int c = 0; c < 3; c++)
+            {
+                if (tri[c] == from) tri[c] = to;
+            }
+            m_vertTris[to].push_back(t);
+        }
+        m_vertTris[from].clear();
+        m_vertTris[to].erase(std::remove_if(m_vertTris[to].begin(), m_vertTris[to].end(),
+            [&](uint32_t t) { return !m_triAlive[t]; }), m_vertTris[to].end());
+        m_quadrics[to] += m_quadrics[from];
+        // The removed vertex never collapses again, and every queued collapse involving either end is stale
+        m_locked[from] = 1;
+        m_stamps[from]++;
+        m_stamps[to]++;
+        pushCollapses(to);
+    }
+    return m_numLive;
+}
+
+void MeshSimplifier::getIndices(std::vector<unsigned int>& out, std::vector<uint32_t>* sourceTris) const
+{
+    out.clear();
+    out.reserve(3 * m_numLive);
+    if (sourceTris) sourceTris->clear();
+    for (size_t t = 0; t < m_triAlive.size(); t++)
+    {
+        if (!m_triAlive[t]) continue;
+        out.insert(out.end(), m_tris.begin() + 3 * t, m_tris.begin() + 3 * t + 3);
+        if (sourceTris) sourceTris->push_back(uint32_t(t));
+    }
+}
+
+float MeshSimplifier::getError() const
+{
+    return float(std::sqrt(std::max(m_maxCost, 0.0)));
+}
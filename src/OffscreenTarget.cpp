@@ -0,0 +1,143 @@
+#include "OffscreenTarget.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+OffscreenTarget::~OffscreenTarget()
+{
+    release();
+}
+
+bool OffscreenTarget::init(unsigned int width, unsigned int height, unsigned int numReadbacks)
+{
+    release();
+    m_width = width;
+    m_height = height;
+
+    glGenFramebuffers(1, &m_fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glGenRenderbuffers(1, &m_colorRB);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_colorRB);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, m_colorRB);
+    glGenRenderbuffers(1, &m_depthRB);
+    glBindRenderbuffer(GL_RENDERBUFFER, m_depthRB);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, m_depthRB);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    const GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cout << "Offscreen framebuffer is incomplete: 0x" << std::hex << status << std::dec << std::endl;
+        release();
+        return false;
+    }
+
+    const GLsizeiptr frameBytes = GLsizeiptr(width) * height * 4;
+    m_readbacks.resize(std::max(1u, numReadbacks));
+    for (auto& readback : m_readbacks)
+    {
+        glGenBuffers(1, &readback.pbo);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+        glBufferData(GL_PIXEL_PACK_BUFFER, frameBytes, nullptr, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    return true;
+}
+
+void OffscreenTarget::release()
+{
+    for (auto& readback : m_readbacks)
+    {
+        if (readback.fence) glDeleteSync(readback.fence);
+        if (readback.pbo) glDeleteBuffers(1, &readback.pbo);
+    }
+    m_readbacks.clear();
+    m_oldest = 0;
+    m_numPending = 0;
+    if (m_depthRB) glDeleteRenderbuffers(1, &m_depthRB);
+    if (m_colorRB) glDeleteRenderbuffers(1, &m_colorRB);
+    if (m_fbo) glDeleteFramebuffers(1, &m_fbo);
+    m_depthRB = m_colorRB = m_fbo = 0;
+}
+
+void OffscreenTarget::bind()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, m_fbo);
+    glViewport(0, 0, m_width, m_height);
+}
+
+void OffscreenTarget::unbind()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+bool OffscreenTarget::requestReadback(uint64_t frameId)
+{
+    if (m_numPending == m_readbacks.size()) return false;
+    Readback& readback = m_readbacks[(m_oldest + m_numPending) % m_readbacks.size()];
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, m_fbo);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    // With a pack buffer bound this only queues the copy; the CPU does not wait for it
+    glReadPixels(0, 0, m_width, m_height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    readback.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    readback.frameId = frameId;
+    m_numPending++;
+    return true;
+}
+
+bool OffscreenTarget::collectReadback(std::vector<unsigned char>& rgba, uint64_t& frameId, bool wait)
+{
+    if (m_numPending == 0) return false;
+    Readback& readback = m_readbacks[m_oldest];
+    const GLuint64 timeout = wait ? 1000000000ull : 0; // 1s per try when waiting
+    GLenum result;
+    do
+    {
+        result = glClientWaitSync(readback.fence, GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+    } while (wait && result == GL_TIMEOUT_EXPIRED);
+    if (result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED) return false;
+    glDeleteSync(readback.fence);
+    readback.fence = nullptr;
+
+    const size_t rowBytes = size_t(m_width) * 4;
+    rgba.resize(rowBytes * m_height);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.pbo);
+    const unsigned char* mapped = static_cast<const unsigned char*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, GLsizeiptr(rgba.size()), GL_MAP_READ_BIT));
+    if (mapped)
+    {
+        // GL rows start at the bottom
+        for (unsigned int y = 0; y < m_height; y++)
+        {
+            std::memcpy(&rgba[size_t(y) * rowBytes], mapped + size_t(m_height - 1 - y) * rowBytes, rowBytes);
+        }
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    frameId = readback.frameId;
+    m_oldest = (m_oldest + 1) % m_readbacks.size();
+    m_numPending--;
+    return mapped != nullptr;
+}
+
+bool OffscreenTarget::writePPM(const std::string& path, unsigned int width, unsigned int height, const std::vector<unsigned char>& rgba)
+{
+    FILE* file = std::fopen(path.c_str(), "wb");
+    if (!file) return false;
+    std::fprintf(file, "P6\n%u %u\n255\n", width, height);
+    std::vector<unsigned char> rgb(size_t(width) * height * 3);
+    for (size_t i = 0; i < size_t(width) * height; i++)
+    {
+        rgb[3 * i + 0] = rgba[4 * i + 0];
+        rgb[3 * i + 1] = rgba[4 * i + 1];
+        rgb[3 * i + 2] = rgba[4 * i + 2];
+    }
+    const bool ok = std::fwrite(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    std::fclose(file);
+    return ok;
+}
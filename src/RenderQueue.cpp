@@ -0,0 +1,251 @@
+#include "RenderQueue.h"
+#include "Mesh.h"
+#include "Shader.h"
+#include "Frustum.h"
+#include <algorithm>
+#include <map>
+
+bool RenderState::useProgram(GLuint id)
+{
+	if (program == id) return false;
+	glUseProgram(id);
+	program = id;
+	numShaderChanges++;
+	return true;
+}
+
+void RenderState::bindTexture(GLuint id)
+{
+	if (texture == id) return;
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_2D, id);
+	texture = id;
+	numTextureChanges++;
+}
+
+void RenderState::bindVertexArray(GLuint id)
+{
+	if (vao == id) return;
+	glBindVertexArray(id);
+	vao = id;
+	numVAOChanges++;
+}
+
+void RenderState::reset()
+{
+	*this = RenderState();
+}
+
+RenderQueue::~RenderQueue()
+{
+	release();
+}
+
+uint64_t RenderQueue::sortKey(GLuint program, GLuint texture, GLuint vao)
+{
+	// GL names are small sequential integers, so 20 bits each is plenty
+	return (uint64_t(program) & 0xFFFFF) << 40 | (uint64_t(texture) & 0xFFFFF) << 20 | (uint64_t(vao) & 0xFFFFF);
+}
+
+static GLuint materialTexture(const Mesh& mesh, const Mesh::BasicMeshEntry& entry)
+{
+	return entry.MaterialIndex < mesh.m_materials.size() ? mesh.m_materials[entry.MaterialIndex].texID : 0;
+}
+
+bool RenderQueue::isBatchable(Mesh& mesh)
+{
+	if (!mesh.IsStatic() || !mesh.m_shader || mesh.GetVAO() == 0) return false;
+	if (mesh.GetNumInstances() > 0 || mesh.GetNumLODs() > 0 || mesh.GetNumClusters() > 0) return false;
+	if (mesh.GetNormalSource() != Mesh::NORMALS_CPU) return false;
+	// Wait for streamed textures, so the placeholder is never baked in
+	for (const auto& material : mesh.m_materials)
+	{
+		if (material.texID == 0 && !material.texturePath.empty()) return false;
+	}
+	return true;
+}
+
+bool RenderQueue::isBatched(const Mesh* mesh) const
+{
+	return std::binary_search(m_batchedMeshes.begin(), m_batchedMeshes.end(), mesh);
+}
+
+// FNV-1a
+static void hashBytes(uint64_t& hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = static_cast<const unsigned char*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+}
+
+void RenderQueue::updateBatches(const std::vector<std::shared_ptr<Mesh>>& models)
+{
+	std::vector<Mesh*> batchable;
+	uint64_t signature = 14695981039346656037ull;
+	for (const auto& mesh : models)
+	{
+		if (!mesh || !isBatchable(*mesh)) continue;
+		batchable.push_back(mesh.get());
+		const Mesh* ptr = mesh.get();
+		const Shader* shader = mesh->m_shader.get();
+		const Eigen::Matrix4f modelMtx = mesh->GetModelMtx();
+		hashBytes(signature, &ptr, sizeof(ptr));
+		hashBytes(signature, &shader, sizeof(shader));
+		hashBytes(signature, modelMtx.data(), sizeof(float) * 16);
+		for (const auto& material : mesh->m_materials)
+		{
+			hashBytes(signature, &material.texID, sizeof(material.texID));
+		}
+	}
+	if (signature == m_signature) return;
+	release();
+	m_signature = signature;
+	m_batchedMeshes.assign(batchable.begin(), batchable.end());
+	std::sort(m_batchedMeshes.begin(), m_batchedMeshes.end());
+	// One arena per shader
+	std::map<const Shader*, std::vector<Mesh*>> byShader;
+	for (Mesh* mesh : batchable) byShader[mesh->m_shader.get()].push_back(mesh);
+	for (auto& group : byShader)
+	{
+		m_batches.emplace_back();
+		buildBatch(m_batches.back(), group.second);
+	}
+}
+
+void RenderQueue::buildBatch(Batch& batch, const std::vector<Mesh*>& meshes)
+{
+	batch.shader = meshes.front()->m_shader;
+	std::vector<Eigen::Vector3f> positions;
+	std::vector<Eigen::Vector2f> texCoords;
+	std::vector<Eigen::Vector3f> normals;
+	// Submeshes are gathered first and sorted by texture before their indices are laid out
+	struct Source { const Mesh* mesh; const Mesh::BasicMeshEntry* entry; uint32_t arenaBaseVertex; GLuint texture; };
+	std::vector<Source> sources;
+	for (Mesh* mesh : meshes)
+	{
+		const uint32_t arenaBase = uint32_t(positions.size());
+		const Eigen::Matrix4f modelMtx = mesh->GetModelMtx();
+		const Eigen::Matrix3f normalMtx = modelMtx.topLeftCorner<3, 3>().inverse().transpose();
+		const Eigen::Map<const Eigen::VectorXf> meshPositions = mesh->GetPositions();
+		const auto& meshNormals = mesh->GetNormals();
+		const auto& meshTexCoords = mesh->GetTexCoords();
+		const uint32_t numVerts = uint32_t(meshPositions.size() / 3);
+		for (uint32_t v = 0; v < numVerts; v++)
+		{
+			const Eigen::Vector3f p = meshPositions.segment<3>(3 * size_t(v));
+			positions.push_back((modelMtx * p.homogeneous()).head<3>());
+			normals.push_back(v < meshNormals.size() ? (normalMtx * meshNormals[v]).normalized() : Eigen::Vector3f::UnitY());
+			texCoords.push_back(v < meshTexCoords.size() ? meshTexCoords[v] : Eigen::Vector2f::Zero());
+		}
+		for (const auto& entry : mesh->m_meshes)
+		{
+			sources.push_back(Source{ mesh, &entry, arenaBase, materialTexture(*mesh, entry) });
+		}
+	}
+	std::stable_sort(sources.begin(), sources.end(), [](const Source& a, const Source& b) { return a.texture < b.texture; });
+
+	// Indices are rebased onto the arena, so neighbouring ranges merge into one draw when all are visible
+	std::vector<unsigned int> indices;
+	for (const Source& source : sources)
+	{
+		const auto& meshIndices = source.mesh->GetIndices();
+		const Mesh::BasicMeshEntry& entry = *source.entry;
+		Range range;
+		range.texture = source.texture;
+		range.firstIndex = uint32_t(indices.size());
+		range.numIndices = entry.NumIndices;
+		for (uint32_t i = 0; i < entry.NumIndices; i++)
+		{
+			const unsigned int vertex = source.arenaBaseVertex + entry.BaseVertex + meshIndices[entry.BaseIndex + i];
+			indices.push_back(vertex);
+			range.bounds.expand(positions[vertex]);
+		}
+		batch.ranges.push_back(range);
+	}
+
+	glGenVertexArrays(1, &batch.vao);
+	glBindVertexArray(batch.vao);
+	glGenBuffers(4, batch.buffers);
+	// Same attribute locations as Mesh, so the scene shaders draw batches unchanged
+	glBindBuffer(GL_ARRAY_BUFFER, batch.buffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(positions[0]) * positions.size(), positions.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.buffers[1]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(texCoords[0]) * texCoords.size(), texCoords.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(1);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, batch.buffers[2]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(normals[0]) * normals.size(), normals.data(), GL_STATIC_DRAW);
+	glEnableVertexAttribArray(2);
+	glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, 0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, batch.buffers[3]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices[0]) * indices.size(), indices.data(), GL_STATIC_DRAW);
+	glBindVertexArray(0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+void RenderQueue::renderBatches(const Eigen::Matrix4f& viewMtx, const Eigen::Matrix4f& projMtx, const Frustum* frustum,
+	RenderState& state, uint32_t& numDrawn, uint32_t& numCulled)
+{
+	// Already in world space: the model matrix is the identity
+	const Eigen::Matrix4f MVP = projMtx * viewMtx;
+	const Eigen::Matrix4f NormalMtx = viewMtx.inverse().transpose();
+	for (Batch& batch : m_batches)
+	{
+		state.useProgram(batch.shader->ID);
+		const Shader& shader = *batch.shader;
+		shader.setMat4(shader.getUniformLocation(Shader::U_MVP), MVP.data());
+		shader.setMat4(shader.getUniformLocation(Shader::U_MV), viewMtx.data());
+		shader.setMat4(shader.getUniformLocation(Shader::U_NORMAL_MTX), NormalMtx.data());
+		shader.setBool(shader.getUniformLocation(Shader::U_GPU_NORMALS), false);
+		shader.setBool(shader.getUniformLocation(Shader::U_INSTANCED), false);
+		state.bindVertexArray(batch.vao);
+		size_t i = 0;
+		while (i < batch.ranges.size())
+		{
+			const GLuint texture = batch.ranges[i].texture;
+			m_drawCounts.clear();
+			m_drawOffsets.clear();
+			uint32_t rangeEnd = 0xFFFFFFFF;
+			for (; i < batch.ranges.size() && batch.ranges[i].texture == texture; i++)
+			{
+				const Range& range = batch.ranges[i];
+				if (frustum && !frustum->intersects(range.bounds))
+				{
+					numCulled++;
+					continue;
+				}
+				numDrawn++;
+				if (range.firstIndex == rangeEnd)
+				{
+					m_drawCounts.back() += GLsizei(range.numIndices);
+				}
+				else
+				{
+					m_drawCounts.push_back(GLsizei(range.numIndices));
+					m_drawOffsets.push_back((const void*)(sizeof(unsigned int) * range.firstIndex));
+				}
+				rangeEnd = range.firstIndex + range.numIndices;
+			}
+			if (m_drawCounts.empty()) continue;
+			state.bindTexture(texture);
+			glMultiDrawElements(GL_TRIANGLES, m_drawCounts.data(), GL_UNSIGNED_INT, m_drawOffsets.data(), GLsizei(m_drawCounts.size()));
+			state.numDrawCalls++;
+		}
+	}
+}
+
+void RenderQueue::release()
+{
+	for (Batch& batch : m_batches)
+	{
+		glDeleteBuffers(4, batch.buffers);
+		glDeleteVertexArrays(1, &batch.vao);
+	}
+	m_batches.clear();
+	m_batchedMeshes.clear();
+	m_signature = 0;
+}
@@ -3,8 +3,13 @@
 #include "Mesh.h"
 #include "Camera.h"
 #include "Shader.h"
+#include "Frustum.h"
+#include "SimCacheReader.h"
+#include <algorithm>
+#include <thread>
+#include <chrono>
 
-Scene::Scene() : SCR_WIDTH(2560), SCR_HEIGHT(1440), TIME_STATE_MULT(1.0f), title("DK Viewer")
+Scene::Scene(unsigned int width, unsigned int height) : SCR_WIDTH(width), SCR_HEIGHT(height), TIME_STATE_MULT(1.0f), title("DK Viewer")
 {
     camera = std::make_shared<Camera>();
     camera->FOV = 45.0f;
@@ -18,19 +23,330 @@ Scene::~Scene()
 {
     glDeleteVertexArrays(1, &m_gridVAO);
     glDeleteBuffers(1, &m_gridVBO);
+    glDeleteBuffers(1, &m_frameUBO);
 }
 
-std::shared_ptr<Mesh> Scene::LoadModel(const std::string& file_path)
+// CPU mirror of the std140 FrameData block declared in the shaders. Every member is either a mat4,
+// a vec4 or a scalar at a 16 byte boundary, so the C++ layout matches std140 as-is.
+struct FrameData {
+    Eigen::Matrix4f viewMtx;
+    Eigen::Matrix4f projMtx;
+    Eigen::Vector4f lightPos;
+    Eigen::Vector4f lightColor;
+    Eigen::Vector4f wireColor;
+    int32_t doWire;
+    int32_t pad[3];
+};
+static_assert(sizeof(FrameData) == 192, "FrameData must match the std140 layout of the GLSL block");
+
+void Scene::UpdateFrameData(const Eigen::Matrix4f& viewMtx)
+{
+    if (m_frameUBO == 0)
+    {
+        glGenBuffers(1, &m_frameUBO);
+        glBindBuffer(GL_UNIFORM_BUFFER, m_frameUBO);
+        glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameData), nullptr, GL_DYNAMIC_DRAW);
+        glBindBufferBase(GL_UNIFORM_BUFFER, Shader::FRAME_DATA_BINDING, m_frameUBO);
+    }
+    FrameData data;
+    data.viewMtx = viewMtx;
+    data.projMtx = camera->projectionMtx;
+    // For now we pin the light to the camera, and the light color is a static white
+    data.lightPos << camera->position, 1.0f;
+    data.lightColor = Eigen::Vector4f(1.0f, 1.0f, 1.0f, 1.0f);
+    data.wireColor << m_wireColor, 1.0f;
+    data.doWire = m_doWire ? 1 : 0;
+    glBindBuffer(GL_UNIFORM_BUFFER, m_frameUBO);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameData), &data);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+std::shared_ptr<Mesh> Scene::LoadModel(const std::string& file_path, bool shared)
 {
+    AssetKey key;
+    const bool cacheable = shared && AssetHash::makeKey(file_path, key);
+    if (cacheable)
+    {
+        if (std::shared_ptr<Mesh> cached = m_meshCache.find(key.str()))
+        {
+            if (std::find(models.begin(), models.end(), cached) == models.end())
+            {
+                models.push_back(cached);
+            }
+            return cached;
+        }
+    }
     std::shared_ptr<Mesh> newMesh = static_cast<bool>(texMgr) ? std::make_shared<Mesh>(texMgr) : std::make_shared<Mesh>();
-    if (!newMesh->LoadFileTinyObj(file_path))
+    if (!newMesh->LoadFileTinyObj(file_path, false))
     {
         return nullptr;
     };
+    PrepareMesh(*newMesh, m_autoLODTriangles, m_autoClusterTriangles);
+    newMesh->UploadToGPU();
+    if (cacheable)
+    {
+        m_meshCache.insert(key.str(), newMesh, newMesh->GetMemoryUsage());
+    }
     models.push_back(newMesh);
     return newMesh;
 }
 
+void Scene::LoadModelAsync(const std::string& file_path, bool shared, std::function<void(std::shared_ptr<Mesh>)> onReady)
+{
+    AssetKey key;
+    const bool cacheable = shared && AssetHash::makeKey(file_path, key);
+    if (cacheable)
+    {
+        if (std::shared_ptr<Mesh> cached = m_meshCache.find(key.str()))
+        {
+            if (std::find(models.begin(), models.end(), cached) == models.end())
+            {
+                models.push_back(cached);
+            }
+            if (onReady) onReady(cached);
+            return;
+        }
+    }
+    // Created lazily, so it picks up the texMgr set after construction
+    if (!m_loader) m_loader = std::make_unique<AssetLoader>(texMgr);
+    const std::string cacheKey = cacheable ? key.str() : std::string();
+    const uint32_t autoLODTriangles = m_autoLODTriangles;
+    const uint32_t autoClusterTriangles = m_autoClusterTriangles;
+    auto prepare = [autoLODTriangles, autoClusterTriangles](Mesh& mesh) { PrepareMesh(mesh, autoLODTriangles, autoClusterTriangles); };
+    m_loader->loadMesh(file_path, [this, cacheKey, onReady](std::shared_ptr<Mesh> newMesh) {
+        if (newMesh)
+        {
+            if (!cacheKey.empty())
+            {
+                m_meshCache.insert(cacheKey, newMesh, newMesh->GetMemoryUsage());
+            }
+            models.push_back(newMesh);
+        }
+        if (onReady) onReady(newMesh);
+    }, prepare);
+}
+
+void Scene::PrepareMesh(Mesh& mesh, uint32_t autoLODTriangles, uint32_t autoClusterTriangles)
+{
+    if (autoClusterTriangles > 0 && mesh.GetNumTriangles() > autoClusterTriangles) mesh.BuildClusters();
+    if (autoLODTriangles > 0 && mesh.GetNumTriangles() > autoLODTriangles) mesh.GenerateLODs();
+}
+
+void Scene::SelectLOD(Mesh& mesh)
+{
+    if (mesh.GetNumLODs() == 0) return;
+    // Distance to the nearest point of the bounding sphere, and the largest axis scale of the model matrix,
+    // turn the object space error into pixels
+    const AABB& bounds = mesh.GetWorldBounds();
+    const float distance = std::max(camera->NEAR, (camera->position - bounds.center()).norm() - 0.5f * bounds.size().norm());
+    const float scale = mesh.GetModelMtx().block<3, 3>(0, 0).colwise().norm().maxCoeff();
+    const float pixelsPerUnit = scale * float(SCR_HEIGHT) / (2.0f * tanf(ToRadian(camera->FOV / 2.0f)) * distance);
+    mesh.SelectLOD(pixelsPerUnit, m_lodThresholdPx);
+}
+
+void Scene::SetAutoLODTriangles(uint32_t numTriangles)
+{
+    m_autoLODTriangles = numTriangles;
+}
+
+void Scene::SetLODThreshold(float pixels)
+{
+    m_lodThresholdPx = pixels;
+}
+
+float Scene::GetLODThreshold()
+{
+    return m_lodThresholdPx;
+}
+
+void Scene::SetFrustumCulling(bool state)
+{
+    m_doCulling = state;
+}
+
+bool Scene::IsFrustumCulling()
+{
+    return m_doCulling;
+}
+
+void Scene::SetAutoClusterTriangles(uint32_t numTriangles)
+{
+    m_autoClusterTriangles = numTriangles;
+}
+
+void Scene::SetClusterConeCulling(bool state)
+{
+    m_doConeCulling = state;
+}
+
+bool Scene::IsClusterConeCulling()
+{
+    return m_doConeCulling;
+}
+
+uint32_t Scene::GetNumClustersDrawn()
+{
+    return m_numClustersDrawn;
+}
+
+uint32_t Scene::GetNumClustersCulled()
+{
+    return m_numClustersCulled;
+}
+
+uint32_t Scene::GetNumDrawn()
+{
+    return m_numDrawn;
+}
+
+uint32_t Scene::GetNumCulled()
+{
+    return m_numCulled;
+}
+
+void Scene::SetStaticBatching(bool state)
+{
+    m_doBatching = state;
+}
+
+bool Scene::IsStaticBatching()
+{
+    return m_doBatching;
+}
+
+uint32_t Scene::GetNumBatchedMeshes()
+{
+    return uint32_t(m_renderQueue.getNumBatchedMeshes());
+}
+
+uint32_t Scene::GetNumStateChanges()
+{
+    return m_renderState.getNumStateChanges();
+}
+
+uint32_t Scene::GetNumDrawCalls()
+{
+    return m_renderState.numDrawCalls;
+}
+
+bool Scene::PlaySimCache(const std::string& file_path, const int model_id)
+{
+    StopSimCache();
+    if (model_id < 0 || model_id >= int(models.size())) return false;
+    auto reader = std::make_unique<SimCacheReader>();
+    if (!reader->open(file_path)) return false;
+    if (reader->getNumVerts() != models[model_id]->GetNumVerts() || reader->getNumFrames() == 0)
+    {
+        std::cout << file_path << " does not match model " << model_id << std::endl;
+        return false;
+    }
+    m_simCache = std::move(reader);
+    m_simCacheMesh = models[model_id];
+    m_simCacheFrame = 0;
+    m_simCacheShown = -1;
+    m_simCacheScrub = -1;
+    return true;
+}
+
+void Scene::StopSimCache()
+{
+    m_simCache.reset();
+    m_simCacheMesh.reset();
+    m_simCacheShown = -1;
+    m_simCacheScrub = -1;
+}
+
+bool Scene::HasSimCache()
+{
+    return static_cast<bool>(m_simCache);
+}
+
+uint32_t Scene::GetSimCacheNumFrames()
+{
+    return m_simCache ? m_simCache->getNumFrames() : 0;
+}
+
+void Scene::SetSimCacheFrame(uint32_t frame)
+{
+    if (!m_simCache) return;
+    m_simCacheScrub = std::min(frame, m_simCache->getNumFrames() - 1);
+}
+
+uint32_t Scene::GetSimCacheFrame()
+{
+    return m_simCacheScrub >= 0 ? uint32_t(m_simCacheScrub) : m_simCacheFrame;
+}
+
+void Scene::SetSimCachePaused(bool state)
+{
+    m_simCachePaused = state;
+}
+
+bool Scene::IsSimCachePaused()
+{
+    return m_simCachePaused;
+}
+
+void Scene::UpdateSimCache()
+{
+    if (!m_simCache) return;
+    if (!m_simCachePaused && m_simCacheShown >= 0)
+    {
+        m_simCacheFrame = (m_simCacheFrame + 1) % m_simCache->getNumFrames();
+    }
+    // A scrub lands on exactly the frame asked for, even while playing
+    if (m_simCacheScrub >= 0)
+    {
+        m_simCacheFrame = uint32_t(m_simCacheScrub);
+        m_simCacheScrub = -1;
+    }
+    if (int64_t(m_simCacheFrame) == m_simCacheShown) return;
+    if (m_simCache->readFrame(m_simCacheFrame, m_simCacheMesh->MapPositions().data()))
+    {
+        m_simCacheMesh->MarkPositionsDirty();
+        m_simCacheShown = m_simCacheFrame;
+    }
+    // Keep a second's worth of frames decoded ahead of the playhead
+    m_simCache->prefetch(m_simCacheFrame + 1, 60);
+}
+
+void Scene::SetUploadBudget(double ms)
+{
+    m_uploadBudgetMs = ms;
+}
+
+size_t Scene::GetNumPendingLoads() const
+{
+    return m_loader ? m_loader->getNumPending() : 0;
+}
+
+void Scene::WaitForLoads()
+{
+    if (!m_loader) return;
+    while (m_loader->getNumPending() > 0)
+    {
+        if (m_loader->processUploads(m_uploadBudgetMs) == 0)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    }
+}
+
+void Scene::SetViewportSize(unsigned int width, unsigned int height)
+{
+    if (width == 0 || height == 0) return; // minimized
+    SCR_WIDTH = width;
+    SCR_HEIGHT = height;
+    glViewport(0, 0, width, height);
+    camera->ASPECT_RATIO = (float)width / (float)height;
+    camera->updateProjMtx();
+}
+
+void Scene::SetMeshCacheBudget(size_t bytes)
+{
+    m_meshCache.setBudget(bytes);
+}
+
 void Scene::SetupGrid()
 {
     m_doGrid = true;
@@ -59,6 +375,11 @@ void Scene::SetupGrid()
 
 void Scene::Render(const Eigen::Matrix4f& viewMtx)
 {
+    // Finish off whatever the loader threads have ready, within the frame's upload budget
+    if (m_loader) m_loader->processUploads(m_uploadBudgetMs);
+    UpdateSimCache();
+    // Camera, light and wireframe state go out once per frame, shared by every shader
+    UpdateFrameData(viewMtx);
     if (m_doGrid)
     {
         Eigen::Matrix4f MV = viewMtx * Eigen::Matrix4f::Identity();
@@ -69,31 +390,69 @@ void Scene::Render(const Eigen::Matrix4f& viewMtx)
         gridShader->setMat4("MVP", MVP.data());
         gridShader->setMat4("MV", MV.data());
         gridShader->setMat4("NormalMtx", NormalMtx.data());
-        gridShader->setMat4("ViewMtx", viewMtx.data());
         DrawGrid();
     }
-    // Static light color - white
-    Eigen::Vector3f lightColor = Eigen::Vector3f(1.0f, 1.0f, 1.0f);
-    // For now we pin the light to the camera
-    Eigen::Vector3f lightPos = camera->position;
-    for (auto mesh : models)
+    CullView view;
+    view.viewProj = camera->projectionMtx * viewMtx;
+    view.frustum.update(view.viewProj);
+    view.cameraPos = camera->position;
+    view.coneCulling = m_doConeCulling;
+    m_numDrawn = 0;
+    m_numCulled = 0;
+    m_numClustersDrawn = 0;
+    m_numClustersCulled = 0;
+    // The grid and ImGui bind behind the state's back, so it starts from scratch every frame
+    m_renderState.reset();
+    if (m_doBatching)
+    {
+        m_renderQueue.updateBatches(models);
+        m_renderQueue.renderBatches(viewMtx, camera->projectionMtx, m_doCulling ? &view.frustum : nullptr,
+            m_renderState, m_numDrawn, m_numCulled);
+    }
+    else
     {
+        m_renderQueue.release();
+    }
+    m_drawList.clear();
+    for (auto& mesh : models)
+    {
+        if (!mesh->m_shader || m_renderQueue.isBatched(mesh.get())) continue;
+        if (m_doCulling && !view.frustum.intersects(mesh->GetWorldBounds()))
+        {
+            m_numCulled += uint32_t(mesh->m_meshes.size());
+            m_numClustersCulled += mesh->GetNumClusters();
+            continue;
+        }
+        const GLuint texture = mesh->m_materials.empty() ? 0 : mesh->m_materials[0].texID;
+        m_drawList.emplace_back(RenderQueue::sortKey(mesh->m_shader->ID, texture, mesh->GetVAO()), mesh.get());
+    }
+    std::sort(m_drawList.begin(), m_drawList.end());
+    for (auto& item : m_drawList)
+    {
+        Mesh* mesh = item.second;
+        SelectLOD(*mesh);
         Eigen::Matrix4f MV = viewMtx * mesh->GetModelMtx();
         Eigen::Matrix4f MVP = camera->projectionMtx * MV;
         Eigen::Matrix4f NormalMtx = MV.inverse().transpose();
+        // Leaves VAO 0 bound behind the state's back, which is harmless: every mesh has its own VAO, so the
+        // state never skips the bind of the one drawn next
         mesh->UpdatePositionBuffer();
-        mesh->m_shader->use();
-        // Bind view and projection matrices
-        mesh->m_shader->setMat4("MVP", MVP.data());
-        mesh->m_shader->setMat4("MV", MV.data());
-        mesh->m_shader->setMat4("NormalMtx", NormalMtx.data());
-        mesh->m_shader->setMat4("ViewMtx", viewMtx.data());
-        // Bind the light color and pos
-        mesh->m_shader->setVec3("lightColor", lightColor.data());
-        mesh->m_shader->setVec3("lightPos", lightPos.data());
-        //shader.setMat4("transform", final.data());
-        mesh->Render();
+        m_renderState.useProgram(mesh->m_shader->ID);
+        // Only the per-object matrices are set per draw
+        const Shader& shader = *mesh->m_shader;
+        shader.setMat4(shader.getUniformLocation(Shader::U_MVP), MVP.data());
+        shader.setMat4(shader.getUniformLocation(Shader::U_MV), MV.data());
+        shader.setMat4(shader.getUniformLocation(Shader::U_NORMAL_MTX), NormalMtx.data());
+        shader.setBool(shader.getUniformLocation(Shader::U_GPU_NORMALS), mesh->GetNormalSource() == Mesh::NORMALS_GPU_FLAT);
+        shader.setBool(shader.getUniformLocation(Shader::U_INSTANCED), mesh->GetNumInstances() > 0);
+        const uint32_t numDrawn = mesh->Render(m_doCulling ? &view : nullptr, &m_renderState);
+        m_numDrawn += numDrawn;
+        m_numCulled += uint32_t(mesh->m_meshes.size()) - numDrawn;
+        m_numClustersDrawn += mesh->GetNumVisibleClusters();
+        m_numClustersCulled += mesh->GetNumCulledClusters();
     }
+    // Make sure the VAO is not changed from the outside
+    glBindVertexArray(0);
 }
 
 void Scene::TranslateModel(const int model_id, Eigen::Vector3f& translation)
@@ -118,6 +477,16 @@ void Scene::TransformModel(const int model_id, Eigen::Matrix4f& transform)
 {
 }
 
+uint32_t Scene::InstanceModel(const int model_id, const Eigen::Matrix4f& transform)
+{
+    // The first extra copy turns the model into an instanced one, so keep its original placement as instance 0
+    if (models[model_id]->GetNumInstances() == 0)
+    {
+        models[model_id]->AddInstance(Eigen::Matrix4f::Identity());
+    }
+    return models[model_id]->AddInstance(transform);
+}
+
 void Scene::SetGridShader(std::shared_ptr<Shader> _gridShader)
 {
     gridShader = _gridShader;
@@ -155,22 +524,18 @@ uint32_t Scene::GetNumEdges()
 
 void Scene::ShowWireframe()
 {
-    for (auto& shader : shaders)
-    {
-        m_doWire = true;
-        shader->use();
-        shader->setBool("doWire", m_doWire);
-    }
+    // Picked up by every shader through the FrameData block on the next Render
+    m_doWire = true;
 }
 
 void Scene::HideWireframe()
 {
-    for (auto& shader : shaders)
-    {
-        m_doWire = false;
-        shader->use();
-        shader->setBool("doWire", m_doWire);
-    }
+    m_doWire = false;
+}
+
+void Scene::SetWireColor(const Eigen::Vector3f& color)
+{
+    m_wireColor = color;
 }
 
 void Scene::DrawGrid()
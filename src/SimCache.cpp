@@ -0,0 +1,349 @@
+#include "SimCache.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+	const uint32_t PROB_BITS = 12;
+	const uint32_t PROB_SCALE = 1u << PROB_BITS;
+	const uint32_t RANS_L = 1u << 23;
+
+	uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+	int32_t unzigzag(uint32_t v) { return int32_t(v >> 1) ^ -int32_t(v & 1); }
+
+	void putVarint(std::vector<uint8_t>& out, uint32_t v)
+	{
+		while (v >= 0x80)
+		{
+			out.push_back(uint8_t(v | 0x80));
+			v >>= 7;
+		}
+		out.push_back(uint8_t(v));
+	}
+
+	bool getVarint(const uint8_t*& p, const uint8_t* end, uint32_t& v)
+	{
+		v = 0;
+		for (int shift = 0; shift < 35; shift += 7)
+		{
+			if (p == end) return false;
+			const uint8_t byte = *p++;
+			v |= uint32_t(byte & 0x7F) << shift;
+			if (!(byte & 0x80)) return true;
+		}
+		return false;
+	}
+
+	template <typename T>
+	void append(std::vector<uint8_t>& out, const T& value)
+	{
+		const size_t at = out.size();
+		out.resize(at + sizeof(T));
+		std::memcpy(&out[at], &value, sizeof(T));
+	}
+
+	int32_t maxQuantized(uint32_t bits) { return int32_t((1u << bits) - 1); }
+
+	SimCache::Grid makeGrid(const float* values, uint32_t numVerts, uint32_t bits)
+	{
+		SimCache::Grid grid;
+		float lo[3], hi[3];
+		float extent = 0.0f;
+		for (int a = 0; a < 3; a++)
+		{
+			lo[a] = INFINITY;
+			hi[a] = -INFINITY;
+			for (uint32_t i = 0; i < numVerts; i++)
+			{
+				const float v = values[3 * size_t(i) + a];
+				if (!std::isfinite(v)) continue;
+				lo[a] = std::min(lo[a], v);
+				hi[a] = std::max(hi[a], v);
+			}
+			if (lo[a] > hi[a]) lo[a] = hi[a] = 0.0f;
+			extent = std::max(extent, hi[a] - lo[a]);
+		}
+		// Room for the chunk to move in without leaving the grid. Sized by the largest axis, so a cloth that
+		// starts flat still has room to fall or fold along the axis it is flat in.
+		const float margin = 0.5f * extent + 1e-3f;
+		for (int a = 0; a < 3; a++)
+		{
+			grid.min[a] = lo[a] - margin;
+			grid.step[a] = std::max((hi[a] - lo[a] + 2.0f * margin) / float(maxQuantized(bits)), 1e-12f);
+		}
+		return grid;
+	}
+
+	// Returns false if a value falls off the grid; with clamp it is pulled back on instead
+	bool quantize(const float* values, uint32_t numVerts, const SimCache::Grid& grid, uint32_t bits, bool clamp, int32_t* out)
+	{
+		const double maxQ = maxQuantized(bits);
+		for (size_t i = 0; i < 3 * size_t(numVerts); i++)
+		{
+			const int a = int(i % 3);
+			double t = std::round((double(values[i]) - grid.min[a]) / grid.step[a]);
+			if (!(t >= 0.0 && t <= maxQ))
+			{
+				if (!clamp) return false;
+				t = t > maxQ ? maxQ : 0.0; // NaN lands on 0
+			}
+			out[i] = int32_t(t);
+		}
+		return true;
+	}
+
+	int32_t predict(const std::vector<int32_t>& current, const std::vector<int32_t>& prev, const std::vector<int32_t>& prev2,
+		bool keyframe, uint32_t framesSinceKey, size_t i, size_t channelStart)
+	{
+		if (keyframe) return i >= channelStart + 3 ? current[i - 3] : 0;
+		return framesSinceKey >= 2 ? 2 * prev[i] - prev2[i] : prev[i];
+	}
+}
+
+size_t SimCache::recordSize(const FrameHeader& header, int numChannels)
+{
+	return sizeof(FrameHeader) + ((header.flags & KEYFRAME) ? numChannels * sizeof(Grid) : 0) + header.payloadSize;
+}
+
+void SimCache::ransEncode(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+	out.clear();
+	if (size == 0) return;
+	uint64_t counts[256] = { 0 };
+	for (size_t i = 0; i < size; i++) counts[data[i]]++;
+
+	// Scale to PROB_SCALE, keeping every present symbol at 1 or more
+	uint32_t freq[256] = { 0 };
+	uint32_t sum = 0;
+	int largest = 0;
+	for (int s = 0; s < 256; s++)
+	{
+		if (!counts[s]) continue;
+		freq[s] = std::max<uint32_t>(1, uint32_t(counts[s] * PROB_SCALE / size));
+		sum += freq[s];
+		if (freq[s] > freq[largest]) largest = s;
+	}
+	if (sum < PROB_SCALE) freq[largest] += PROB_SCALE - sum;
+	while (sum > PROB_SCALE)
+	{
+		int s = int(std::max_element(freq, freq + 256) - freq);
+		freq[s]--;
+		sum--;
+	}
+	uint32_t cum[256];
+	uint32_t numSymbols = 0;
+	for (uint32_t s = 0, c = 0; s < 256; s++)
+	{
+		cum[s] = c;
+		c += freq[s];
+		numSymbols += freq[s] ? 1 : 0;
+	}
+
+	out.push_back(uint8_t(numSymbols - 1));
+	for (int s = 0; s < 256; s++)
+	{
+		if (!freq[s]) continue;
+		out.push_back(uint8_t(s));
+		append(out, uint16_t(freq[s] - 1)); // PROB_SCALE itself only fits this way
+	}
+	const size_t tableSize = out.size();
+
+	// rANS encodes back to front; collect the bytes reversed and flip them at the end
+	uint32_t x = RANS_L;
+	for (size_t i = size; i-- > 0;)
+	{
+		const uint32_t f = freq[data[i]];
+		const uint32_t xMax = ((RANS_L >> PROB_BITS) << 8) * f;
+		while (x >= xMax)
+		{
+			out.push_back(uint8_t(x & 0xFF));
+			x >>= 8;
+		}
+		x = ((x / f) << PROB_BITS) + (x % f) + cum[data[i]];
+	}
+	for (int shift = 24; shift >= 0; shift -= 8) out.push_back(uint8_t(x >> shift));
+	std::reverse(out.begin() + tableSize, out.end());
+}
+
+bool SimCache::ransDecode(const uint8_t* data, size_t size, uint8_t* out, size_t outSize)
+{
+	if (outSize == 0) return true;
+	const uint8_t* p = data;
+	const uint8_t* end = data + size;
+	if (p == end) return false;
+	const uint32_t numSymbols = uint32_t(*p++) + 1;
+	if (size_t(end - p) < numSymbols * 3) return false;
+	uint32_t freq[256] = { 0 };
+	for (uint32_t i = 0; i < numSymbols; i++)
+	{
+		uint16_t f;
+		const uint8_t s = *p++;
+		std::memcpy(&f, p, sizeof(f));
+		p += sizeof(f);
+		freq[s] = uint32_t(f) + 1;
+	}
+	uint32_t cum[256];
+	std::vector<uint8_t> slotSymbol(PROB_SCALE);
+	uint32_t c = 0;
+	for (uint32_t s = 0; s < 256; s++)
+	{
+		cum[s] = c;
+		if (c + freq[s] > PROB_SCALE) return false;
+		std::fill(slotSymbol.begin() + c, slotSymbol.begin() + c + freq[s], uint8_t(s));
+		c += freq[s];
+	}
+	if (c != PROB_SCALE || end - p < 4) return false;
+
+	uint32_t x = uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+	p += 4;
+	for (size_t i = 0; i < outSize; i++)
+	{
+		const uint32_t slot = x & (PROB_SCALE - 1);
+		const uint8_t s = slotSymbol[slot];
+		out[i] = s;
+		x = freq[s] * (x >> PROB_BITS) + slot - cum[s];
+		while (x < RANS_L)
+		{
+			if (p == end) return false;
+			x = (x << 8) | *p++;
+		}
+	}
+	return true;
+}
+
+SimCache::FrameEncoder::FrameEncoder(uint32_t numVerts, int numChannels, const uint32_t bits[2], uint32_t keyframeInterval, bool entropyCoding)
+	: m_numVerts(numVerts), m_numChannels(numChannels), m_keyframeInterval(std::max(1u, keyframeInterval)), m_entropyCoding(entropyCoding)
+{
+	for (int c = 0; c < 2; c++) m_bits[c] = std::min(std::max(bits[c], 4u), 24u);
+	const size_t total = size_t(numChannels) * 3 * numVerts;
+	m_prev.resize(total);
+	m_prev2.resize(total);
+	m_current.resize(total);
+}
+
+bool SimCache::FrameEncoder::nextIsKeyframe() const
+{
+	return m_frameIndex == 0 || m_framesSinceKey >= m_keyframeInterval;
+}
+
+uint32_t SimCache::FrameEncoder::encode(const float* const* channels, std::vector<uint8_t>& out)
+{
+	const size_t channelSize = 3 * size_t(m_numVerts);
+	bool keyframe = nextIsKeyframe();
+	if (!keyframe)
+	{
+		for (int c = 0; c < m_numChannels && !keyframe; c++)
+		{
+			keyframe = !quantize(channels[c], m_numVerts, m_grids[c], m_bits[c], false, &m_current[c * channelSize]);
+		}
+	}
+	if (keyframe)
+	{
+		for (int c = 0; c < m_numChannels; c++)
+		{
+			m_grids[c] = makeGrid(channels[c], m_numVerts, m_bits[c]);
+			quantize(channels[c], m_numVerts, m_grids[c], m_bits[c], true, &m_current[c * channelSize]);
+		}
+	}
+
+	m_varints.clear();
+	for (int c = 0; c < m_numChannels; c++)
+	{
+		const size_t start = c * channelSize;
+		for (size_t i = start; i < start + channelSize; i++)
+		{
+			putVarint(m_varints, zigzag(m_current[i] - predict(m_current, m_prev, m_prev2, keyframe, m_framesSinceKey, i, start)));
+		}
+	}
+
+	FrameHeader header;
+	header.frameIndex = m_frameIndex;
+	header.flags = keyframe ? uint32_t(KEYFRAME) : 0u;
+	header.rawSize = uint32_t(m_varints.size());
+	const std::vector<uint8_t>* payload = &m_varints;
+	if (m_entropyCoding)
+	{
+		ransEncode(m_varints.data(), m_varints.size(), m_entropy);
+		if (m_entropy.size() < m_varints.size())
+		{
+			header.flags |= ENTROPY_CODED;
+			payload = &m_entropy;
+		}
+	}
+	header.payloadSize = uint32_t(payload->size());
+	append(out, header);
+	if (keyframe)
+	{
+		for (int c = 0; c < m_numChannels; c++) append(out, m_grids[c]);
+	}
+	out.insert(out.end(), payload->begin(), payload->end());
+
+	m_prev2.swap(m_prev);
+	m_prev.swap(m_current);
+	m_framesSinceKey = keyframe ? 1 : m_framesSinceKey + 1;
+	m_frameIndex++;
+	return header.flags;
+}
+
+SimCache::FrameDecoder::FrameDecoder(uint32_t numVerts, int numChannels)
+	: m_numVerts(numVerts), m_numChannels(numChannels)
+{
+	const size_t total = size_t(numChannels) * 3 * numVerts;
+	m_prev.resize(total);
+	m_prev2.resize(total);
+	m_current.resize(total);
+}
+
+bool SimCache::FrameDecoder::decode(const uint8_t* record, size_t size, float* const* channels)
+{
+	if (size < sizeof(FrameHeader)) return false;
+	FrameHeader header;
+	std::memcpy(&header, record, sizeof(header));
+	if (size < recordSize(header, m_numChannels)) return false;
+	const bool keyframe = (header.flags & KEYFRAME) != 0;
+	// A delta frame is only meaningful on top of the frame right before it
+	if (!keyframe && m_lastFrame + 1 != int64_t(header.frameIndex)) return false;
+	const uint8_t* p = record + sizeof(FrameHeader);
+	if (keyframe)
+	{
+		for (int c = 0; c < m_numChannels; c++)
+		{
+			std::memcpy(&m_grids[c], p, sizeof(Grid));
+			p += sizeof(Grid);
+		}
+	}
+
+	const uint8_t* varints = p;
+	if (header.flags & ENTROPY_CODED)
+	{
+		m_varints.resize(header.rawSize);
+		if (!ransDecode(p, header.payloadSize, m_varints.data(), m_varints.size())) return false;
+		varints = m_varints.data();
+	}
+	const uint8_t* end = varints + ((header.flags & ENTROPY_CODED) ? header.rawSize : header.payloadSize);
+
+	const size_t channelSize = 3 * size_t(m_numVerts);
+	for (int c = 0; c < m_numChannels; c++)
+	{
+		const size_t start = c * channelSize;
+		for (size_t i = start; i < start + channelSize; i++)
+		{
+			uint32_t residual;
+			if (!getVarint(varints, end, residual)) return false;
+			m_current[i] = predict(m_current, m_prev, m_prev2, keyframe, m_framesSinceKey, i, start) + unzigzag(residual);
+		}
+		if (!channels[c]) continue;
+		const Grid& grid = m_grids[c];
+		for (size_t i = 0; i < channelSize; i++)
+		{
+			channels[c][i] = grid.min[i % 3] + float(m_current[start + i]) * grid.step[i % 3];
+		}
+	}
+
+	m_prev2.swap(m_prev);
+	m_prev.swap(m_current);
+	m_framesSinceKey = keyframe ? 1 : m_framesSinceKey + 1;
+	m_lastFrame = header.frameIndex;
+	return true;
+}
@@ -0,0 +1,233 @@
+#include "SimCacheReader.h"
+#include "ThreadPool.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+SimCacheReader::~SimCacheReader()
+{
+	close();
+}
+
+bool SimCacheReader::open(const std::string& path)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) return false;
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0)
+	{
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	}
+	if (!mapping)
+	{
+		CloseHandle(file);
+		return false;
+	}
+	m_data = static_cast<const uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	m_fileHandle = file;
+	m_mappingHandle = mapping;
+	m_size = size_t(fileSize.QuadPart);
+#else
+	m_fd = ::open(path.c_str(), O_RDONLY);
+	if (m_fd < 0) return false;
+	struct stat st;
+	if (fstat(m_fd, &st) == 0 && st.st_size > 0)
+	{
+		void* mapped = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, m_fd, 0);
+		if (mapped != MAP_FAILED)
+		{
+			m_data = static_cast<const uint8_t*>(mapped);
+			m_size = size_t(st.st_size);
+		}
+	}
+#endif
+	if (!m_data || m_size < sizeof(SimCache::FileHeader))
+	{
+		close();
+		return false;
+	}
+	std::memcpy(&m_header, m_data, sizeof(m_header));
+	if (std::memcmp(m_header.magic, SimCache::FILE_MAGIC, sizeof(m_header.magic)) != 0 ||
+		m_header.version != SimCache::VERSION || m_header.numVerts == 0 || !buildIndex())
+	{
+		std::cout << path << " is not a readable sim cache" << std::endl;
+		close();
+		return false;
+	}
+	m_numChannels = hasVelocities() ? 2 : 1;
+	m_decoder = std::make_unique<SimCache::FrameDecoder>(m_header.numVerts, m_numChannels);
+	m_prefetchDecoder = std::make_unique<SimCache::FrameDecoder>(m_header.numVerts, m_numChannels);
+	return true;
+}
+
+void SimCacheReader::close()
+{
+	if (m_prefetch.valid())
+	{
+		m_cancel = true;
+		m_prefetch.wait();
+		m_prefetch = std::future<void>();
+		m_cancel = false;
+	}
+#ifdef _WIN32
+	if (m_data) UnmapViewOfFile(m_data);
+	if (m_mappingHandle) CloseHandle(m_mappingHandle);
+	if (m_fileHandle) CloseHandle(m_fileHandle);
+	m_mappingHandle = m_fileHandle = nullptr;
+#else
+	if (m_data) munmap(const_cast<uint8_t*>(m_data), m_size);
+	if (m_fd >= 0) ::close(m_fd);
+	m_fd = -1;
+#endif
+	m_data = nullptr;
+	m_size = 0;
+	m_index.clear();
+	m_cache.clear();
+	m_prefetchBegin = m_prefetchEnd = 0;
+	m_decoder.reset();
+	m_prefetchDecoder.reset();
+}
+
+bool SimCacheReader::buildIndex()
+{
+	const int numChannels = (m_header.flags & SimCache::HAS_VELOCITIES) ? 2 : 1;
+	if (m_size >= sizeof(SimCache::FileHeader) + sizeof(SimCache::Footer))
+	{
+		SimCache::Footer footer;
+		std::memcpy(&footer, m_data + m_size - sizeof(footer), sizeof(footer));
+		const uint64_t indexBytes = uint64_t(footer.numFrames) * sizeof(SimCache::IndexEntry);
+		if (std::memcmp(footer.magic, SimCache::FOOTER_MAGIC, sizeof(footer.magic)) == 0 &&
+			footer.indexOffset + indexBytes + sizeof(footer) == m_size)
+		{
+			m_index.resize(footer.numFrames);
+			std::memcpy(m_index.data(), m_data + footer.indexOffset, indexBytes);
+			const bool valid = std::all_of(m_index.begin(), m_index.end(), [&](const SimCache::IndexEntry& entry) {
+				return entry.offset + entry.size <= footer.indexOffset;
+			});
+			if (valid && (m_index.empty() || (m_index[0].flags & SimCache::KEYFRAME))) return true;
+			m_index.clear();
+		}
+	}
+	// No usable footer: walk the records, stopping at the first one cut short
+	size_t offset = sizeof(SimCache::FileHeader);
+	while (offset + sizeof(SimCache::FrameHeader) <= m_size)
+	{
+		SimCache::FrameHeader header;
+		std::memcpy(&header, m_data + offset, sizeof(header));
+		const size_t size = SimCache::recordSize(header, numChannels);
+		if (header.frameIndex != m_index.size() || offset + size > m_size) break;
+		if (m_index.empty() && !(header.flags & SimCache::KEYFRAME)) return false;
+		m_index.push_back(SimCache::IndexEntry{ offset, uint32_t(size), header.flags });
+		offset += size;
+	}
+	return true;
+}
+
+uint32_t SimCacheReader::keyframeBefore(uint32_t frame) const
+{
+	while (frame > 0 && !(m_index[frame].flags & SimCache::KEYFRAME)) frame--;
+	return frame;
+}
+
+bool SimCacheReader::decodeFrame(SimCache::FrameDecoder& decoder, uint32_t frame, std::vector<float>& data)
+{
+	const size_t channelFloats = 3 * size_t(m_header.numVerts);
+	data.resize(m_numChannels * channelFloats);
+	float* channels[2] = { data.data(), m_numChannels > 1 ? data.data() + channelFloats : nullptr };
+	uint32_t start = keyframeBefore(frame);
+	// Sequential playback just carries on
+	const int64_t last = decoder.getLastFrame();
+	if (last >= int64_t(start) && last < int64_t(frame)) start = uint32_t(last + 1);
+	for (uint32_t f = start; f <= frame; f++)
+	{
+		const SimCache::IndexEntry& entry = m_index[f];
+		if (!decoder.decode(m_data + entry.offset, entry.size, channels))
+		{
+			decoder.reset();
+			return false;
+		}
+	}
+	return true;
+}
+
+bool SimCacheReader::findCached(uint32_t frame, float* positions, float* velocities)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	for (const Decoded& decoded : m_cache)
+	{
+		if (decoded.frame != frame) continue;
+		const size_t channelFloats = 3 * size_t(m_header.numVerts);
+		std::memcpy(positions, decoded.data.data(), sizeof(float) * channelFloats);
+		if (velocities)
+		{
+			if (m_numChannels > 1) std::memcpy(velocities, decoded.data.data() + channelFloats, sizeof(float) * channelFloats);
+			else std::fill(velocities, velocities + channelFloats, 0.0f);
+		}
+		return true;
+	}
+	return false;
+}
+
+void SimCacheReader::storeCached(uint32_t frame, const std::vector<float>& data)
+{
+	std::lock_guard<std::mutex> lock(m_cacheMutex);
+	for (const Decoded& decoded : m_cache)
+	{
+		if (decoded.frame == frame) return;
+	}
+	if (m_cache.size() >= m_cacheCapacity) m_cache.pop_front();
+	m_cache.push_back(Decoded{ frame, data });
+}
+
+bool SimCacheReader::readFrame(uint32_t frame, float* positions, float* velocities)
+{
+	if (!isOpen() || frame >= m_index.size()) return false;
+	if (findCached(frame, positions, velocities)) return true;
+	if (!decodeFrame(*m_decoder, frame, m_scratch)) return false;
+	const size_t channelFloats = 3 * size_t(m_header.numVerts);
+	std::memcpy(positions, m_scratch.data(), sizeof(float) * channelFloats);
+	if (velocities)
+	{
+		if (m_numChannels > 1) std::memcpy(velocities, m_scratch.data() + channelFloats, sizeof(float) * channelFloats);
+		else std::fill(velocities, velocities + channelFloats, 0.0f);
+	}
+	return true;
+}
+
+void SimCacheReader::prefetch(uint32_t frame, uint32_t count)
+{
+	if (!isOpen() || frame >= m_index.size()) return;
+	if (m_prefetch.valid() && m_prefetch.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return;
+	if (frame >= m_prefetchBegin && size_t(frame) + count / 2 <= m_prefetchEnd) return;
+	const uint32_t end = uint32_t(std::min<size_t>(m_index.size(), size_t(frame) + count));
+	{
+		std::lock_guard<std::mutex> lock(m_cacheMutex);
+		m_cacheCapacity = std::max<size_t>(m_cacheCapacity, 2 * size_t(count));
+	}
+	m_prefetchBegin = frame;
+	m_prefetchEnd = end;
+	m_prefetch = m_prefetchWorker.enqueue([this, frame, end]() {
+		std::vector<float> data;
+		for (uint32_t f = frame; f < end && !m_cancel; f++)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_cacheMutex);
+				if (std::any_of(m_cache.begin(), m_cache.end(), [f](const Decoded& decoded) { return decoded.frame == f; })) continue;
+			}
+			if (!decodeFrame(*m_prefetchDecoder, f, data)) return;
+			storeCached(f, data);
+		}
+	});
+}
@@ -0,0 +1,166 @@
+#include "SimCacheWriter.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+SimCacheWriter::~SimCacheWriter()
+{
+	close();
+}
+
+bool SimCacheWriter::open(const std::string& path, uint32_t numVerts, float timeStep, const Options& options)
+{
+	close();
+	m_file = std::fopen(path.c_str(), "wb");
+	if (!m_file)
+	{
+		std::cout << "Could not open sim cache " << path << " for writing" << std::endl;
+		return false;
+	}
+	m_options = options;
+	m_options.maxQueuedFrames = std::max<size_t>(1, options.maxQueuedFrames);
+	m_numVerts = numVerts;
+	m_frameFloats = (options.velocities ? 6 : 3) * size_t(numVerts);
+
+	SimCache::FileHeader header = {};
+	std::memcpy(header.magic, SimCache::FILE_MAGIC, sizeof(header.magic));
+	header.version = SimCache::VERSION;
+	header.flags = options.velocities ? uint32_t(SimCache::HAS_VELOCITIES) : 0u;
+	header.numVerts = numVerts;
+	header.keyframeInterval = options.keyframeInterval;
+	header.positionBits = options.positionBits;
+	header.velocityBits = options.velocityBits;
+	header.timeStep = timeStep;
+	if (std::fwrite(&header, sizeof(header), 1, m_file) != 1)
+	{
+		std::fclose(m_file);
+		m_file = nullptr;
+		return false;
+	}
+	m_chunkOffset = sizeof(header);
+	m_bytesWritten = sizeof(header);
+	m_index.clear();
+	m_chunk.clear();
+	m_failed = false;
+	m_closing = false;
+	m_numAppended = 0;
+	m_numBuffers = 0;
+	m_thread = std::thread(&SimCacheWriter::ioLoop, this);
+	return true;
+}
+
+bool SimCacheWriter::appendFrame(const float* positions, const float* velocities)
+{
+	if (!isOpen() || m_failed) return false;
+	std::vector<float> buffer;
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		// Buffers circulate between here and the I/O thread; only a few ever exist
+		m_freeCV.wait(lock, [&] { return !m_free.empty() || m_numBuffers < m_options.maxQueuedFrames; });
+		if (!m_free.empty())
+		{
+			buffer = std::move(m_free.back());
+			m_free.pop_back();
+		}
+		else
+		{
+			m_numBuffers++;
+		}
+	}
+	buffer.resize(m_frameFloats);
+	const size_t channelFloats = 3 * size_t(m_numVerts);
+	std::memcpy(buffer.data(), positions, sizeof(float) * channelFloats);
+	if (m_options.velocities)
+	{
+		if (velocities) std::memcpy(buffer.data() + channelFloats, velocities, sizeof(float) * channelFloats);
+		else std::fill(buffer.begin() + channelFloats, buffer.end(), 0.0f);
+	}
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_queue.push_back(std::move(buffer));
+		m_numAppended++;
+	}
+	m_queueCV.notify_one();
+	return true;
+}
+
+void SimCacheWriter::ioLoop()
+{
+	const uint32_t bits[2] = { m_options.positionBits, m_options.velocityBits };
+	const int numChannels = m_options.velocities ? 2 : 1;
+	SimCache::FrameEncoder encoder(m_numVerts, numChannels, bits, m_options.keyframeInterval, m_options.entropyCoding);
+	const size_t channelFloats = 3 * size_t(m_numVerts);
+	while (true)
+	{
+		std::vector<float> frame;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_queueCV.wait(lock, [&] { return !m_queue.empty() || m_closing; });
+			if (m_queue.empty()) break;
+			frame = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+		if (!m_failed)
+		{
+			// A chunk goes out in one write once the next one starts
+			if (encoder.nextIsKeyframe() && !m_chunk.empty()) flushChunk();
+			const size_t recordStart = m_chunk.size();
+			const float* channels[2] = { frame.data(), frame.data() + channelFloats };
+			const uint32_t flags = encoder.encode(channels, m_chunk);
+			// A frame that leaves the grid becomes a keyframe mid-chunk, which only matters for decoding
+			SimCache::IndexEntry entry;
+			entry.offset = m_chunkOffset + recordStart;
+			entry.size = uint32_t(m_chunk.size() - recordStart);
+			entry.flags = flags;
+			m_index.push_back(entry);
+		}
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_free.push_back(std::move(frame));
+		}
+		m_freeCV.notify_one();
+	}
+	if (!m_chunk.empty()) flushChunk();
+}
+
+bool SimCacheWriter::flushChunk()
+{
+	if (std::fwrite(m_chunk.data(), 1, m_chunk.size(), m_file) != m_chunk.size())
+	{
+		std::cout << "Sim cache write failed, recording stopped" << std::endl;
+		m_failed = true;
+		return false;
+	}
+	m_chunkOffset += m_chunk.size();
+	m_bytesWritten += m_chunk.size();
+	m_chunk.clear();
+	return true;
+}
+
+bool SimCacheWriter::close()
+{
+	if (!isOpen()) return true;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_closing = true;
+	}
+	m_queueCV.notify_one();
+	m_thread.join();
+
+	bool ok = !m_failed;
+	if (ok)
+	{
+		SimCache::Footer footer;
+		footer.indexOffset = m_chunkOffset;
+		footer.numFrames = uint32_t(m_index.size());
+		std::memcpy(footer.magic, SimCache::FOOTER_MAGIC, sizeof(footer.magic));
+		ok = std::fwrite(m_index.data(), sizeof(SimCache::IndexEntry), m_index.size(), m_file) == m_index.size() &&
+			std::fwrite(&footer, sizeof(footer), 1, m_file) == 1;
+		m_bytesWritten += sizeof(SimCache::IndexEntry) * m_index.size() + sizeof(footer);
+	}
+	ok = std::fclose(m_file) == 0 && ok;
+	m_file = nullptr;
+	m_queue.clear();
+	m_free.clear();
+	return ok;
+}
@@ -1,259 +1,924 @@
 #include "SpringSolver.h"
+#include "ThreadPool.h"
+#include "KrylovSolvers.h"
+#include "AtomicFile.h"
+#include <new>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <algorithm>
+#include <unordered_map>
+#include <type_traits>
 
-void SpringSolver::accumulateForces()
+namespace
 {
-	totalE = 0.0f;
-	F.setZero();
-	Eigen::VectorXf G = Eigen::Vector3f(0.0f, -9.8 * (mass / n), 0.0f).replicate(n, 1);
-	for (auto& sp : springs)
-	{
-		Eigen::Vector3f x_i = currPos.segment<3>(sp.edge->a * 3);
-		Eigen::Vector3f x_j = currPos.segment<3>(sp.edge->b * 3);
-		Eigen::Vector3f v_i = currVel.segment<3>(sp.edge->a * 3);
-		Eigen::Vector3f v_j = currVel.segment<3>(sp.edge->b * 3);
-		Eigen::Vector3f n = (x_j - x_i);
-		float l = n.norm();
-		totalE += (l - sp.l0) * (l - sp.l0) * k / 2.0f;
+	uint64_t fnv1a(const uint8_t* data, size_t size, uint64_t hash = 14695981039346656037ull)
+	{
+		for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 1099511628211ull;
+		return hash;
+	}
+
+	template <typename Matrix>
+	uint64_t sparsityHash(const Matrix& m, uint64_t hash = fnv1a(nullptr, 0))
+	{
+		hash = fnv1a(reinterpret_cast<const uint8_t*>(m.outerIndexPtr()), sizeof(int) * size_t(m.outerSize() + 1), hash);
+		return fnv1a(reinterpret_cast<const uint8_t*>(m.innerIndexPtr()), sizeof(int) * size_t(m.nonZeros()), hash);
+	}
+
+	// Takes the symbolic analysis from the cache, or computes it and adds it
+	template <typename Matrix>
+	void analyzeCached(CachedLDLT<Matrix>& ldlt, const Matrix& m)
+	{
+		const uint64_t hash = sparsityHash(m);
+		const std::string path = SymbolicCache::getCachePath(hash);
+		SymbolicCache::Analysis analysis;
+		if (SymbolicCache::read(path, hash, size_t(m.rows()), analysis) && ldlt.setSymbolic(analysis, m)) return;
+		ldlt.analyzePattern(m);
+		ldlt.getSymbolic(analysis);
+		SymbolicCache::write(path, hash, analysis);
+	}
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::accumulateForces(Island& island)
+{
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	island.energy = Scalar(0);
+	F.segment(base, dofs).setZero();
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const Spring& sp = springs[s];
+		Vector3 x_i = currPos.template segment<3>(3 * Eigen::Index(sp.a));
+		Vector3 x_j = currPos.template segment<3>(3 * Eigen::Index(sp.b));
+		Vector3 v_i = currVel.template segment<3>(3 * Eigen::Index(sp.a));
+		Vector3 v_j = currVel.template segment<3>(3 * Eigen::Index(sp.b));
+		Vector3 n = (x_j - x_i);
+		Scalar l = n.norm();
+		island.energy += (l - sp.l0) * (l - sp.l0) * k / Scalar(2);
 		n.normalize();
 		// spring force
-		Eigen::Vector3f _f = n * (l - sp.l0) * k;
+		Vector3 _f = n * (l - sp.l0) * k;
 		// spring dampening
 		_f += -beta_s * (n.dot(v_i - v_j)) * n;
-		F.segment<3>(sp.edge->a * 3) += _f;
-		F.segment<3>(sp.edge->b * 3) += -_f;
-	}
-	F += G;
-	F *= globalScale;
-	/*F.col(0) = Eigen::Vector3f::Zero();
-	F.col(2) = Eigen::Vector3f::Zero();*/
-	/*F.col(68) = Eigen::Vector3f::Zero();
-	F.col(73) = Eigen::Vector3f::Zero();*/
-	F.segment<3>(263 * 3) = Eigen::Vector3f::Zero();
-	F.segment<3>(275 * 3) = Eigen::Vector3f::Zero();
-	/*F.col(1680) = Eigen::Vector3f::Zero();
-	F.col(1269) = Eigen::Vector3f::Zero();*/
-	//std::cout << "Total E=" << totalE << std::endl;
-}
-
-void SpringSolver::accumulatedFdX()
-{
-	for (auto& sp : springs)
-	{
-		Eigen::Vector3f x_i = currPos.segment<3>(sp.edge->a * 3);
-		Eigen::Vector3f x_j = currPos.segment<3>(sp.edge->b * 3);
-		Eigen::Vector3f v_i = currVel.segment<3>(sp.edge->a * 3);
-		Eigen::Vector3f v_j = currVel.segment<3>(sp.edge->b * 3);
-		Eigen::Vector3f n = (x_j - x_i);
-		float l = n.norm();
+		F.template segment<3>(3 * Eigen::Index(sp.a)) += _f;
+		F.template segment<3>(3 * Eigen::Index(sp.b)) += -_f;
+	}
+	// Gravity, with the mass spread evenly over the vertices of each body
+	for (const Body& body : bodies)
+	{
+		if (body.island != island.index) continue;
+		const Scalar g = Scalar(-9.8 * (mass / body.numVerts));
+		for (uint32_t v = body.vertexOffset; v < body.vertexOffset + body.numVerts; v++)
+			F(3 * Eigen::Index(v) + 1) += g;
+	}
+	F.segment(base, dofs) *= globalScale;
+	zeroPinned(island, F);
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::accumulatedFdX(Island& island)
+{
+	SparseMatrix& LHS = island.LHS;
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const Spring& sp = springs[s];
+		Vector3 x_i = currPos.template segment<3>(3 * Eigen::Index(sp.a));
+		Vector3 x_j = currPos.template segment<3>(3 * Eigen::Index(sp.b));
+		Vector3 v_i = currVel.template segment<3>(3 * Eigen::Index(sp.a));
+		Vector3 v_j = currVel.template segment<3>(3 * Eigen::Index(sp.b));
+		Vector3 n = (x_j - x_i);
+		Scalar l = n.norm();
 		n.normalize();
-		Eigen::Matrix3f nnt = n * n.transpose();
+		Matrix3 nnt = n * n.transpose();
 		// spring force
-		Eigen::Matrix3f K_s, K_d; // The positional derivatives of the spring force, and the spring dampening
+		Matrix3 K_s, K_d; // The positional derivatives of the spring force, and the spring dampening
 		K_s.setZero();
 		K_d.setZero();
-		K_s = -k * (nnt + (l - sp.l0) / l * (Eigen::Matrix3f::Identity() - nnt));
-		Eigen::Vector3f b = v_i - v_j;
-		K_d = -beta_s / l * ((n.dot(b) * Eigen::Matrix3f::Identity() + n * b.transpose())) * (Eigen::Matrix3f::Identity() - nnt);
+		K_s = -k * hessianScale() * (nnt + transverseStiffness(l, sp.l0) * (Matrix3::Identity() - nnt));
+		Vector3 b = v_i - v_j;
+		K_d = -beta_s / l * ((n.dot(b) * Matrix3::Identity() + n * b.transpose())) * (Matrix3::Identity() - nnt);
+		if (symmetricSystem() || integrator == SolverType::NEWTON) K_d.setZero(); // not symmetric
+		if (usesBlocks())
+		{
+			addSpringBlock(island, s, -(dt * dt * K_s) - (dt * dt * K_d));
+			continue;
+		}
+		const Eigen::Index ia = 3 * Eigen::Index(sp.a - island.firstVertex);
+		const Eigen::Index ib = 3 * Eigen::Index(sp.b - island.firstVertex);
 		for (int r = 0; r < 3; ++r) {
 			for (int c = 0; c < 3; ++c) {
-				float k_s = K_s(r, c);
-				float k_d = K_d(r, c);
-				LHS.coeffRef(sp.edge->a * 3 + r, sp.edge->a * 3 + c) += -(dt * dt * k_s) - (dt * dt * k_d);
-				LHS.coeffRef(sp.edge->b * 3 + r, sp.edge->b * 3 + c) += -(dt * dt * k_s) - (dt * dt * k_d);
-				LHS.coeffRef(sp.edge->a * 3 + r, sp.edge->b * 3 + c) += (dt * dt * k_s) + (dt * dt * k_d);
-				LHS.coeffRef(sp.edge->b * 3 + r, sp.edge->a * 3 + c) += (dt * dt * k_s) + (dt * dt * k_d);
+				Scalar k_s = K_s(r, c);
+				Scalar k_d = K_d(r, c);
+				LHS.coeffRef(ia + r, ia + c) += -(dt * dt * k_s) - (dt * dt * k_d);
+				LHS.coeffRef(ib + r, ib + c) += -(dt * dt * k_s) - (dt * dt * k_d);
+				LHS.coeffRef(ia + r, ib + c) += (dt * dt * k_s) + (dt * dt * k_d);
+				LHS.coeffRef(ib + r, ia + c) += (dt * dt * k_s) + (dt * dt * k_d);
 			}
 		}
 	}
 }
 
-void SpringSolver::accumulatedFdV()
+template <typename Scalar>
+void SpringSolverT<Scalar>::accumulatedFdV(Island& island)
 {
-	for (auto& sp : springs)
+	SparseMatrix& LHS = island.LHS;
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
 	{
-		Eigen::Vector3f x_i = currPos.segment<3>(sp.edge->a * 3);
-		Eigen::Vector3f x_j = currPos.segment<3>(sp.edge->b * 3);
-		Eigen::Vector3f n = (x_j - x_i);
-		float l = n.norm();
+		const Spring& sp = springs[s];
+		Vector3 x_i = currPos.template segment<3>(3 * Eigen::Index(sp.a));
+		Vector3 x_j = currPos.template segment<3>(3 * Eigen::Index(sp.b));
+		Vector3 n = (x_j - x_i);
+		Scalar l = n.norm();
 		n.normalize();
-		Eigen::Matrix3f B = -beta_s * n * n.transpose();
+		if (integrator == SolverType::NEWTON) n = island.startDirections[s - island.firstSpring]; // see newtonObjective
+		Matrix3 B = -beta_s * hessianScale() * n * n.transpose();
+		if (usesBlocks())
+		{
+			addSpringBlock(island, s, -(dt * B));
+			continue;
+		}
+		const Eigen::Index ia = 3 * Eigen::Index(sp.a - island.firstVertex);
+		const Eigen::Index ib = 3 * Eigen::Index(sp.b - island.firstVertex);
 		for (int r = 0; r < 3; ++r) {
 			for (int c = 0; c < 3; ++c) {
-				LHS.coeffRef(sp.edge->a * 3 + r, sp.edge->a * 3 + c) += -(dt * B(r, c));
-				LHS.coeffRef(sp.edge->b * 3 + r, sp.edge->b * 3 + c) += -(dt * B(r, c));;
-				LHS.coeffRef(sp.edge->a * 3 + r, sp.edge->b * 3 + c) += (dt * B(r, c));;
-				LHS.coeffRef(sp.edge->b * 3 + r, sp.edge->a * 3 + c) += (dt * B(r, c));;
+				LHS.coeffRef(ia + r, ia + c) += -(dt * B(r, c));
+				LHS.coeffRef(ib + r, ib + c) += -(dt * B(r, c));;
+				LHS.coeffRef(ia + r, ib + c) += (dt * B(r, c));;
+				LHS.coeffRef(ib + r, ia + c) += (dt * B(r, c));;
 			}
 		}
 	}
 }
 
-void SpringSolver::step()
+template <typename Scalar>
+void SpringSolverT<Scalar>::addSpringBlock(Island& island, uint32_t s, const Matrix3& K)
 {
-	if (!doSim) return;
-	switch (integrator) {
-	case SolverType::SYMPLECTIC:
-		symplecticSolver();
-		break;
-	case SolverType::IMPLICIT:
-		implicitSolver();
-		break;
+	const uint32_t* blocks = &island.springBlocks[4 * size_t(s - island.firstSpring)];
+	island.blockLHS.block(blocks[0]) += K;
+	island.blockLHS.block(blocks[1]) += K;
+	island.blockLHS.block(blocks[2]) -= K;
+	island.blockLHS.block(blocks[3]) -= K;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::blockSetup(Island& island)
+{
+	std::vector<std::pair<uint32_t, uint32_t>> pattern;
+	pattern.reserve(2 * size_t(island.numSprings));
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const uint32_t a = springs[s].a - island.firstVertex, b = springs[s].b - island.firstVertex;
+		pattern.emplace_back(a, b);
+		pattern.emplace_back(b, a);
+	}
+	island.blockLHS.setPattern(island.numVerts, std::move(pattern));
+	// The block positions each spring adds to are looked up once, so assembly never searches the pattern
+	island.springBlocks.resize(4 * size_t(island.numSprings));
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const uint32_t a = springs[s].a - island.firstVertex, b = springs[s].b - island.firstVertex;
+		uint32_t* blocks = &island.springBlocks[4 * size_t(s - island.firstSpring)];
+		blocks[0] = island.blockLHS.getDiagonalIndex(a);
+		blocks[1] = island.blockLHS.getDiagonalIndex(b);
+		blocks[2] = uint32_t(island.blockLHS.findBlock(a, b));
+		blocks[3] = uint32_t(island.blockLHS.findBlock(b, a));
 	}
+	island.blocksReady = true;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::adjacencySetup(Island& island)
+{
+	// Springs grouped by vertex, so the product can gather per vertex in parallel without write conflicts
+	island.vertexSpringStart.assign(size_t(island.numVerts) + 1, 0);
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		island.vertexSpringStart[springs[s].a - island.firstVertex + 1]++;
+		island.vertexSpringStart[springs[s].b - island.firstVertex + 1]++;
+	}
+	for (uint32_t v = 0; v < island.numVerts; v++) island.vertexSpringStart[v + 1] += island.vertexSpringStart[v];
+	island.vertexSprings.resize(2 * size_t(island.numSprings));
+	std::vector<uint32_t> fill(island.vertexSpringStart.begin(), island.vertexSpringStart.end() - 1);
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		island.vertexSprings[fill[springs[s].a - island.firstVertex]++] = s - island.firstSpring;
+		island.vertexSprings[fill[springs[s].b - island.firstVertex]++] = s - island.firstSpring;
+	}
+	island.springPinned.resize(island.numSprings);
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+		island.springPinned[s - island.firstSpring] = isPinned(springs[s].a) || isPinned(springs[s].b);
+	island.adjacencyReady = true;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::computeSpringBlocks(Island& island)
+{
+	if (!island.adjacencyReady) adjacencySetup(island);
+	// Each spring adds its block K to (a, a) and (b, b) and -K to (a, b) and (b, a), so K is all the system
+	// needs per spring. The damping term that depends on the relative velocity is left out to keep it symmetric.
+	island.springHessians.resize(island.numSprings);
+	ThreadPool::global().parallelFor(0, island.numSprings, [&](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			const Spring& sp = springs[island.firstSpring + i];
+			Vector3 n = currPos.template segment<3>(3 * Eigen::Index(sp.b)) - currPos.template segment<3>(3 * Eigen::Index(sp.a));
+			const Scalar l = n.norm();
+			n.normalize();
+			const Matrix3 nnt = n * n.transpose();
+			const Matrix3 K_s = -k * hessianScale() * (nnt + transverseStiffness(l, sp.l0) * (Matrix3::Identity() - nnt));
+			const Vector3& d = integrator == SolverType::NEWTON ? island.startDirections[i] : n;
+			const Matrix3 B = -beta_s * hessianScale() * d * d.transpose();
+			island.springHessians[i] = -(dt * dt * K_s) - (dt * B);
+		}
+	}, 1024);
+	// The diagonal blocks, for the preconditioner
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	island.diagonalBlocks.resize(island.numVerts);
+	ThreadPool::global().parallelFor(0, island.numVerts, [&](size_t begin, size_t end) {
+		for (size_t v = begin; v < end; v++)
+		{
+			Matrix3 d = (M.template segment<3>(base + 3 * Eigen::Index(v)) + Vector3::Constant(drag())).asDiagonal();
+			for (uint32_t i = island.vertexSpringStart[v]; i < island.vertexSpringStart[v + 1]; i++)
+				d += island.springHessians[island.vertexSprings[i]];
+			island.diagonalBlocks[v] = d;
+		}
+	}, 1024);
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::multiplySystem(const Island& island, const Vector& x, Vector& y) const
+{
+	// y_v = M_v x_v + sum over the springs at v of K (x_v - x_other)
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	y.resize(x.size());
+	const bool decouple = integrator == SolverType::NEWTON;
+	ThreadPool::global().parallelFor(0, island.numVerts, [&](size_t begin, size_t end) {
+		for (size_t v = begin; v < end; v++)
+		{
+			const Vector3 xv = x.template segment<3>(3 * Eigen::Index(v));
+			Vector3 sum = (M.template segment<3>(base + 3 * Eigen::Index(v)) + Vector3::Constant(drag())).cwiseProduct(xv);
+			for (uint32_t i = island.vertexSpringStart[v]; i < island.vertexSpringStart[v + 1]; i++)
+			{
+				const uint32_t s = island.vertexSprings[i];
+				const Spring& sp = springs[island.firstSpring + s];
+				const uint32_t other = (sp.a - island.firstVertex == v ? sp.b : sp.a) - island.firstVertex;
+				if (decouple && island.springPinned[s]) // see decouplePinned
+					sum.noalias() += island.springHessians[s] * xv;
+				else
+					sum.noalias() += island.springHessians[s] * (xv - x.template segment<3>(3 * Eigen::Index(other)));
+			}
+			y.template segment<3>(3 * Eigen::Index(v)) = sum;
+		}
+	}, 1024);
+}
+
+template <typename Scalar>
+Scalar SpringSolverT<Scalar>::transverseStiffness(Scalar l, Scalar l0) const
+{
+	// Compressed springs have negative stiffness across their direction, which makes the system indefinite.
+	// Newton steps clamp it to zero, the projected Hessian, so every step is a descent direction; so do the
+	// CG solves, whatever the integrator, since CG needs a positive definite system to converge.
+	const Scalar stiffness = (l - l0) / l;
+	const bool project = integrator == SolverType::NEWTON || linearSolver == LinearSolverType::BLOCK_CG ||
+		linearSolver == LinearSolverType::MATRIX_FREE_CG;
+	return project ? std::max(stiffness, Scalar(0)) : stiffness;
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::isPinned(uint32_t vertex) const
+{
+	return std::binary_search(pinned.begin(), pinned.end(), vertex);
+}
+
+template <typename Scalar>
+Scalar SpringSolverT<Scalar>::drag() const
+{
+	// The linearized step keeps the global damping on the right hand side only; Newton steps need its
+	// derivative too for the system to be the Hessian of newtonObjective
+	return integrator == SolverType::NEWTON ? dt * beta_g : Scalar(0);
+}
+
+template <typename Scalar>
+Scalar SpringSolverT<Scalar>::hessianScale() const
+{
+	// newtonObjective scales the spring potentials by globalScale, so its Hessian has to as well. IMPLICIT
+	// keeps the unscaled Jacobian it has always used.
+	return integrator == SolverType::NEWTON ? globalScale : Scalar(1);
+}
+
+template <typename Scalar>
+uint32_t SpringSolverT<Scalar>::getLastNewtonIterations() const
+{
+	uint32_t iterations = 0;
+	for (const auto& island : islands) iterations = std::max(iterations, island->newtonIterations);
+	return iterations;
+}
+
+template <typename Scalar>
+uint32_t SpringSolverT<Scalar>::getLastIterations() const
+{
+	uint32_t iterations = 0;
+	for (const auto& island : islands) iterations = std::max(iterations, island->iterations);
+	return iterations;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::zeroPinned(const Island& island, Eigen::Ref<Vector> v, uint32_t firstVertex) const
+{
+	auto it = std::lower_bound(pinned.begin(), pinned.end(), island.firstVertex);
+	for (; it != pinned.end() && *it < island.firstVertex + island.numVerts; ++it)
+		v.template segment<3>(3 * Eigen::Index(*it - firstVertex)) = Vector3::Zero();
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::step()
+{
+	if (!doSim) return;
+	// Islands only touch their own segments of the global vectors, so they can all be solved at once
+	ThreadPool::global().parallelFor(0, islands.size(), [this](size_t begin, size_t end) {
+		for (size_t i = begin; i < end; i++)
+		{
+			switch (integrator) {
+			case SolverType::SYMPLECTIC:
+				symplecticSolver(*islands[i]);
+				break;
+			case SolverType::IMPLICIT:
+				implicitSolver(*islands[i]);
+				break;
+			case SolverType::NEWTON:
+				newtonSolver(*islands[i]);
+				break;
+			}
+		}
+	}, 1);
+	totalE = Scalar(0);
+	for (const auto& island : islands) totalE += island->energy;
 	//std::cout << "Finished solve..." << std::endl;
 	if (doCollisions)
 	{
 		//std::cout << "Starting collisions..." << std::endl;
 		detectCollisions();
 	}
+	syncMeshes();
+	if (recorder)
+	{
+		if constexpr (std::is_same<Scalar, float>::value)
+			recorder->appendFrame(currPos.data(), currVel.data());
+		else
+		{
+			recordPos = currPos.template cast<float>();
+			recordVel = currVel.template cast<float>();
+			recorder->appendFrame(recordPos.data(), recordVel.data());
+		}
+	}
 	//std::cout << "Step..." << std::endl;
 }
 
-void SpringSolver::sparseSetup()
+template <typename Scalar>
+void SpringSolverT<Scalar>::buildPattern(const Island& island, SparseMatrix& LHS) const
 {
-	std::vector<Eigen::Triplet<float>> pat;
-	pat.reserve(9 * n + 18 * springs.size());
+	std::vector<Eigen::Triplet<Scalar>> pat;
+	pat.reserve(9 * size_t(island.numVerts) + 18 * size_t(island.numSprings));
 
 	// This creates 9 triplets, and puts them into the pat vector. Thus we vectorize the 3x3 matrix
 	// and unroll it row-wise.
-	auto addFull3x3Pattern = [&](int r0, int c0) {
+	auto addFull3x3Pattern = [&](Eigen::Index r0, Eigen::Index c0) {
 		for (int r = 0; r < 3; ++r) for (int c = 0; c < 3; ++c)
 			pat.emplace_back(r0 + r, c0 + c, 1.0f);
 	};
 
-	for (int i = 0; i < n; ++i) addFull3x3Pattern(3 * i, 3 * i); // Do this for each vertex, along the block diagonal
-	for (auto& sp : springs) { // Do this for each spring, twice
-		addFull3x3Pattern(3 * sp.edge->a, 3 * sp.edge->b);
-		addFull3x3Pattern(3 * sp.edge->b, 3 * sp.edge->a);
+	for (uint32_t i = 0; i < island.numVerts; ++i) addFull3x3Pattern(3 * Eigen::Index(i), 3 * Eigen::Index(i)); // Do this for each vertex, along the block diagonal
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++) { // Do this for each spring, twice
+		const Eigen::Index ia = 3 * Eigen::Index(springs[s].a - island.firstVertex);
+		const Eigen::Index ib = 3 * Eigen::Index(springs[s].b - island.firstVertex);
+		addFull3x3Pattern(ia, ib);
+		addFull3x3Pattern(ib, ia);
 	}
 
-	LHS = Eigen::SparseMatrix<float>(3 * n, 3 * n);
+	LHS = SparseMatrix(3 * Eigen::Index(island.numVerts), 3 * Eigen::Index(island.numVerts));
 
 	LHS.setFromTriplets(pat.begin(), pat.end());
 	LHS.makeCompressed();
 	assert(LHS.isCompressed());
+}
 
-	bicg.setTolerance(1e-4);
-	bicg.setMaxIterations(200);
-	bicg.preconditioner().setFillfactor(4);
+template <typename Scalar>
+void SpringSolverT<Scalar>::resetSystem(Island& island)
+{
+	island.LHS = SparseMatrix();
+	island.patternReady = false;
+	island.analyzed = false;
+	island.ldltAnalyzed = false;
+	island.lowAnalyzed = false;
+	island.lowLdltAnalyzed = false;
+	island.blocksReady = false;
+	island.adjacencyReady = false;
 }
 
-void SpringSolver::reset()
+template <typename Scalar>
+void SpringSolverT<Scalar>::reset()
 {
 	currPos = defaultPos;
 	lastPos = defaultPos;
 	currVel.setZero();
 	F.setZero();
-	for (int i = 0; i < n; i++)
+	syncMeshes();
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::symplecticSolver(Island& island)
+{
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	accumulateForces(island);
+	currVel.segment(base, dofs) += M_inv.segment(base, dofs).asDiagonal() * (dt * (F.segment(base, dofs) - beta_g * currVel.segment(base, dofs)));
+	currPos.segment(base, dofs) += dt * currVel.segment(base, dofs);
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::implicitSolver(Island& island)
+{
+	// Implicit Euler
+	// TODO: I am currently doing one step at each frame. This makes smaller steps look slower.
+	//       I would like to make all steps move more or less at the same speed, but, with a
+	//       different accuracy that depends on the step size.
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	currPos.segment(base, dofs) += dt * currVel.segment(base, dofs);
+	accumulateForces(island);
+	assembleSystem(island);
+	// The velocity is linearized around the current one, so the inertia term M (v_next - v) is zero
+	Vector RHS = dt * (F.segment(base, dofs) - beta_g * currVel.segment(base, dofs));
+	solveSystem(island, RHS);
+	zeroPinned(island, dv);
+	currVel.segment(base, dofs) += dv.segment(base, dofs);
+	currPos.segment(base, dofs) += dt * currVel.segment(base, dofs);
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::assembleSystem(Island& island)
+{
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	SparseMatrix& LHS = island.LHS;
+	if (linearSolver == LinearSolverType::MATRIX_FREE_CG)
+	{
+		// Nothing to assemble, only one block per spring
+		computeSpringBlocks(island);
+		return;
+	}
+	if (usesBlocks())
+	{
+		if (!island.blocksReady) blockSetup(island);
+		island.blockLHS.setZero();
+		for (uint32_t v = 0; v < island.numVerts; v++)
+			island.blockLHS.block(island.blockLHS.getDiagonalIndex(v)).diagonal() += M.template segment<3>(base + 3 * Eigen::Index(v)) + Vector3::Constant(drag());
+	}
+	else
 	{
-		Eigen::Vector3f new_pos = currPos.segment<3>(i * 3);
-		_mesh->SetVertex(new_pos, i);
+		if (!island.patternReady) { buildPattern(island, LHS); island.patternReady = true; }
+		Eigen::Map<Vector>(LHS.valuePtr(), LHS.nonZeros()).setZero(); // We need to zero out the matrix but NOT destroy the pattern!
+		// Set the mass to the main sparse matrix
+		for (Eigen::Index i = 0; i < dofs; ++i)
+			LHS.coeffRef(i, i) += M(base + i) + drag();
 	}
+	accumulatedFdX(island);
+	accumulatedFdV(island);
+	if (integrator == SolverType::NEWTON) decouplePinned(island);
 }
 
-void SpringSolver::symplecticSolver()
+template <typename Scalar>
+void SpringSolverT<Scalar>::decouplePinned(Island& island)
 {
-	accumulateForces();
-	currVel += M_inv * (dt * (F - beta_g * currVel));
-	currPos = currPos + dt * currVel;
+	// Newton steps solve for the free vertices only. Without the blocks coupling pinned vertices to the rest,
+	// the zero right hand side keeps the pinned ones in place and their neighbours get the exact constrained
+	// step, instead of one that is zeroed after the fact.
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const Spring& sp = springs[s];
+		if (!isPinned(sp.a) && !isPinned(sp.b)) continue;
+		if (usesBlocks())
+		{
+			const uint32_t* blocks = &island.springBlocks[4 * size_t(s - island.firstSpring)];
+			island.blockLHS.block(blocks[2]).setZero();
+			island.blockLHS.block(blocks[3]).setZero();
+			continue;
+		}
+		const Eigen::Index ia = 3 * Eigen::Index(sp.a - island.firstVertex);
+		const Eigen::Index ib = 3 * Eigen::Index(sp.b - island.firstVertex);
+		for (int r = 0; r < 3; ++r) {
+			for (int c = 0; c < 3; ++c) {
+				island.LHS.coeffRef(ia + r, ib + c) = Scalar(0);
+				island.LHS.coeffRef(ib + r, ia + c) = Scalar(0);
+			}
+		}
+	}
+}
 
-	for (int i = 0; i < n; i++)
+template <typename Scalar>
+void SpringSolverT<Scalar>::solveSystem(Island& island, const Vector& RHS)
+{
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	SparseMatrix& LHS = island.LHS;
+	if (linearSolver == LinearSolverType::MATRIX_FREE_CG)
+	{
+		island.blockJacobi.compute(island.diagonalBlocks);
+		Vector x = dv.segment(base, dofs);
+		island.iterations = Krylov::conjugateGradient(MatrixFreeOperator{ *this, island }, island.blockJacobi, RHS, x, maxIterations, iterativeTol);
+		dv.segment(base, dofs) = x;
+	}
+	else if (usesBlocks())
+	{
+		island.blockJacobi.compute(island.blockLHS);
+		// Warm start from the last step's velocity change, which changes slowly between steps
+		Vector x = dv.segment(base, dofs);
+		if (linearSolver == LinearSolverType::BLOCK_CG)
+			island.iterations = Krylov::conjugateGradient(island.blockLHS, island.blockJacobi, RHS, x, maxIterations, iterativeTol);
+		else
+			island.iterations = Krylov::biCGStab(island.blockLHS, island.blockJacobi, RHS, x, maxIterations, iterativeTol);
+		dv.segment(base, dofs) = x;
+	}
+	else if (mixedPrecision && !std::is_same<Scalar, float>::value)
+		solveMixed(island, RHS, dv.segment(base, dofs));
+	else if (linearSolver == LinearSolverType::LDLT)
 	{
-		Eigen::Vector3f new_pos = currPos.segment<3>(i * 3);
-		_mesh->SetVertex(new_pos, i);
+		if (!island.ldltAnalyzed) { analyzeCached(island.ldlt, LHS); island.ldltAnalyzed = true; }
+		island.ldlt.factorize(LHS);
+		dv.segment(base, dofs) = island.ldlt.solve(RHS);
+	}
+	else
+	{
+		if (!island.analyzed) { island.lu.analyzePattern(LHS); island.analyzed = true; } // once
+		island.lu.factorize(LHS);
+		dv.segment(base, dofs) = island.lu.solve(RHS);
 	}
 }
 
-void SpringSolver::implicitSolver()
+template <typename Scalar>
+Scalar SpringSolverT<Scalar>::newtonObjective(const Island& island, const Vector& v, Vector& force) const
 {
-	// Implicit Euler
-	// TODO: I am currently doing one step at each frame. This makes smaller steps look slower.
-	//       I would like to make all steps move more or less at the same speed, but, with a
-	//       different accuracy that depends on the step size.
-	Eigen::Map<Eigen::VectorXf>(LHS.valuePtr(), LHS.nonZeros()).setZero(); // We need to zero out the matrix but NOT destroy the pattern!
-	// Set the mass to the main sparse matrix
-	for (int i = 0; i < n; ++i) {
-		for (int r = 0; r < 3; ++r) for (int c = 0; c < 3; ++c)
-			LHS.coeffRef(i * 3 + r, i * 3 + c) += M(r, c);
+	// Backward Euler over the step velocity v minimizes
+	//   1/2 (v - v0)^T M (v - v0) + (spring and gravity potential at x0 + dt v) + dissipation
+	// which is the incremental potential divided by dt^2. The dissipation potentials give the spring damping
+	// along the spring directions at the start of the step, and the global damping. force is minus its
+	// gradient with respect to the positions, so the gradient with respect to v is M (v - v0) - dt force.
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	force.setZero(dofs);
+	Scalar potential = Scalar(0);
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		const Spring& sp = springs[s];
+		const Eigen::Index ia = 3 * Eigen::Index(sp.a - island.firstVertex);
+		const Eigen::Index ib = 3 * Eigen::Index(sp.b - island.firstVertex);
+		Vector3 n = island.startPos.template segment<3>(ib) + dt * v.template segment<3>(ib)
+			- island.startPos.template segment<3>(ia) - dt * v.template segment<3>(ia);
+		const Scalar l = n.norm();
+		n /= l;
+		const Vector3& n0 = island.startDirections[s - island.firstSpring];
+		const Scalar relative = n0.dot(v.template segment<3>(ia) - v.template segment<3>(ib));
+		potential += (l - sp.l0) * (l - sp.l0) * k / Scalar(2) + beta_s * dt * relative * relative / Scalar(2);
+		const Vector3 f = n * (l - sp.l0) * k - beta_s * relative * n0;
+		force.template segment<3>(ia) += f;
+		force.template segment<3>(ib) -= f;
 	}
-	currPos = currPos + dt * currVel;
-	accumulateForces();
-	accumulatedFdX();
-	accumulatedFdV();
-	if (!analyzed) { lu.analyzePattern(LHS); analyzed = true; } // once
-	Eigen::VectorXf nextVel_i = currVel;
-	Eigen::VectorXf RHS = -M * (nextVel_i - currVel) + dt * (F - beta_g * currVel);
-	lu.factorize(LHS);
-	Eigen::VectorXf dv = lu.solve(RHS);
-	//bicg.compute(LHS); // cheap vs LU
-	//dv = bicg.solveWithGuess(RHS, dv);
-	/*Eigen::VectorXf dv = LHS.fullPivLu().solve(RHS);*/
-	dv.segment<3>(263 * 3) = Eigen::Vector3f::Zero();
-	dv.segment<3>(275 * 3) = Eigen::Vector3f::Zero();
-	currVel += dv;
-	currPos += dt * currVel;
-	for (int i = 0; i < n; i++)
+	for (const Body& body : bodies)
 	{
-		Eigen::Vector3f new_pos = currPos.segment<3>(i * 3);
-		_mesh->SetVertex(new_pos, i);
+		if (body.island != island.index) continue;
+		const Scalar g = Scalar(-9.8 * (mass / body.numVerts));
+		for (uint32_t v_i = body.vertexOffset; v_i < body.vertexOffset + body.numVerts; v_i++)
+		{
+			const Eigen::Index y = 3 * Eigen::Index(v_i - island.firstVertex) + 1;
+			force(y) += g;
+			potential -= g * (island.startPos(y) + dt * v(y));
+		}
 	}
+	force *= globalScale;
+	force -= beta_g * v;
+	zeroPinned(island, force, island.firstVertex);
+	const Vector dv0 = v - island.startVel;
+	return dv0.dot(M.segment(3 * Eigen::Index(island.firstVertex), dofs).cwiseProduct(dv0)) / Scalar(2)
+		+ globalScale * potential + beta_g * dt * v.squaredNorm() / Scalar(2);
 }
 
+template <typename Scalar>
+void SpringSolverT<Scalar>::newtonSolver(Island& island)
+{
+	const Eigen::Index base = 3 * Eigen::Index(island.firstVertex);
+	const Eigen::Index dofs = 3 * Eigen::Index(island.numVerts);
+	island.startPos = currPos.segment(base, dofs);
+	island.startVel = currVel.segment(base, dofs);
+	island.startDirections.resize(island.numSprings);
+	for (uint32_t s = island.firstSpring; s < island.firstSpring + island.numSprings; s++)
+	{
+		island.startDirections[s - island.firstSpring] = (currPos.template segment<3>(3 * Eigen::Index(springs[s].b))
+			- currPos.template segment<3>(3 * Eigen::Index(springs[s].a))).normalized();
+	}
+	// Start from the current velocity, which is the linearized step's starting point too
+	Vector v = island.startVel;
+	Vector force, trialForce, RHS, step, trial;
+	Scalar objective = newtonObjective(island, v, force);
+	island.newtonIterations = 0;
+	while (island.newtonIterations < maxNewtonIterations)
+	{
+		// Minus the gradient of the objective, the right hand side of the linearized step
+		RHS = dt * force - M.segment(base, dofs).cwiseProduct(v - island.startVel);
+		if (RHS.squaredNorm() == Scalar(0)) break;
+		// The inner step assembles and solves the usual system at the current iterate. Its spring Hessians are
+		// projected (see transverseStiffness), so the system is positive definite and the step goes downhill.
+		currPos.segment(base, dofs) = island.startPos + dt * v;
+		currVel.segment(base, dofs) = v;
+		assembleSystem(island);
+		solveSystem(island, RHS);
+		zeroPinned(island, dv);
+		step = dv.segment(base, dofs);
+		Scalar slope = RHS.dot(step);
+		if (!(slope > Scalar(0)))
+		{
+			// An inexact or failed inner solve: fall back to the mass-scaled gradient
+			step = M_inv.segment(base, dofs).cwiseProduct(RHS);
+			slope = RHS.dot(step);
+		}
+		// Backtracking line search with the Armijo condition
+		Scalar alpha = Scalar(1);
+		Scalar trialObjective = objective;
+		for (uint32_t i = 0; i < 30; i++, alpha /= Scalar(2))
+		{
+			trial = v + alpha * step;
+			trialObjective = newtonObjective(island, trial, trialForce);
+			if (trialObjective <= objective - Scalar(1e-4) * alpha * slope) break;
+		}
+		island.newtonIterations++;
+		if (!(trialObjective < objective)) break; // no further decrease possible in this precision
+		v.swap(trial);
+		force.swap(trialForce);
+		objective = trialObjective;
+		if (alpha * step.template lpNorm<Eigen::Infinity>() <= newtonTol) break;
+	}
+	dv.segment(base, dofs) = v - island.startVel;
+	currVel.segment(base, dofs) = v;
+	currPos.segment(base, dofs) = island.startPos + dt * v;
+	// Leaves F and the energy at the end of the step, like the other integrators
+	accumulateForces(island);
+}
 
+template <typename Scalar>
+void SpringSolverT<Scalar>::solveMixed(Island& island, const Vector& rhs, Eigen::Ref<Vector> x)
+{
+	// Each refinement round solves for the error of the current solution with the float factors, which gains
+	// roughly as many digits as a float solve has, so a couple of rounds get to full precision
+	island.lowLHS = island.LHS.template cast<float>();
+	const bool ldlt = linearSolver == LinearSolverType::LDLT;
+	if (ldlt)
+	{
+		if (!island.lowLdltAnalyzed) { analyzeCached(island.lowLdlt, island.lowLHS); island.lowLdltAnalyzed = true; }
+		island.lowLdlt.factorize(island.lowLHS);
+	}
+	else
+	{
+		if (!island.lowAnalyzed) { island.lowLu.analyzePattern(island.lowLHS); island.lowAnalyzed = true; }
+		island.lowLu.factorize(island.lowLHS);
+	}
+	auto lowSolve = [&](const Eigen::VectorXf& b) -> Eigen::VectorXf {
+		if (ldlt) return island.lowLdlt.solve(b);
+		return island.lowLu.solve(b);
+	};
+	Eigen::VectorXf lowRhs = rhs.template cast<float>();
+	x = lowSolve(lowRhs).template cast<Scalar>();
+	const Scalar tolerance = refinementTol * rhs.norm();
+	for (uint32_t i = 0; i < maxRefinements; i++)
+	{
+		const Vector residual = rhs - island.LHS * x;
+		if (residual.norm() <= tolerance) break;
+		lowRhs = residual.template cast<float>();
+		x += lowSolve(lowRhs).template cast<Scalar>();
+	}
+}
 
-bool SpringSolver::setup(const std::shared_ptr<Mesh> mesh)
+template <typename Scalar>
+void SpringSolverT<Scalar>::clear()
 {
-	_mesh = mesh;
+	bodies.clear();
+	islands.clear();
 	springs.clear();
-	n = _mesh->GetNumVerts();
-	currPos = Eigen::VectorXf::Zero(3 * n);
-	defaultPos = Eigen::VectorXf::Zero(3 * n);
-	currVel = Eigen::VectorXf::Zero(3 * n);
-	F = Eigen::VectorXf::Zero(3 * n);
-	dv = Eigen::VectorXf::Zero(3 * n);
-	M = Eigen::MatrixXf::Identity(3 * n, 3 * n);
-	M_inv = M * 1.0f / (mass / n);
-	M *= (mass / n);
+	pinned.clear();
+	n = 0;
+	ownedPos.resize(0);
+	new (&currPos) Eigen::Map<Vector>(nullptr, 0);
+	for (Vector* v : { &lastPos, &defaultPos, &currVel, &lastVel, &F, &M, &M_inv, &dv }) v->resize(0);
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::setup(const std::shared_ptr<Mesh> mesh, bool ownPositions)
+{
+	return setup(mesh, std::vector<uint32_t>(), ownPositions);
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::setup(const std::shared_ptr<Mesh> mesh, const std::vector<uint32_t>& pinnedVerts, bool ownPositions)
+{
+	clear();
+	addMesh(mesh, pinnedVerts, ownPositions);
+	return true;
+}
+
+template <typename Scalar>
+uint32_t SpringSolverT<Scalar>::addMesh(const std::shared_ptr<Mesh> mesh, const std::vector<uint32_t>& pinnedVerts, bool ownPositions)
+{
+	const uint32_t offset = n;
+	const uint32_t numVerts = mesh->GetNumVerts();
+	const Eigen::Index base = 3 * Eigen::Index(offset);
+	const Eigen::Index dofs = 3 * Eigen::Index(numVerts);
+	Vector positions(base + dofs);
+	positions.head(base) = currPos;
+	positions.tail(dofs) = mesh->GetPositions().template cast<Scalar>();
+	for (Vector* v : { &lastPos, &defaultPos, &currVel, &lastVel, &F, &M, &M_inv, &dv }) v->conservativeResize(base + dofs);
+	defaultPos.tail(dofs) = positions.tail(dofs);
+	lastPos.tail(dofs) = positions.tail(dofs);
+	currVel.tail(dofs).setZero();
+	lastVel.tail(dofs).setZero();
+	F.tail(dofs).setZero();
+	dv.tail(dofs).setZero();
+	M.tail(dofs).setConstant(mass / numVerts);
+	M_inv.tail(dofs) = M.tail(dofs).cwiseInverse();
 	// Create a spring for each edge
-	for (auto& edge : _mesh->m_edges)
-	{
-		Spring _sp(edge);
-		Eigen::Vector3f x_i = _mesh->GetVertex(edge.a);
-		Eigen::Vector3f x_j = _mesh->GetVertex(edge.b);
-		_sp.l0 = (x_i - x_j).norm();
-		springs.push_back(_sp);
-		currPos.segment<3>(edge.a * 3) = x_i;
-		currPos.segment<3>(edge.b * 3) = x_j;
+	springs.reserve(springs.size() + mesh->m_edges.size());
+	for (auto& edge : mesh->m_edges)
+	{
+		Vector3 x_i = mesh->GetVertex(edge.a).template cast<Scalar>();
+		Vector3 x_j = mesh->GetVertex(edge.b).template cast<Scalar>();
+		springs.push_back({ offset + edge.a, offset + edge.b, (x_i - x_j).norm() });
 	};
-	sparseSetup();
-	defaultPos = currPos;
-	lastPos = currPos;
+	for (uint32_t v : pinnedVerts)
+	{
+		if (v < numVerts) pinned.push_back(offset + v);
+	}
+	bodies.push_back({ mesh, offset, numVerts, ownPositions, 0 });
+	n += numVerts;
+	rebuildLayout(positions);
+	return uint32_t(bodies.size() - 1);
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::addAttachment(uint32_t bodyA, uint32_t vertA, uint32_t bodyB, uint32_t vertB, Scalar restLength)
+{
+	if (bodyA >= bodies.size() || bodyB >= bodies.size() || vertA >= bodies[bodyA].numVerts || vertB >= bodies[bodyB].numVerts)
+		return false;
+	const uint32_t a = bodies[bodyA].vertexOffset + vertA;
+	const uint32_t b = bodies[bodyB].vertexOffset + vertB;
+	if (restLength < Scalar(0)) restLength = (currPos.template segment<3>(3 * Eigen::Index(a)) - currPos.template segment<3>(3 * Eigen::Index(b))).norm();
+	springs.push_back({ a, b, restLength });
+	rebuildLayout(Vector(currPos));
 	return true;
 }
 
-bool triIntersect(const Eigen::Vector3f& src,
-	const Eigen::Vector3f& vtxA,
-	const Eigen::Vector3f& vtxB,
-	const Eigen::Vector3f& vtxC,
-	const Eigen::Vector3f& tNorm,
-	Eigen::Vector3f& hitPoint,
-	float tolerance)
+template <typename Scalar>
+void SpringSolverT<Scalar>::rebuildLayout(const Vector& positions)
+{
+	const uint32_t numBodies = uint32_t(bodies.size());
+	std::vector<uint32_t> bodyOf(n);
+	for (uint32_t i = 0; i < numBodies; i++)
+		std::fill_n(bodyOf.begin() + bodies[i].vertexOffset, bodies[i].numVerts, i);
+
+	// Union-find over the bodies, joined by every spring that runs from one to another
+	std::vector<uint32_t> parent(numBodies);
+	std::iota(parent.begin(), parent.end(), 0);
+	auto find = [&](uint32_t i) {
+		while (parent[i] != i) i = parent[i] = parent[parent[i]];
+		return i;
+	};
+	for (const Spring& sp : springs)
+	{
+		const uint32_t ra = find(bodyOf[sp.a]), rb = find(bodyOf[sp.b]);
+		if (ra != rb) parent[std::max(ra, rb)] = std::min(ra, rb);
+	}
+	// Islands are numbered in order of their first body and keep their bodies in registration order
+	std::vector<uint32_t> rootIsland(numBodies, UINT32_MAX);
+	std::vector<uint32_t> bodyIsland(numBodies);
+	uint32_t numIslands = 0;
+	for (uint32_t i = 0; i < numBodies; i++)
+	{
+		const uint32_t root = find(i);
+		if (rootIsland[root] == UINT32_MAX) rootIsland[root] = numIslands++;
+		bodyIsland[i] = rootIsland[root];
+	}
+	islands.clear();
+	std::vector<uint32_t> newOffset(numBodies);
+	uint32_t next = 0;
+	for (uint32_t i = 0; i < numIslands; i++)
+	{
+		islands.push_back(std::make_unique<Island>());
+		Island& island = *islands.back();
+		island.index = i;
+		island.firstVertex = next;
+		for (uint32_t b = 0; b < numBodies; b++)
+		{
+			if (bodyIsland[b] != i) continue;
+			newOffset[b] = next;
+			next += bodies[b].numVerts;
+		}
+		island.numVerts = next - island.firstVertex;
+	}
+
+	// Move the state to the new layout, body by body
+	auto permute = [&](const Vector& v) {
+		Vector out(v.size());
+		for (uint32_t b = 0; b < numBodies; b++)
+			out.segment(3 * Eigen::Index(newOffset[b]), 3 * Eigen::Index(bodies[b].numVerts)) = v.segment(3 * Eigen::Index(bodies[b].vertexOffset), 3 * Eigen::Index(bodies[b].numVerts));
+		return out;
+	};
+	auto remap = [&](uint32_t v) { return newOffset[bodyOf[v]] + (v - bodies[bodyOf[v]].vertexOffset); };
+	Vector newPositions = permute(positions);
+	for (Vector* v : { &lastPos, &defaultPos, &currVel, &lastVel, &F, &M, &M_inv, &dv }) *v = permute(*v);
+	for (Spring& sp : springs)
+	{
+		sp.a = remap(sp.a);
+		sp.b = remap(sp.b);
+	}
+	for (uint32_t& v : pinned) v = remap(v);
+	std::sort(pinned.begin(), pinned.end());
+	for (uint32_t b = 0; b < numBodies; b++)
+	{
+		bodies[b].vertexOffset = newOffset[b];
+		bodies[b].island = bodyIsland[b];
+	}
+
+	// Group the springs by island, keeping their order within each (it fixes the order forces are summed in)
+	std::vector<uint32_t> vertexIsland(n);
+	for (const Body& body : bodies)
+		std::fill_n(vertexIsland.begin() + body.vertexOffset, body.numVerts, body.island);
+	std::stable_sort(springs.begin(), springs.end(), [&](const Spring& s0, const Spring& s1) {
+		return vertexIsland[s0.a] < vertexIsland[s1.a];
+	});
+	uint32_t s = 0;
+	for (auto& island : islands)
+	{
+		island->firstSpring = s;
+		while (s < springs.size() && vertexIsland[springs[s].a] == island->index) s++;
+		island->numSprings = s - island->firstSpring;
+		resetSystem(*island);
+	}
+
+	// Re-seat the map onto the mesh storage, or our own copy (placement new is how Eigen::Map is rebound)
+	if constexpr (std::is_same<Scalar, float>::value)
+	{
+		if (aliasesMesh())
+		{
+			ownedPos.resize(0);
+			new (&currPos) Eigen::Map<Vector>(bodies[0].mesh->MapPositions());
+			currPos = newPositions;
+			return;
+		}
+	}
+	ownedPos = std::move(newPositions);
+	new (&currPos) Eigen::Map<Vector>(ownedPos.data(), ownedPos.size());
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::aliasesMesh() const
+{
+	return std::is_same<Scalar, float>::value && bodies.size() == 1 && !bodies[0].ownsPositions;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::syncMeshes()
+{
+	const bool aliased = aliasesMesh();
+	for (const Body& body : bodies)
+	{
+		if (body.ownsPositions) continue;
+		if (!aliased)
+			body.mesh->MapPositions() = currPos.segment(3 * Eigen::Index(body.vertexOffset), 3 * Eigen::Index(body.numVerts)).template cast<float>();
+		body.mesh->MarkPositionsDirty();
+	}
+}
+
+template <typename Vector3>
+bool triIntersect(const Vector3& src,
+	const Vector3& vtxA,
+	const Vector3& vtxB,
+	const Vector3& vtxC,
+	const Vector3& tNorm,
+	Vector3& hitPoint,
+	typename Vector3::Scalar tolerance)
 {
-	Eigen::Vector3f result(0, 0, 0);
+	Vector3 result(0, 0, 0);
 
 	// One of the verts plus the normal define the plane. Compute closest point on plane
-	Eigen::Vector3f pToVtx = vtxA - src;
-	float distToPlane = tNorm.dot(pToVtx);
+	Vector3 pToVtx = vtxA - src;
+	typename Vector3::Scalar distToPlane = tNorm.dot(pToVtx);
 	
-	if (abs(distToPlane) > tolerance) return false;
+	if (std::abs(distToPlane) > tolerance) return false;
 
 	result = src + tNorm * (distToPlane);
 
 	// Determine if point is inside the triangle
 	bool inside = false;
 
-	Eigen::Vector3f alpha = (vtxB - vtxA).cross(result - vtxA);
-	Eigen::Vector3f beta = (vtxC - vtxB).cross(result - vtxB);
-	Eigen::Vector3f gamma = (vtxA - vtxC).cross(result - vtxC);
+	Vector3 alpha = (vtxB - vtxA).cross(result - vtxA);
+	Vector3 beta = (vtxC - vtxB).cross(result - vtxB);
+	Vector3 gamma = (vtxA - vtxC).cross(result - vtxC);
 
 	inside = (alpha.dot(tNorm) > 0 && beta.dot(tNorm) > 0 && gamma.dot(tNorm) > 0);
 
@@ -262,7 +927,8 @@ bool triIntersect(const Eigen::Vector3f& src,
 	return inside;
 }
 
-void SpringSolver::detectCollisions()
+template <typename Scalar>
+void SpringSolverT<Scalar>::detectCollisions()
 {
 	/*
 	For each collider
@@ -275,9 +941,9 @@ void SpringSolver::detectCollisions()
 	*/
 	struct CollisionCombo
 	{
-		int srcId;
-		Eigen::Vector3f colNorm;
-		Eigen::Vector3f contactPoint;
+		uint32_t srcId;
+		Vector3 colNorm;
+		Vector3 contactPoint;
 	};
 	struct CollisionComparator {
 		bool operator()(const CollisionCombo& a, const CollisionCombo& b) const {
@@ -288,23 +954,23 @@ void SpringSolver::detectCollisions()
 	for (auto collider : colliders)
 	{
 		// Brute force first
-		for (int vId=0; vId < currPos.rows()/3; vId++)
+		for (uint32_t vId = 0; vId < n; vId++)
 		{
-			Eigen::Vector3f x_i = currPos.segment<3>(vId * 3);
-			for (int i = 0; i < collider->GetNumTriangles(); i++)
+			Vector3 x_i = currPos.template segment<3>(3 * Eigen::Index(vId));
+			for (uint32_t i = 0; i < collider->GetNumTriangles(); i++)
 			{
-				int* vIndices = collider->GetTriIndices(i);
-				Eigen::Vector3f vA = collider->GetVertex(vIndices[0], true);
-				Eigen::Vector3f vB = collider->GetVertex(vIndices[1], true);
-				Eigen::Vector3f vC = collider->GetVertex(vIndices[2], true);
+				const unsigned int* vIndices = collider->GetTriIndices(i);
+				Vector3 vA = collider->GetVertex(vIndices[0], true).template cast<Scalar>();
+				Vector3 vB = collider->GetVertex(vIndices[1], true).template cast<Scalar>();
+				Vector3 vC = collider->GetVertex(vIndices[2], true).template cast<Scalar>();
 				if ((x_i - vA).squaredNorm() > colTol && (x_i - vB).squaredNorm() > colTol && (x_i - vC).squaredNorm() > colTol)
 				{
 					continue;
 				}
-				Eigen::Vector3f norm = (vB - vA).cross(vC - vA);
+				Vector3 norm = (vB - vA).cross(vC - vA);
 				norm.normalize();
 
-				Eigen::Vector3f hitPoint;
+				Vector3 hitPoint;
 				if (triIntersect(x_i, vA, vB, vC, norm, hitPoint, colTol))
 				{
 					CollisionCombo col = { vId, norm, hitPoint };
@@ -318,21 +984,278 @@ void SpringSolver::detectCollisions()
 	// Resolve Collisions
 	for (auto col : collisions)
 	{
-		auto velVec = currVel.segment<3>(col.srcId * 3);
+		const Eigen::Index offset = 3 * Eigen::Index(col.srcId);
+		auto velVec = currVel.template segment<3>(offset);
 		if (col.colNorm.dot(velVec) < 0.0f)
 		{
-			currVel.segment<3>(col.srcId * 3) = velVec - col.colNorm * (col.colNorm.dot(velVec));
+			currVel.template segment<3>(offset) = velVec - col.colNorm * (col.colNorm.dot(velVec));
 		}
-		Eigen::Vector3f posVec = currPos.segment<3>(col.srcId * 3) - col.colNorm;
+		Vector3 posVec = currPos.template segment<3>(offset) - col.colNorm;
 		if (col.colNorm.dot(posVec) < 0)
 		{
-			currPos.segment<3>(col.srcId * 3) = col.contactPoint + col.colNorm * colTol;
-			_mesh->SetVertex(currPos.segment<3>(col.srcId * 3), col.srcId);
+			currPos.template segment<3>(offset) = col.contactPoint + col.colNorm * colTol;
 		}
 	}
 }
 
-void SpringSolver::addCollider(const std::shared_ptr<Mesh> m)
+template <typename Scalar>
+Scalar SpringSolverT<Scalar>::getMaxStretch() const
+{
+	Scalar maxStretch = Scalar(0);
+	for (const Spring& sp : springs)
+	{
+		if (sp.l0 <= Scalar(0)) continue;
+		const Scalar l = (currPos.template segment<3>(3 * Eigen::Index(sp.b)) - currPos.template segment<3>(3 * Eigen::Index(sp.a))).norm();
+		maxStretch = std::max(maxStretch, l / sp.l0 - Scalar(1));
+	}
+	return maxStretch;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::setRecorder(std::shared_ptr<SimCacheWriter> writer)
+{
+	recorder = writer;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::addCollider(const std::shared_ptr<Mesh> m)
 {
 	colliders.push_back(m);
 }
+
+namespace
+{
+	const char CHECKPOINT_MAGIC[8] = { 'D', 'K', 'C', 'K', 'P', 'T', '0', '1' };
+
+	struct CheckpointWriter
+	{
+		std::vector<uint8_t>& out;
+		template <typename T>
+		void put(const T& value)
+		{
+			const size_t at = out.size();
+			out.resize(at + sizeof(T));
+			std::memcpy(&out[at], &value, sizeof(T));
+		}
+		template <typename T>
+		void putVector(const T* data, Eigen::Index size)
+		{
+			put(uint64_t(size));
+			const size_t at = out.size();
+			out.resize(at + sizeof(T) * size_t(size));
+			if (size > 0) std::memcpy(&out[at], data, sizeof(T) * size_t(size));
+		}
+	};
+
+	struct CheckpointReader
+	{
+		const uint8_t* p;
+		const uint8_t* end;
+		template <typename T>
+		bool get(T& value)
+		{
+			if (size_t(end - p) < sizeof(T)) return false;
+			std::memcpy(&value, p, sizeof(T));
+			p += sizeof(T);
+			return true;
+		}
+		template <typename T>
+		bool getVector(Eigen::Matrix<T, Eigen::Dynamic, 1>& v)
+		{
+			uint64_t size;
+			if (!get(size) || size > uint64_t(end - p) / sizeof(T)) return false;
+			v.resize(Eigen::Index(size));
+			if (size > 0) std::memcpy(v.data(), p, sizeof(T) * size_t(size));
+			p += sizeof(T) * size_t(size);
+			return true;
+		}
+		template <typename T>
+		bool getVector(std::vector<T>& v)
+		{
+			uint64_t size;
+			if (!get(size) || size > uint64_t(end - p) / sizeof(T)) return false;
+			v.resize(size_t(size));
+			if (size > 0) std::memcpy(v.data(), p, sizeof(T) * size_t(size));
+			p += sizeof(T) * size_t(size);
+			return true;
+		}
+	};
+}
+
+template <typename Scalar>
+uint64_t SpringSolverT<Scalar>::patternHash() const
+{
+	uint64_t hash = fnv1a(nullptr, 0);
+	SparseMatrix pattern;
+	for (const auto& island : islands)
+	{
+		if (island->patternReady)
+			hash = sparsityHash(island->LHS, hash);
+		else
+		{
+			buildPattern(*island, pattern);
+			hash = sparsityHash(pattern, hash);
+		}
+	}
+	return hash;
+}
+
+template <typename Scalar>
+void SpringSolverT<Scalar>::saveCheckpoint(std::vector<uint8_t>& out) const
+{
+	out.clear();
+	CheckpointWriter w{ out };
+	for (char c : CHECKPOINT_MAGIC) w.put(c);
+	w.put(uint32_t(1)); // version
+	w.put(uint32_t(sizeof(Scalar)));
+	w.put(n);
+	w.put(uint32_t(springs.size()));
+	w.put(patternHash());
+	// Pins are the caller's choice, not the mesh's, so a solver set up with other ones must not resume
+	w.putVector(pinned.data(), Eigen::Index(pinned.size()));
+	w.put(k); w.put(dt); w.put(mass); w.put(beta_s); w.put(beta_g); w.put(totalE); w.put(globalScale); w.put(colTol);
+	w.put(uint8_t(doSim)); w.put(uint8_t(doCollisions));
+	w.put(int32_t(integrator));
+	w.put(vIters);
+	w.put(uint8_t(mixedPrecision)); w.put(maxRefinements); w.put(refinementTol);
+	w.put(int32_t(linearSolver));
+	w.put(maxIterations); w.put(iterativeTol);
+	w.put(maxNewtonIterations); w.put(newtonTol);
+	w.putVector(currPos.data(), currPos.size());
+	for (const Vector* v : { &lastPos, &defaultPos, &currVel, &lastVel, &F, &M, &M_inv, &dv })
+	{
+		w.putVector(v->data(), v->size());
+	}
+	// The spring order fixes the order forces are summed in, so it is part of the state
+	for (const Spring& sp : springs)
+	{
+		w.put(sp.a);
+		w.put(sp.b);
+		w.put(sp.l0);
+	}
+	w.put(fnv1a(out.data(), out.size()));
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::loadCheckpoint(const uint8_t* data, size_t size)
+{
+	if (bodies.empty() || size < sizeof(CHECKPOINT_MAGIC) + sizeof(uint64_t)) return false;
+	uint64_t checksum;
+	std::memcpy(&checksum, data + size - sizeof(checksum), sizeof(checksum));
+	if (std::memcmp(data, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0 || fnv1a(data, size - sizeof(checksum)) != checksum)
+	{
+		std::cout << "Checkpoint is not valid or is damaged" << std::endl;
+		return false;
+	}
+	CheckpointReader r{ data + sizeof(CHECKPOINT_MAGIC), data + size - sizeof(checksum) };
+	uint32_t version, scalarSize, numVerts, numSprings;
+	uint64_t pattern;
+	if (!r.get(version) || version != 1 || !r.get(scalarSize)) return false;
+	if (scalarSize != sizeof(Scalar))
+	{
+		std::cout << "Checkpoint was saved by a solver of another precision" << std::endl;
+		return false;
+	}
+	if (!r.get(numVerts) || !r.get(numSprings) || !r.get(pattern)) return false;
+	if (numVerts != n || numSprings != springs.size())
+	{
+		std::cout << "Checkpoint was saved for a different mesh" << std::endl;
+		return false;
+	}
+	std::vector<uint32_t> savedPinned;
+	if (!r.getVector(savedPinned)) return false;
+	if (savedPinned != pinned)
+	{
+		std::cout << "Checkpoint was saved with different pinned vertices" << std::endl;
+		return false;
+	}
+
+	// Everything is parsed into temporaries first, so a bad checkpoint leaves the solver untouched
+	Scalar params[8];
+	uint8_t flags[2];
+	int32_t integratorType;
+	uint32_t iters;
+	uint8_t mixed;
+	uint32_t refinements, iterationLimit, newtonLimit;
+	Scalar tolerance, iterationTol, newtonTolerance;
+	int32_t solverType;
+	for (Scalar& param : params) if (!r.get(param)) return false;
+	if (!r.get(flags[0]) || !r.get(flags[1]) || !r.get(integratorType) || !r.get(iters)) return false;
+	if (!r.get(mixed) || !r.get(refinements) || !r.get(tolerance) || !r.get(solverType)) return false;
+	if (!r.get(iterationLimit) || !r.get(iterationTol) || !r.get(newtonLimit) || !r.get(newtonTolerance)) return false;
+	Vector vectors[9];
+	for (Vector& v : vectors) if (!r.getVector(v) || v.size() != currPos.size()) return false;
+	// The springs must be ours, in the same islands, though they may come in a different order within each
+	std::unordered_map<uint64_t, uint32_t> springIsland;
+	for (const auto& island : islands)
+	{
+		for (uint32_t s = island->firstSpring; s < island->firstSpring + island->numSprings; s++)
+			springIsland[uint64_t(springs[s].a) << 32 | springs[s].b] = island->index;
+	}
+	std::vector<Spring> newSprings(numSprings);
+	std::vector<uint32_t> islandSprings(islands.size(), 0);
+	uint32_t lastIsland = 0;
+	for (Spring& sp : newSprings)
+	{
+		if (!r.get(sp.a) || !r.get(sp.b) || !r.get(sp.l0)) return false;
+		auto it = springIsland.find(uint64_t(sp.a) << 32 | sp.b);
+		if (it == springIsland.end() || it->second < lastIsland) return false;
+		lastIsland = it->second;
+		islandSprings[lastIsland]++;
+	}
+	for (const auto& island : islands)
+		if (islandSprings[island->index] != island->numSprings) return false;
+
+	std::vector<Spring> oldSprings = std::move(springs);
+	springs = std::move(newSprings);
+	for (auto& island : islands) resetSystem(*island);
+	if (patternHash() != pattern)
+	{
+		springs = std::move(oldSprings);
+		for (auto& island : islands) resetSystem(*island);
+		return false;
+	}
+	k = params[0]; dt = params[1]; mass = params[2]; beta_s = params[3];
+	beta_g = params[4]; totalE = params[5]; globalScale = params[6]; colTol = params[7];
+	doSim = flags[0] != 0;
+	doCollisions = flags[1] != 0;
+	integrator = integratorType;
+	vIters = iters;
+	mixedPrecision = mixed != 0;
+	maxRefinements = refinements;
+	refinementTol = tolerance;
+	linearSolver = solverType;
+	maxIterations = iterationLimit;
+	iterativeTol = iterationTol;
+	maxNewtonIterations = newtonLimit;
+	newtonTol = newtonTolerance;
+	currPos = vectors[0];
+	lastPos = vectors[1]; defaultPos = vectors[2]; currVel = vectors[3]; lastVel = vectors[4];
+	F = vectors[5]; M = vectors[6]; M_inv = vectors[7]; dv = vectors[8];
+	// resetSystem() cleared the analyzed flags. The symbolic analysis only depends on the pattern checked
+	// above, so redoing it gives the same result.
+	syncMeshes();
+	return true;
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::saveCheckpoint(const std::string& path) const
+{
+	std::vector<uint8_t> data;
+	saveCheckpoint(data);
+	return AtomicFile::write(path, [&data](std::ostream& file) {
+		file.write(reinterpret_cast<const char*>(data.data()), data.size());
+	});
+}
+
+template <typename Scalar>
+bool SpringSolverT<Scalar>::loadCheckpoint(const std::string& path)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+	std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	return loadCheckpoint(data.data(), data.size());
+}
+
+template class SpringSolverT<float>;
+template class SpringSolverT<double>;
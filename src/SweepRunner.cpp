@@ -0,0 +1,198 @@
+#include "SweepRunner.h"
+#include "SpringSolver.h"
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+
+SweepRunner::SweepRunner(std::shared_ptr<Mesh> cloth, ThreadPool& pool)
+	: m_cloth(cloth), m_pool(pool)
+{
+}
+
+void SweepRunner::addCollider(std::shared_ptr<Mesh> collider)
+{
+	m_colliders.push_back(collider);
+}
+
+void SweepRunner::setPinned(const std::vector<uint32_t>& pinned)
+{
+	m_pinned = pinned;
+}
+
+std::vector<SweepRunner::Parameters> SweepRunner::expandGrid(const Grid& grid)
+{
+	const SpringSolver defaults;
+	auto valuesOr = [](const std::vector<float>& values, float fallback) {
+		return values.empty() ? std::vector<float>{ fallback } : values;
+	};
+	const std::vector<float> ks = valuesOr(grid.k, defaults.k);
+	const std::vector<float> betaSs = valuesOr(grid.beta_s, defaults.beta_s);
+	const std::vector<float> betaGs = valuesOr(grid.beta_g, defaults.beta_g);
+	const std::vector<float> masses = valuesOr(grid.mass, defaults.mass);
+	const std::vector<float> dts = valuesOr(grid.dt, defaults.dt);
+	const std::vector<Precision> precisions = grid.precision.empty() ? std::vector<Precision>{ FLOAT } : grid.precision;
+	std::vector<Parameters> points;
+	points.reserve(ks.size() * betaSs.size() * betaGs.size() * masses.size() * dts.size() * precisions.size());
+	for (float k : ks)
+		for (float betaS : betaSs)
+			for (float betaG : betaGs)
+				for (float mass : masses)
+					for (float dt : dts)
+						for (Precision precision : precisions)
+							points.push_back(Parameters{ k, betaS, betaG, mass, dt, precision });
+	return points;
+}
+
+bool SweepRunner::parseGrid(const std::string& spec, Grid& grid)
+{
+	std::string normalized = spec;
+	for (char& c : normalized) if (c == ';') c = ' ';
+	std::istringstream tokens(normalized);
+	std::string token;
+	while (tokens >> token)
+	{
+		const size_t eq = token.find('=');
+		if (eq == std::string::npos) return false;
+		const std::string name = token.substr(0, eq);
+		if (name == "precision")
+		{
+			grid.precision.clear();
+			std::istringstream items(token.substr(eq + 1));
+			std::string item;
+			while (std::getline(items, item, ','))
+			{
+				if (item == "float") grid.precision.push_back(FLOAT);
+				else if (item == "double") grid.precision.push_back(DOUBLE);
+				else if (item == "mixed") grid.precision.push_back(MIXED);
+				else return false;
+			}
+			if (grid.precision.empty()) return false;
+			continue;
+		}
+		std::vector<float>* values =
+			name == "k" ? &grid.k :
+			name == "beta_s" ? &grid.beta_s :
+			name == "beta_g" ? &grid.beta_g :
+			name == "mass" ? &grid.mass :
+			name == "dt" ? &grid.dt : nullptr;
+		if (!values) return false;
+		values->clear();
+		const std::string list = token.substr(eq + 1);
+		float first, last;
+		int count;
+		char sep1, sep2;
+		std::istringstream range(list);
+		if (list.find(':') != std::string::npos)
+		{
+			if (!(range >> first >> sep1 >> last >> sep2 >> count) || sep1 != ':' || sep2 != ':' || count < 1) return false;
+			for (int i = 0; i < count; i++)
+			{
+				values->push_back(count == 1 ? first : first + (last - first) * float(i) / float(count - 1));
+			}
+			continue;
+		}
+		std::istringstream items(list);
+		std::string item;
+		while (std::getline(items, item, ','))
+		{
+			try { values->push_back(std::stof(item)); }
+			catch (...) { return false; }
+		}
+		if (values->empty()) return false;
+	}
+	return true;
+}
+
+const char* SweepRunner::precisionName(Precision precision)
+{
+	switch (precision)
+	{
+	case DOUBLE: return "double";
+	case MIXED: return "mixed";
+	default: return "float";
+	}
+}
+
+SweepRunner::Result SweepRunner::runOne(const Parameters& params, uint32_t numSteps) const
+{
+	const auto start = std::chrono::steady_clock::now();
+	Result result;
+	result.params = params;
+	if (params.precision == FLOAT)
+	{
+		SpringSolver solver;
+		simulate(solver, numSteps, result);
+	}
+	else
+	{
+		SpringSolverD solver;
+		solver.mixedPrecision = params.precision == MIXED;
+		simulate(solver, numSteps, result);
+	}
+	result.wallMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+template <typename Scalar>
+void SweepRunner::simulate(SpringSolverT<Scalar>& solver, uint32_t numSteps, Result& result) const
+{
+	const Parameters& params = result.params;
+	solver.k = params.k;
+	solver.beta_s = params.beta_s;
+	solver.beta_g = params.beta_g;
+	solver.mass = params.mass;
+	solver.dt = params.dt;
+	solver.setup(m_cloth, m_pinned, true);
+	for (const auto& collider : m_colliders) solver.addCollider(collider);
+	solver.doCollisions = !m_colliders.empty();
+	solver.doSim = true;
+	for (uint32_t step = 0; step < numSteps && !m_cancel; step++)
+	{
+		solver.step();
+		result.steps++;
+		if (!solver.getPositions().allFinite())
+		{
+			result.stable = false;
+			break;
+		}
+		result.maxStretch = std::max(result.maxStretch, float(solver.getMaxStretch()));
+	}
+	result.energy = float(solver.totalE);
+}
+
+std::vector<SweepRunner::Result> SweepRunner::run(const std::vector<Parameters>& points, uint32_t numSteps,
+	std::function<void(size_t done, size_t total)> progress)
+{
+	m_cancel = false;
+	std::vector<Result> results(points.size());
+	std::atomic<size_t> next{ 0 };
+	std::atomic<size_t> done{ 0 };
+	// One long-lived chunk per thread pulling runs off a shared counter, so slow runs (small dt, blow-ups
+	// caught late) do not leave other threads idle the way a static split would
+	m_pool.parallelFor(0, size_t(m_pool.size()) + 1, [&](size_t, size_t) {
+		for (size_t i = next++; i < points.size(); i = next++)
+		{
+			results[i].params = points[i];
+			if (m_cancel) continue;
+			results[i] = runOne(points[i], numSteps);
+			const size_t finished = ++done;
+			if (progress) progress(finished, points.size());
+		}
+	}, 1);
+	return results;
+}
+
+bool SweepRunner::writeCSV(const std::string& path, const std::vector<Result>& results)
+{
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (!file) return false;
+	std::fprintf(file, "run,k,beta_s,beta_g,mass,dt,precision,steps,energy,max_stretch,wall_ms,stable\n");
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const Result& r = results[i];
+		std::fprintf(file, "%zu,%g,%g,%g,%g,%g,%s,%u,%g,%g,%.3f,%d\n", i, r.params.k, r.params.beta_s, r.params.beta_g,
+			r.params.mass, r.params.dt, precisionName(r.params.precision), r.steps, r.energy, r.maxStretch, r.wallMs,
+			r.stable ? 1 : 0);
+	}
+	return std::fclose(file) == 0;
+}
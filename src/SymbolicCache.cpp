@@ -0,0 +1,89 @@
+#include "SymbolicCache.h"
+#include "AtomicFile.h"
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <filesystem>
+#include <mutex>
+
+namespace
+{
+	const char SYMBOLIC_MAGIC[8] = { 'D', 'K', 'L', 'D', 'L', 'T', '0', '2' };
+
+	std::mutex s_cacheDirMutex;
+	std::string s_cacheDir;
+
+	uint64_t fnv1a(const void* data, size_t size, uint64_t hash)
+	{
+		const uint8_t* bytes = static_cast<const uint8_t*>(data);
+		for (size_t i = 0; i < size; i++) hash = (hash ^ bytes[i]) * 1099511628211ull;
+		return hash;
+	}
+
+	uint64_t checksum(const SymbolicCache::Analysis& analysis)
+	{
+		return fnv1a(analysis.ordering.data(), sizeof(int) * analysis.ordering.size(), 14695981039346656037ull);
+	}
+}
+
+void SymbolicCache::setCacheDirectory(const std::string& dir)
+{
+	std::lock_guard<std::mutex> lock(s_cacheDirMutex);
+	s_cacheDir = dir;
+}
+
+std::string SymbolicCache::getCachePath(uint64_t patternHash)
+{
+	std::string dir;
+	{
+		std::lock_guard<std::mutex> lock(s_cacheDirMutex);
+		dir = s_cacheDir;
+	}
+	if (dir.empty())
+	{
+		std::error_code ec;
+		dir = (std::filesystem::temp_directory_path(ec) / "dkViewer" / "solvercache").string();
+	}
+	char name[64];
+	std::snprintf(name, sizeof(name), "%016llx.ldlt", (unsigned long long)patternHash);
+	return (std::filesystem::path(dir) / name).string();
+}
+
+bool SymbolicCache::write(const std::string& path, uint64_t patternHash, const Analysis& analysis)
+{
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	return AtomicFile::write(path, [&](std::ostream& file) {
+		const uint64_t size = analysis.ordering.size();
+		const uint64_t sum = checksum(analysis);
+		file.write(SYMBOLIC_MAGIC, sizeof(SYMBOLIC_MAGIC));
+		file.write(reinterpret_cast<const char*>(&patternHash), sizeof(patternHash));
+		file.write(reinterpret_cast<const char*>(&size), sizeof(size));
+		file.write(reinterpret_cast<const char*>(&sum), sizeof(sum));
+		file.write(reinterpret_cast<const char*>(analysis.ordering.data()), sizeof(int) * analysis.ordering.size());
+	});
+}
+
+bool SymbolicCache::read(const std::string& path, uint64_t patternHash, size_t size, Analysis& analysis)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+	char magic[8];
+	uint64_t fileHash, fileSize, sum;
+	file.read(magic, sizeof(magic));
+	file.read(reinterpret_cast<char*>(&fileHash), sizeof(fileHash));
+	file.read(reinterpret_cast<char*>(&fileSize), sizeof(fileSize));
+	file.read(reinterpret_cast<char*>(&sum), sizeof(sum));
+	if (!file || std::memcmp(magic, SYMBOLIC_MAGIC, sizeof(magic)) != 0 || fileHash != patternHash || fileSize != size) return false;
+	analysis.ordering.resize(size);
+	file.read(reinterpret_cast<char*>(analysis.ordering.data()), sizeof(int) * size);
+	if (!file || checksum(analysis) != sum) return false;
+	// Permuting by something that is not a permutation would corrupt the matrix, so check it is one
+	std::vector<uint8_t> seen(size, 0);
+	for (const int p : analysis.ordering)
+	{
+		if (p < 0 || size_t(p) >= size || seen[size_t(p)]) return false;
+		seen[size_t(p)] = 1;
+	}
+	return true;
+}
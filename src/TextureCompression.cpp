@@ -0,0 +1,410 @@
+#include "TextureCompression.h"
+#include "TextureManager.h"
+#include "AtomicFile.h"
+#include "glad/glad.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+
+namespace
+{
+	// ---- BC1 colour endpoints ----
+	uint16_t packRGB565(const float c[3])
+	{
+		auto q = [](float v, int maxVal) { return int(std::min(std::max(v, 0.0f), 255.0f) * maxVal / 255.0f + 0.5f); };
+		return uint16_t((q(c[0], 31) << 11) | (q(c[1], 63) << 5) | q(c[2], 31));
+	}
+
+	void unpackRGB565(uint16_t c, int out[3])
+	{
+		const int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+		out[0] = (r << 3) | (r >> 2);
+		out[1] = (g << 2) | (g >> 4);
+		out[2] = (b << 3) | (b >> 2);
+	}
+
+	void bc1Palette(uint16_t c0, uint16_t c1, bool forceFourColor, int palette[4][3])
+	{
+		unpackRGB565(c0, palette[0]);
+		unpackRGB565(c1, palette[1]);
+		for (int k = 0; k < 3; k++)
+		{
+			if (c0 > c1 || forceFourColor)
+			{
+				palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+				palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+			}
+			else
+			{
+				palette[2][k] = (palette[0][k] + palette[1][k]) / 2;
+				palette[3][k] = 0;
+			}
+		}
+	}
+
+	// Endpoints are the extremes of the block along its principal colour axis
+	void encodeColorBlock(const unsigned char texels[16][4], unsigned char* out)
+	{
+		float mean[3] = { 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+			for (int k = 0; k < 3; k++) mean[k] += texels[i][k] / 16.0f;
+		float cov[6] = { 0, 0, 0, 0, 0, 0 };
+		for (int i = 0; i < 16; i++)
+		{
+			const float d[3] = { texels[i][0] - mean[0], texels[i][1] - mean[1], texels[i][2] - mean[2] };
+			cov[0] += d[0] * d[0]; cov[1] += d[0] * d[1]; cov[2] += d[0] * d[2];
+			cov[3] += d[1] * d[1]; cov[4] += d[1] * d[2]; cov[5] += d[2] * d[2];
+		}
+		// A few power iterations are plenty for a 3x3 covariance
+		float axis[3] = { 1.0f, 1.0f, 1.0f };
+		for (int it = 0; it < 4; it++)
+		{
+			const float next[3] = {
+				cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2],
+				cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2],
+				cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2] };
+			const float len = std::max({ std::abs(next[0]), std::abs(next[1]), std::abs(next[2]) });
+			if (len < 1e-6f) break;
+			for (int k = 0; k < 3; k++) axis[k] = next[k] / len;
+		}
+		int minIdx = 0, maxIdx = 0;
+		float minProj = 1e30f, maxProj = -1e30f;
+		for (int i = 0; i < 16; i++)
+		{
+			const float proj = texels[i][0] * axis[0] + texels[i][1] * axis[1] + texels[i][2] * axis[2];
+			if (proj < minProj) { minProj = proj; minIdx = i; }
+			if (proj > maxProj) { maxProj = proj; maxIdx = i; }
+		}
+		const float e0[3] = { float(texels[maxIdx][0]), float(texels[maxIdx][1]), float(texels[maxIdx][2]) };
+		const float e1[3] = { float(texels[minIdx][0]), float(texels[minIdx][1]), float(texels[minIdx][2]) };
+		uint16_t c0 = packRGB565(e0), c1 = packRGB565(e1);
+		// Four colour mode needs c0 > c1
+		if (c0 < c1) std::swap(c0, c1);
+		uint32_t indices = 0;
+		if (c0 != c1)
+		{
+			int palette[4][3];
+			bc1Palette(c0, c1, true, palette);
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0, bestDist = 1 << 30;
+				for (int p = 0; p < 4; p++)
+				{
+					const int dr = texels[i][0] - palette[p][0], dg = texels[i][1] - palette[p][1], db = texels[i][2] - palette[p][2];
+					const int dist = dr * dr + dg * dg + db * db;
+					if (dist < bestDist) { bestDist = dist; best = p; }
+				}
+				indices |= uint32_t(best) << (2 * i);
+			}
+		}
+		out[0] = uint8_t(c0 & 0xFF); out[1] = uint8_t(c0 >> 8);
+		out[2] = uint8_t(c1 & 0xFF); out[3] = uint8_t(c1 >> 8);
+		for (int b = 0; b < 4; b++) out[4 + b] = uint8_t(indices >> (8 * b));
+	}
+
+	void decodeColorBlock(const unsigned char* in, bool forceFourColor, unsigned char texels[16][4])
+	{
+		const uint16_t c0 = uint16_t(in[0] | (in[1] << 8));
+		const uint16_t c1 = uint16_t(in[2] | (in[3] << 8));
+		const uint32_t indices = uint32_t(in[4]) | (uint32_t(in[5]) << 8) | (uint32_t(in[6]) << 16) | (uint32_t(in[7]) << 24);
+		int palette[4][3];
+		bc1Palette(c0, c1, forceFourColor, palette);
+		for (int i = 0; i < 16; i++)
+		{
+			const int p = (indices >> (2 * i)) & 3;
+			for (int k = 0; k < 3; k++) texels[i][k] = uint8_t(palette[p][k]);
+		}
+	}
+
+	// ---- BC4 single channel, also the alpha half of BC3 and both halves of BC5 ----
+	void bc4Palette(int r0, int r1, int palette[8])
+	{
+		palette[0] = r0;
+		palette[1] = r1;
+		if (r0 > r1)
+		{
+			for (int i = 1; i < 7; i++) palette[i + 1] = ((7 - i) * r0 + i * r1) / 7;
+		}
+		else
+		{
+			for (int i = 1; i < 5; i++) palette[i + 1] = ((5 - i) * r0 + i * r1) / 5;
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+	}
+
+	void encodeChannelBlock(const unsigned char texels[16][4], int channel, unsigned char* out)
+	{
+		int mn = 255, mx = 0;
+		for (int i = 0; i < 16; i++)
+		{
+			mn = std::min(mn, int(texels[i][channel]));
+			mx = std::max(mx, int(texels[i][channel]));
+		}
+		out[0] = uint8_t(mx);
+		out[1] = uint8_t(mn);
+		uint64_t indices = 0;
+		if (mx != mn)
+		{
+			int palette[8];
+			bc4Palette(mx, mn, palette);
+			for (int i = 0; i < 16; i++)
+			{
+				int best = 0, bestDist = 1 << 30;
+				for (int p = 0; p < 8; p++)
+				{
+					const int dist = std::abs(int(texels[i][channel]) - palette[p]);
+					if (dist < bestDist) { bestDist = dist; best = p; }
+				}
+				indices |= uint64_t(best) << (3 * i);
+			}
+		}
+		for (int b = 0; b < 6; b++) out[2 + b] = uint8_t(indices >> (8 * b));
+	}
+
+	void decodeChannelBlock(const unsigned char* in, int channel, unsigned char texels[16][4])
+	{
+		int palette[8];
+		bc4Palette(in[0], in[1], palette);
+		uint64_t indices = 0;
+		for (int b = 0; b < 6; b++) indices |= uint64_t(in[2 + b]) << (8 * b);
+		for (int i = 0; i < 16; i++) texels[i][channel] = uint8_t(palette[(indices >> (3 * i)) & 7]);
+	}
+
+	std::mutex s_cacheDirMutex;
+	std::string s_cacheDir;
+
+	const unsigned char KTX_IDENTIFIER[12] = { 0xAB, 'K', 'T', 'X', ' ', '1', '1', 0xBB, '\r', '\n', 0x1A, '\n' };
+	const uint32_t KTX_ENDIANNESS = 0x04030201;
+
+	uint32_t baseFormatForChannels(int nChannels)
+	{
+		switch (nChannels)
+		{
+		case 1: return GL_RED;
+		case 2: return GL_RG;
+		case 3: return GL_RGB;
+		default: return GL_RGBA;
+		}
+	}
+}
+
+uint32_t TextureCompression::formatForChannels(int nChannels)
+{
+	switch (nChannels)
+	{
+	case 1: return FORMAT_BC4_R;
+	case 2: return FORMAT_BC5_RG;
+	case 3: return FORMAT_BC1_RGB;
+	case 4: return FORMAT_BC3_RGBA;
+	default: return 0;
+	}
+}
+
+int TextureCompression::channelsForFormat(uint32_t format)
+{
+	switch (format)
+	{
+	case FORMAT_BC4_R: return 1;
+	case FORMAT_BC5_RG: return 2;
+	case FORMAT_BC1_RGB: return 3;
+	case FORMAT_BC3_RGBA: return 4;
+	default: return 0;
+	}
+}
+
+size_t TextureCompression::blockBytes(uint32_t format)
+{
+	return (format == FORMAT_BC1_RGB || format == FORMAT_BC4_R) ? 8 : 16;
+}
+
+size_t TextureCompression::compressedSize(uint32_t format, int width, int height)
+{
+	return size_t((width + 3) / 4) * size_t((height + 3) / 4) * blockBytes(format);
+}
+
+void TextureCompression::compressLevel(const unsigned char* pixels, int width, int height, int nChannels, std::vector<unsigned char>& out)
+{
+	const uint32_t format = formatForChannels(nChannels);
+	const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	const size_t bytesPerBlock = blockBytes(format);
+	out.resize(compressedSize(format, width, height));
+	for (int by = 0; by < blocksY; by++)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			// Edge blocks repeat the last row/column
+			unsigned char texels[16][4] = {};
+			for (int i = 0; i < 16; i++)
+			{
+				const int x = std::min(bx * 4 + (i & 3), width - 1);
+				const int y = std::min(by * 4 + (i >> 2), height - 1);
+				std::memcpy(texels[i], pixels + (size_t(y) * width + x) * nChannels, nChannels);
+			}
+			unsigned char* block = out.data() + (size_t(by) * blocksX + bx) * bytesPerBlock;
+			switch (format)
+			{
+			case FORMAT_BC1_RGB: encodeColorBlock(texels, block); break;
+			case FORMAT_BC3_RGBA: encodeChannelBlock(texels, 3, block); encodeColorBlock(texels, block + 8); break;
+			case FORMAT_BC4_R: encodeChannelBlock(texels, 0, block); break;
+			case FORMAT_BC5_RG: encodeChannelBlock(texels, 0, block); encodeChannelBlock(texels, 1, block + 8); break;
+			}
+		}
+	}
+}
+
+void TextureCompression::decompressLevel(const unsigned char* blocks, int width, int height, uint32_t format, std::vector<unsigned char>& out)
+{
+	const int nChannels = channelsForFormat(format);
+	const int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+	const size_t bytesPerBlock = blockBytes(format);
+	out.resize(size_t(width) * height * nChannels);
+	for (int by = 0; by < blocksY; by++)
+	{
+		for (int bx = 0; bx < blocksX; bx++)
+		{
+			const unsigned char* block = blocks + (size_t(by) * blocksX + bx) * bytesPerBlock;
+			unsigned char texels[16][4] = {};
+			switch (format)
+			{
+			case FORMAT_BC1_RGB: decodeColorBlock(block, false, texels); break;
+			case FORMAT_BC3_RGBA: decodeChannelBlock(block, 3, texels); decodeColorBlock(block + 8, true, texels); break;
+			case FORMAT_BC4_R: decodeChannelBlock(block, 0, texels); break;
+			case FORMAT_BC5_RG: decodeChannelBlock(block, 0, texels); decodeChannelBlock(block + 8, 1, texels); break;
+			}
+			for (int i = 0; i < 16; i++)
+			{
+				const int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+				if (x >= width || y >= height) continue;
+				std::memcpy(out.data() + (size_t(y) * width + x) * nChannels, texels[i], nChannels);
+			}
+		}
+	}
+}
+
+void TextureCompression::compressImage(TextureImage& image)
+{
+	if (image.compressedFormat != 0 || formatForChannels(image.nChannels) == 0) return;
+	int width = image.width, height = image.height;
+	for (auto& level : image.levels)
+	{
+		std::vector<unsigned char> blocks;
+		compressLevel(level.data(), width, height, image.nChannels, blocks);
+		level.swap(blocks);
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+	}
+	image.compressedFormat = formatForChannels(image.nChannels);
+}
+
+void TextureCompression::decompressImage(TextureImage& image)
+{
+	if (image.compressedFormat == 0) return;
+	int width = image.width, height = image.height;
+	for (auto& level : image.levels)
+	{
+		std::vector<unsigned char> pixels;
+		decompressLevel(level.data(), width, height, image.compressedFormat, pixels);
+		level.swap(pixels);
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+	}
+	image.compressedFormat = 0;
+}
+
+bool TextureCompression::writeKTX(const std::string& path, const TextureImage& image)
+{
+	if (image.compressedFormat == 0) return false;
+	std::error_code ec;
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), ec);
+	// Written under a temporary name and renamed, so a concurrent reader never sees half a file
+	return AtomicFile::write(path, [&image](std::ostream& file) {
+		const uint32_t header[13] = {
+			KTX_ENDIANNESS,
+			0,                                          // glType: compressed
+			1,                                          // glTypeSize
+			0,                                          // glFormat: compressed
+			image.compressedFormat,
+			baseFormatForChannels(image.nChannels),
+			uint32_t(image.width),
+			uint32_t(image.height),
+			0,                                          // pixelDepth
+			0,                                          // numberOfArrayElements
+			1,                                          // numberOfFaces
+			uint32_t(image.levels.size()),
+			0                                           // bytesOfKeyValueData
+		};
+		file.write(reinterpret_cast<const char*>(KTX_IDENTIFIER), sizeof(KTX_IDENTIFIER));
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+		// Block sizes are multiples of 8 bytes, so no mip padding is ever needed
+		for (const auto& level : image.levels)
+		{
+			const uint32_t imageSize = uint32_t(level.size());
+			file.write(reinterpret_cast<const char*>(&imageSize), sizeof(imageSize));
+			file.write(reinterpret_cast<const char*>(level.data()), level.size());
+		}
+	});
+}
+
+bool TextureCompression::readKTX(const std::string& path, TextureImage& image)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file) return false;
+	unsigned char identifier[12];
+	uint32_t header[13];
+	file.read(reinterpret_cast<char*>(identifier), sizeof(identifier));
+	file.read(reinterpret_cast<char*>(header), sizeof(header));
+	if (!file || std::memcmp(identifier, KTX_IDENTIFIER, sizeof(identifier)) != 0 || header[0] != KTX_ENDIANNESS) return false;
+	const uint32_t format = header[4];
+	const int nChannels = channelsForFormat(format);
+	int width = int(header[6]), height = int(header[7]);
+	const uint32_t numLevels = header[11];
+	if (nChannels == 0 || width <= 0 || height <= 0 || numLevels == 0 || numLevels > 32) return false;
+	file.seekg(header[12], std::ios::cur);
+
+	image.width = width;
+	image.height = height;
+	image.nChannels = nChannels;
+	image.compressedFormat = format;
+	image.levels.assign(numLevels, std::vector<unsigned char>());
+	for (uint32_t level = 0; level < numLevels; level++)
+	{
+		uint32_t imageSize = 0;
+		file.read(reinterpret_cast<char*>(&imageSize), sizeof(imageSize));
+		if (!file || imageSize != compressedSize(format, width, height)) return false;
+		image.levels[level].resize(imageSize);
+		file.read(reinterpret_cast<char*>(image.levels[level].data()), imageSize);
+		if (!file) return false;
+		width = std::max(1, width / 2);
+		height = std::max(1, height / 2);
+	}
+	return true;
+}
+
+void TextureCompression::setCacheDirectory(const std::string& dir)
+{
+	std::lock_guard<std::mutex> lock(s_cacheDirMutex);
+	s_cacheDir = dir;
+}
+
+std::string TextureCompression::getCachePath(uint64_t contentHash, uint32_t format)
+{
+	std::string dir;
+	{
+		std::lock_guard<std::mutex> lock(s_cacheDirMutex);
+		dir = s_cacheDir;
+	}
+	if (dir.empty())
+	{
+		std::error_code ec;
+		dir = (std::filesystem::temp_directory_path(ec) / "dkViewer" / "texcache").string();
+	}
+	char name[64];
+	// The v1 tag covers the encoder and the vertical flip; bump it if either changes
+	std::snprintf(name, sizeof(name), "%016llx_%04x_v1.ktx", (unsigned long long)contentHash, format);
+	return (std::filesystem::path(dir) / name).string();
+}
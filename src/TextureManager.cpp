@@ -1,51 +1,275 @@
 #include "TextureManager.h"
+#include "AssetCache.h"
+#include "TextureCompression.h"
 #include "glad/glad.h"
 #include "GLFW/glfw3.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <iostream>
+#include <algorithm>
 
-struct TextureData {
-    unsigned char* data;
-    int width;
-    int height;
-    int nChannels;
-};
+TextureManager::TextureManager()
+{
+    // RGTC (1 and 2 channels) is core since 3.0, S3TC (3 and 4 channels) is still an extension
+    if (glGetStringi)
+    {
+        GLint numExtensions = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &numExtensions);
+        for (GLint i = 0; i < numExtensions; i++)
+        {
+            const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+            if (name && std::string(name) == "GL_EXT_texture_compression_s3tc") m_s3tcSupported = true;
+        }
+    }
+    m_compress = m_s3tcSupported;
+}
+
+void TextureManager::setCompression(bool enable)
+{
+    m_compress = enable && m_s3tcSupported;
+}
 
 bool TextureManager::loadTexture(const std::string& texture_path, unsigned int& id)
 {
-    stbi_set_flip_vertically_on_load(1);
-    TextureData texture;
-    texture.data = stbi_load(texture_path.c_str(), &texture.width, &texture.height, &texture.nChannels, 0);
-    if (!texture.data)
+    if (acquireTexture(texture_path, id)) return true;
+    TextureImage image;
+    if (!decodeTexture(texture_path, image, m_compress)) return false;
+    return uploadTexture(texture_path, image, id);
+}
+
+bool TextureManager::acquireTexture(const std::string& texture_path, unsigned int& id)
+{
+    AssetKey key;
+    if (!AssetHash::makeKey(texture_path, key)) return false;
+    return acquireTexture(key, id);
+}
+
+bool TextureManager::acquireTexture(const AssetKey& key, unsigned int& id)
+{
+    if (key.canonicalPath.empty()) return false;
+    auto it = m_keyToId.find(key.str());
+    if (it == m_keyToId.end()) return false;
+    id = it->second;
+    return retainTexture(id);
+}
+
+bool TextureManager::retainTexture(unsigned int id)
+{
+    auto it = m_textures.find(id);
+    if (it == m_textures.end()) return false;
+    it->second.refCount++;
+    it->second.lastUse = ++m_useCounter;
+    return true;
+}
+
+bool TextureManager::decodeTexture(const std::string& texture_path, TextureImage& image, bool compress)
+{
+    // A transcoded copy from an earlier run saves both the decode and the compression
+    std::string cachePath;
+    if (compress)
+    {
+        AssetKey key;
+        int headerWidth, headerHeight, headerChannels;
+        if (AssetHash::makeKey(texture_path, key) && stbi_info(texture_path.c_str(), &headerWidth, &headerHeight, &headerChannels))
+        {
+            cachePath = TextureCompression::getCachePath(key.contentHash, TextureCompression::formatForChannels(headerChannels));
+            if (TextureCompression::readKTX(cachePath, image))
+            {
+                std::cout << "Texture " << texture_path << " loaded from the transcode cache" << std::endl;
+                return true;
+            }
+        }
+    }
+
+    // The thread local variant, so decoding on loader threads does not race on stb's global flag
+    stbi_set_flip_vertically_on_load_thread(1);
+    int width, height, nChannels;
+    unsigned char* data = stbi_load(texture_path.c_str(), &width, &height, &nChannels, 0);
+    if (!data)
     {
         std::cout << "Texture " << texture_path << " failed to load" << std::endl;
         return false;
     }
+    image.width = width;
+    image.height = height;
+    image.nChannels = nChannels;
+    image.compressedFormat = 0;
+    image.levels.clear();
+    image.levels.emplace_back(data, data + size_t(width) * height * nChannels);
+    stbi_image_free(data);
+
+    // Box filtered mip chain down to 1x1, built here so the GL thread never has to call glGenerateMipmap
+    while (width > 1 || height > 1)
+    {
+        const int w = std::max(1, width / 2);
+        const int h = std::max(1, height / 2);
+        const std::vector<unsigned char>& src = image.levels.back();
+        std::vector<unsigned char> dst(size_t(w) * h * nChannels);
+        for (int y = 0; y < h; y++)
+        {
+            const int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int x = 0; x < w; x++)
+            {
+                const int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                for (int c = 0; c < nChannels; c++)
+                {
+                    const int sum = src[(size_t(y0) * width + x0) * nChannels + c] + src[(size_t(y0) * width + x1) * nChannels + c]
+                                  + src[(size_t(y1) * width + x0) * nChannels + c] + src[(size_t(y1) * width + x1) * nChannels + c];
+                    dst[(size_t(y) * w + x) * nChannels + c] = (unsigned char)((sum + 2) / 4);
+                }
+            }
+        }
+        image.levels.push_back(std::move(dst));
+        width = w;
+        height = h;
+    }
+    if (compress)
+    {
+        TextureCompression::compressImage(image);
+        if (!cachePath.empty() && !TextureCompression::writeKTX(cachePath, image))
+        {
+            std::cout << "Could not write " << cachePath << " to the transcode cache" << std::endl;
+        }
+    }
     std::cout << "Texture " << texture_path << " loaded succesfully" << std::endl;
+    return true;
+}
+
+bool TextureManager::uploadTexture(const std::string& texture_path, const TextureImage& image, unsigned int& id)
+{
+    AssetKey key;
+    if (!AssetHash::makeKey(texture_path, key)) key.canonicalPath.clear();
+    return uploadTexture(texture_path, key, image, id);
+}
+
+bool TextureManager::uploadTexture(const std::string& texture_path, const AssetKey& key, const TextureImage& image, unsigned int& id)
+{
+    // Someone else may have finished loading the same file in the meantime
+    if (acquireTexture(key, id)) return true;
+
+    static const GLenum formats[4] = { GL_RED, GL_RG, GL_RGB, GL_RGBA };
+    static const GLenum internalFormats[4] = { GL_R8, GL_RG8, GL_RGB, GL_RGBA };
+    if (image.nChannels < 1 || image.nChannels > 4)
+    {
+        std::cout << "Texture " << texture_path << " has an unsupported channel count " << image.nChannels << std::endl;
+        return false;
+    }
+    // S3TC blocks from the cache on a driver without the extension get unpacked again
+    const bool isS3TC = image.compressedFormat == TextureCompression::FORMAT_BC1_RGB || image.compressedFormat == TextureCompression::FORMAT_BC3_RGBA;
+    if (isS3TC && !m_s3tcSupported)
+    {
+        TextureImage unpacked = image;
+        TextureCompression::decompressImage(unpacked);
+        return uploadTexture(texture_path, key, unpacked, id);
+    }
+    const GLenum format = formats[image.nChannels - 1];
     glGenTextures(1, &id);
     // Bind this texture to modify it
     glBindTexture(GL_TEXTURE_2D, id);
-    if (texture.nChannels == 3)
+    // RGB rows are not 4 byte aligned in general
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    int width = image.width, height = image.height;
+    for (size_t level = 0; level < image.levels.size(); level++)
+    {
+        const std::vector<unsigned char>& data = image.levels[level];
+        if (image.compressedFormat != 0)
+        {
+            glCompressedTexImage2D(GL_TEXTURE_2D, GLint(level), image.compressedFormat, width, height, 0, GLsizei(data.size()), data.data());
+        }
+        else
+        {
+            glTexImage2D(GL_TEXTURE_2D, GLint(level), internalFormats[image.nChannels - 1], width, height, 0, format, GL_UNSIGNED_BYTE, data.data());
+        }
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, GLint(image.levels.size()) - 1);
+    // Grey and grey + alpha images sample as such, instead of as pure red / red-green
+    if (image.nChannels == 1)
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, texture.width, texture.height, 0, GL_RGB, GL_UNSIGNED_BYTE, texture.data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        const GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
     }
-    else if (texture.nChannels == 4)
+    else if (image.nChannels == 2)
     {
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, texture.width, texture.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, texture.data);
-        glGenerateMipmap(GL_TEXTURE_2D);
+        const GLint swizzle[4] = { GL_RED, GL_RED, GL_RED, GL_GREEN };
+        glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
     }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
     glBindTexture(GL_TEXTURE_2D, 0);
-    stbi_image_free(texture.data);
-    m_allTextureIDs.push_back(id);
+
+    const bool cacheable = !key.canonicalPath.empty();
+    TextureEntry entry;
+    entry.key = cacheable ? key.str() : texture_path;
+    entry.refCount = 1;
+    entry.bytes = 0;
+    for (auto& level : image.levels) entry.bytes += level.size();
+    entry.lastUse = ++m_useCounter;
+    m_textures[id] = entry;
+    if (cacheable) m_keyToId[entry.key] = id;
+    m_bytes += entry.bytes;
+    evictUnused();
     return true;
 }
 
-TextureManager::~TextureManager()
+unsigned int TextureManager::getPlaceholderTexture()
+{
+    if (m_placeholderID == 0)
+    {
+        // 1x1 mid grey, shown while the real texture is still being decoded
+        const unsigned char grey[4] = { 128, 128, 128, 255 };
+        glGenTextures(1, &m_placeholderID);
+        glBindTexture(GL_TEXTURE_2D, m_placeholderID);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, grey);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    return m_placeholderID;
+}
+
+void TextureManager::releaseTexture(unsigned int id)
+{
+    auto it = m_textures.find(id);
+    if (it == m_textures.end() || it->second.refCount == 0) return;
+    it->second.refCount--;
+    evictUnused();
+}
+
+void TextureManager::setBudget(size_t bytes)
+{
+    m_budget = bytes;
+    evictUnused();
+}
+
+void TextureManager::evictUnused()
 {
-    for (unsigned int& texID : m_allTextureIDs)
+    if (m_bytes <= m_budget) return;
+    // Least recently used first, and only textures nobody holds a reference to
+    std::vector<unsigned int> candidates;
+    for (auto& it : m_textures)
     {
+        if (it.second.refCount == 0) candidates.push_back(it.first);
+    }
+    std::sort(candidates.begin(), candidates.end(), [this](unsigned int a, unsigned int b) {
+        return m_textures[a].lastUse < m_textures[b].lastUse;
+    });
+    for (unsigned int texID : candidates)
+    {
+        if (m_bytes <= m_budget) break;
+        TextureEntry& entry = m_textures[texID];
+        m_bytes -= entry.bytes;
+        m_keyToId.erase(entry.key);
+        m_textures.erase(texID);
         glDeleteTextures(1, &texID);
     }
+}
+
+TextureManager::~TextureManager()
+{
+    for (auto& it : m_textures)
+    {
+        glDeleteTextures(1, &it.first);
+    }
+    if (m_placeholderID != 0) glDeleteTextures(1, &m_placeholderID);
 }
\ No newline at end of file
@@ -0,0 +1,109 @@
+#include "ThreadPool.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+
+ThreadPool::ThreadPool(unsigned int numThreads)
+{
+	if (numThreads == 0)
+	{
+		// Keep at least one worker so enqueue() always makes progress, even on a single core
+		unsigned int hw = std::thread::hardware_concurrency();
+		numThreads = hw > 2 ? hw - 1 : 1;
+	}
+	m_workers.reserve(numThreads);
+	for (unsigned int i = 0; i < numThreads; i++)
+	{
+		m_workers.emplace_back([this]() { workerLoop(); });
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cv.notify_all();
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+ThreadPool& ThreadPool::global()
+{
+	static ThreadPool pool;
+	return pool;
+}
+
+ThreadPool& ThreadPool::background()
+{
+	static ThreadPool pool(2);
+	return pool;
+}
+
+void ThreadPool::workerLoop()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cv.wait(lock, [this]() { return m_stop || !m_tasks.empty(); });
+			if (m_stop && m_tasks.empty()) return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void ThreadPool::parallelFor(size_t begin, size_t end, const std::function<void(size_t, size_t)>& body, size_t minChunk)
+{
+	if (end <= begin) return;
+	const size_t count = end - begin;
+	const size_t maxChunks = size_t(m_workers.size()) + 1;
+	const size_t numChunks = std::min(maxChunks, (count + minChunk - 1) / std::max<size_t>(minChunk, 1));
+	if (numChunks <= 1)
+	{
+		body(begin, end);
+		return;
+	}
+
+	// Chunks are claimed from a counter owned by this call. The caller works through them too, and only ever
+	// runs its own chunks: other queued tasks (loading, decoding, solves) stay with the workers, and a nested
+	// call cannot deadlock because any chunk no worker has claimed yet is run by the caller.
+	struct Group
+	{
+		std::atomic<size_t> next{ 0 };
+		std::atomic<size_t> done{ 0 };
+		std::mutex mutex;
+		std::condition_variable cv;
+	};
+	auto group = std::make_shared<Group>();
+	const size_t chunkSize = (count + numChunks - 1) / numChunks;
+	auto runChunks = [group, &body, begin, end, chunkSize, numChunks]() {
+		for (size_t c = group->next.fetch_add(1); c < numChunks; c = group->next.fetch_add(1))
+		{
+			const size_t b = begin + c * chunkSize;
+			const size_t e = std::min(end, b + chunkSize);
+			if (b < e) body(b, e);
+			if (group->done.fetch_add(1) + 1 == numChunks)
+			{
+				std::lock_guard<std::mutex> lock(group->mutex);
+				group->cv.notify_all();
+			}
+		}
+	};
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		// Helpers that start after every chunk is claimed return without touching body
+		for (size_t c = 1; c < numChunks; c++) m_tasks.emplace_back(runChunks);
+	}
+	m_cv.notify_all();
+
+	runChunks();
+	std::unique_lock<std::mutex> lock(group->mutex);
+	group->cv.wait(lock, [&]() { return group->done.load() == numChunks; });
+}
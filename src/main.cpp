@@ -14,6 +14,8 @@
 #include <memory>
 #include <string>
 #include <filesystem>
+#include <future>
+#include <cstdlib>
 // Eigen
 #include <Eigen/Geometry>
 // Local
@@ -25,11 +27,19 @@
 #include "Camera.h"
 #include "Mesh.h"
 #include "SpringSolver.h"
+#include "OffscreenTarget.h"
+#include "HeadlessContext.h"
+#include "SimCacheWriter.h"
+#include "SweepRunner.h"
+#include "ThreadPool.h"
 
 static const std::string g_assets_folder = ASSETS_DIR;
+// The two corners of plane4.obj the demo cloth hangs from
+static const std::vector<uint32_t> g_ClothPins = { 263, 275 };
 static bool g_ShowStatsOverlay = false;
 static bool g_ShowWireframe = false;
 static bool g_DoSim = false;
+static bool g_RecordSim = false;
 
 void framebuffer_size_clbk(GLFWwindow* window, int width, int height);
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods);
@@ -40,6 +50,80 @@ void scroll_callback(GLFWwindow* window, double xoffset, double yoffset);
 Scene* MyScene = NULL;
 SpringSolver* SpSolve = NULL;
 
+// Command line options for batch rendering without a window:
+//   --headless --frames N --out DIR --width W --height H --sim --turntable --record CACHE
+// or, for a parameter sweep of the cloth without any window or GL context:
+//   --sweep CSV --grid "k=10,30,50 dt=0.001:0.01:4" --steps N
+// adding precision=float,double,mixed to the grid compares the solver precisions on every parameter set
+struct HeadlessOptions
+{
+    bool enabled = false;
+    int frames = 120;
+    std::string outDir = "frames";
+    unsigned int width = 1920;
+    unsigned int height = 1080;
+    bool simulate = false;
+    bool turntable = false;
+    std::string recordPath;
+    std::string sweepCSV;
+    std::string sweepGrid;
+    uint32_t sweepSteps = 500;
+};
+
+static HeadlessOptions parseArgs(int argc, char** argv)
+{
+    HeadlessOptions opts;
+    for (int i = 1; i < argc; i++)
+    {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--headless") opts.enabled = true;
+        else if (arg == "--sim") opts.simulate = true;
+        else if (arg == "--turntable") opts.turntable = true;
+        else if (arg == "--frames" && hasValue) opts.frames = std::max(0, std::atoi(argv[++i]));
+        else if (arg == "--out" && hasValue) opts.outDir = argv[++i];
+        else if (arg == "--record" && hasValue) opts.recordPath = argv[++i];
+        else if (arg == "--sweep" && hasValue) opts.sweepCSV = argv[++i];
+        else if (arg == "--grid" && hasValue) opts.sweepGrid = argv[++i];
+        else if (arg == "--steps" && hasValue) opts.sweepSteps = uint32_t(std::max(1, std::atoi(argv[++i])));
+        else if (arg == "--width" && hasValue) opts.width = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--height" && hasValue) opts.height = std::max(1, std::atoi(argv[++i]));
+        else std::cout << "Ignoring unknown argument " << arg << std::endl;
+    }
+    return opts;
+}
+
+// Where the viewer records the cloth to when no path is given
+static const std::string& defaultSimCachePath()
+{
+    static const std::string path = [] {
+        std::error_code ec;
+        auto dir = std::filesystem::temp_directory_path(ec) / "dkViewer";
+        std::filesystem::create_directories(dir, ec);
+        return (dir / "cloth.dksim").string();
+    }();
+    return path;
+}
+
+// Starts appending every solver step to a sim cache, or stops and finalizes the file
+static bool setSimRecording(bool record, const std::string& path)
+{
+    if (!record)
+    {
+        if (auto writer = SpSolve->getRecorder())
+        {
+            SpSolve->setRecorder(nullptr);
+            writer->close();
+            std::cout << "Recorded " << writer->getNumFrames() << " frames (" << writer->getBytesWritten() / 1024 << " KB)" << std::endl;
+        }
+        return true;
+    }
+    auto writer = std::make_shared<SimCacheWriter>();
+    if (!writer->open(path, SpSolve->getNumVerts(), SpSolve->dt)) return false;
+    SpSolve->setRecorder(writer);
+    return true;
+}
+
 void setupScene(Scene* scene)
 {
     MyScene->SetupGrid();
@@ -47,20 +131,11 @@ void setupScene(Scene* scene)
     MyScene->texMgr = std::make_shared<TextureManager>();
     //////////////////// MESH SETUP /////////////////////////
     auto modelPath = std::filesystem::path(g_assets_folder) / "plane4.obj";
-    MyScene->LoadModel(modelPath.string().c_str());
-    SpSolve->setup(MyScene->models[0]);
+    // The cloth gets deformed by the solver, so it must not be shared through the asset cache
+    MyScene->LoadModel(modelPath.string().c_str(), false);
+    SpSolve->setup(MyScene->models[0], g_ClothPins);
     // Set the cloth normals to recompute
     MyScene->models[0]->SetRecomputeNormals(true);
-    auto modelPath2 = std::filesystem::path(g_assets_folder) / "sphere.obj";
-    MyScene->LoadModel(modelPath2.string().c_str());
-
-    // Move the sphere down a bit
-    Eigen::Vector3f translation(0.0f, -0.8f, -0.2f);
-    Eigen::Vector3f scale(0.5f, 0.5f, 0.5f);
-    MyScene->TranslateModel(1, translation);
-    MyScene->ScaleModel(1, scale);
-
-    SpSolve->addCollider(MyScene->models[1]);
 
     ////////////////// SHADER SETUP  ///////////////////////
     auto vertShaderPath = std::filesystem::path(g_assets_folder) / "VertexShader.vert";
@@ -92,10 +167,26 @@ void setupScene(Scene* scene)
         }
     
     }
+
+    // The sphere streams in on a loader thread; it only gets placed and collided with once it is ready
+    auto modelPath2 = std::filesystem::path(g_assets_folder) / "sphere.obj";
+    MyScene->LoadModelAsync(modelPath2.string().c_str(), true, [shader](std::shared_ptr<Mesh> sphere) {
+        if (!sphere) return;
+        // Move the sphere down a bit
+        Eigen::Matrix4f transform = Eigen::Matrix4f::Identity();
+        transform.block<3, 3>(0, 0) *= 0.5f;
+        transform.block<3, 1>(0, 3) = Eigen::Vector3f(0.0f, -0.8f, -0.2f);
+        sphere->SetModelMtx(transform);
+        sphere->m_shader = shader;
+        // The sphere never moves, so it can go into a static batch
+        sphere->SetStatic(true);
+        SpSolve->addCollider(sphere);
+    });
+
     Eigen::Vector3f wireColor(1.0f, 1.0f, 1.0f);
-    shader->use();
-    shader->setVec3("wireColor", wireColor.data());
-    shader->setBool("doWire", g_ShowWireframe);
+    MyScene->SetWireColor(wireColor);
+    if (g_ShowWireframe) MyScene->ShowWireframe();
+    else MyScene->HideWireframe();
     Eigen::Vector3f gridColor(0.0f, 0.0f, 0.0f);
     gridShader->use();
     gridShader->setVec3("ourColor", gridColor.data());
@@ -103,17 +194,166 @@ void setupScene(Scene* scene)
     shader->setBool("hasTexture", true);*/
 }
 
-int main()
+void setContextHints()
 {
-    glfwInit();
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
     //glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-    
-    MyScene = new Scene(); // This creates a default camera
+}
+
+// Renders opts.frames frames into an offscreen framebuffer and writes them out as PPM images. The context
+// comes from EGL directly (see HeadlessContext), so this runs on machines without any display, e.g. Mesa's
+// llvmpipe on a CI box. Without EGL it falls back to a hidden GLFW window, which does need a display.
+int runHeadless(const HeadlessOptions& opts)
+{
+    HeadlessContext eglContext;
+    GLFWwindow* window = NULL;
+    auto shutdown = [&]() {
+        eglContext.destroy();
+        if (window != NULL)
+        {
+            glfwDestroyWindow(window);
+            glfwTerminate();
+        }
+    };
+    if (!eglContext.create(3, 3))
+    {
+        if (!glfwInit())
+        {
+            std::cout << "Failed to create an offscreen GL context: no EGL and GLFW could not initialize" << std::endl;
+            return -1;
+        }
+        setContextHints();
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+        // The window only carries the context, so keep its default framebuffer tiny
+        window = glfwCreateWindow(16, 16, MyScene->title, NULL, NULL);
+        if (window == NULL)
+        {
+            std::cout << "Failed to create an offscreen GL context" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+        glfwMakeContextCurrent(window);
+    }
+    const GLADloadproc loader = window != NULL ? (GLADloadproc)glfwGetProcAddress : (GLADloadproc)HeadlessContext::getProcAddress;
+    if (!gladLoadGLLoader(loader))
+    {
+        std::cout << "Failed to initialize GLAD" << std::endl;
+        shutdown();
+        return -1;
+    }
+
+    OffscreenTarget target;
+    if (!target.init(opts.width, opts.height))
+    {
+        shutdown();
+        return -1;
+    }
+    std::error_code ec;
+    std::filesystem::create_directories(opts.outDir, ec);
+
+    setupScene(MyScene);
+    // Every frame must show the whole scene, so nothing may still be streaming in
+    MyScene->WaitForLoads();
+    SpSolve->doSim = opts.simulate;
+    if (!opts.recordPath.empty()) setSimRecording(true, opts.recordPath);
+
+    glEnable(GL_DEPTH_TEST);
+    glFrontFace(GL_CW);
+    glCullFace(GL_BACK);
+
+    // Frames are read back a few frames late so the GPU is never waited on, and written to disk on the pool
+    std::vector<std::future<void>> writes;
+    std::vector<unsigned char> pixels;
+    auto writeFrame = [&](uint64_t frameId) {
+        char name[32];
+        snprintf(name, sizeof(name), "frame_%05llu.ppm", (unsigned long long)frameId);
+        const std::string path = (std::filesystem::path(opts.outDir) / name).string();
+        writes.push_back(ThreadPool::global().enqueue([path, w = target.getWidth(), h = target.getHeight(), rgba = std::move(pixels)]() {
+            if (!OffscreenTarget::writePPM(path, w, h, rgba)) std::cout << "Failed to write " << path << std::endl;
+        }));
+        pixels = std::vector<unsigned char>();
+    };
+    const float yawStep = opts.frames > 0 ? 360.0f / opts.frames : 0.0f;
+    uint64_t frameId;
+    for (int frame = 0; frame < opts.frames; frame++)
+    {
+        if (opts.turntable && frame > 0)
+        {
+            MyScene->camera->yaw += yawStep;
+            MyScene->camera->rotateTarget();
+        }
+        SpSolve->step();
+
+        target.bind();
+        glClearColor(0.2f, 0.3f, 0.3f, 1.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        MyScene->Render(MyScene->camera->getMtx());
+
+        // Make room in the ring if every buffer is still in flight, then collect whatever is already done
+        if (target.getNumPending() == target.getNumReadbackBuffers() && target.collectReadback(pixels, frameId, true)) writeFrame(frameId);
+        target.requestReadback(frame);
+        while (target.collectReadback(pixels, frameId, false)) writeFrame(frameId);
+    }
+    while (target.collectReadback(pixels, frameId, true)) writeFrame(frameId);
+    for (auto& write : writes) write.wait();
+    setSimRecording(false, "");
+    std::cout << "Wrote " << writes.size() << " frames to " << opts.outDir << std::endl;
+
+    target.release();
+    shutdown();
+    return 0;
+}
+
+// Simulates the cloth once per grid point on the thread pool and writes the metrics to a CSV
+int runSweep(const HeadlessOptions& opts)
+{
+    SweepRunner::Grid grid;
+    if (!SweepRunner::parseGrid(opts.sweepGrid, grid))
+    {
+        std::cout << "Could not parse the sweep grid \"" << opts.sweepGrid << "\"" << std::endl;
+        return -1;
+    }
+    // CPU only: nothing is uploaded, so no GL context is needed
+    auto cloth = std::make_shared<Mesh>();
+    auto modelPath = std::filesystem::path(g_assets_folder) / "plane4.obj";
+    if (!cloth->LoadFileTinyObj(modelPath.string(), false)) return -1;
+    const std::vector<SweepRunner::Parameters> points = SweepRunner::expandGrid(grid);
+    std::cout << "Sweeping " << points.size() << " parameter sets, " << opts.sweepSteps << " steps each" << std::endl;
+    SweepRunner runner(cloth);
+    runner.setPinned(g_ClothPins);
+    std::mutex printMutex;
+    const auto results = runner.run(points, opts.sweepSteps, [&printMutex](size_t done, size_t total) {
+        std::lock_guard<std::mutex> lock(printMutex);
+        if (done % 10 == 0 || done == total) std::cout << done << "/" << total << " runs done" << std::endl;
+    });
+    if (!SweepRunner::writeCSV(opts.sweepCSV, results))
+    {
+        std::cout << "Failed to write " << opts.sweepCSV << std::endl;
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const HeadlessOptions headless = parseArgs(argc, argv);
+    if (!headless.sweepCSV.empty()) return runSweep(headless);
     SpSolve = new SpringSolver();
+    if (headless.enabled)
+    {
+        MyScene = new Scene(headless.width, headless.height);
+        return runHeadless(headless);
+    }
+    if (!glfwInit())
+    {
+        std::cout << "Failed to initialize GLFW" << std::endl;
+        return -1;
+    }
+    setContextHints();
+    MyScene = new Scene(); // This creates a default camera
 
     GLFWwindow* window = glfwCreateWindow(MyScene->SCR_WIDTH, MyScene->SCR_HEIGHT, MyScene->title, NULL, NULL);
     if (window == NULL)
@@ -127,6 +367,8 @@ int main()
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
         std::cout << "Failed to initialize GLAD" << std::endl;
+        glfwDestroyWindow(window);
+        glfwTerminate();
         return -1;
     }
 
@@ -210,8 +452,14 @@ int main()
                     ImGuiWindowFlags_NoDecoration |
                     ImGuiWindowFlags_AlwaysAutoResize |
                     ImGuiWindowFlags_NoSavedSettings);
-                ImGui::Text("Vertices: %zu", MyScene->GetNumVerts());
-                ImGui::Text("Edges:    %zu", MyScene->GetNumEdges());
+                ImGui::Text("Vertices: %u", MyScene->GetNumVerts());
+                ImGui::Text("Edges:    %u", MyScene->GetNumEdges());
+                ImGui::Text("Drawn:    %u", MyScene->GetNumDrawn());
+                ImGui::Text("Culled:   %u", MyScene->GetNumCulled());
+                ImGui::Text("Clusters: %u drawn, %u culled", MyScene->GetNumClustersDrawn(), MyScene->GetNumClustersCulled());
+                ImGui::Text("Draw calls: %u", MyScene->GetNumDrawCalls());
+                ImGui::Text("State changes: %u", MyScene->GetNumStateChanges());
+                ImGui::Text("Batched meshes: %u", MyScene->GetNumBatchedMeshes());
                 ImGui::End();
             }
             static float f = 0.0f;
@@ -234,6 +482,26 @@ int main()
             {
                 MyScene->SetShowGrid(showGrid);
             }
+            float lodThreshold = MyScene->GetLODThreshold();
+            if (ImGui::SliderFloat("LOD Error (px)", &lodThreshold, 0.1f, 20.0f, "%.1f"))
+            {
+                MyScene->SetLODThreshold(lodThreshold);
+            }
+            bool frustumCulling = MyScene->IsFrustumCulling();
+            if (ImGui::Checkbox("Frustum Culling", &frustumCulling))
+            {
+                MyScene->SetFrustumCulling(frustumCulling);
+            }
+            bool staticBatching = MyScene->IsStaticBatching();
+            if (ImGui::Checkbox("Static Batching", &staticBatching))
+            {
+                MyScene->SetStaticBatching(staticBatching);
+            }
+            bool coneCulling = MyScene->IsClusterConeCulling();
+            if (ImGui::Checkbox("Cluster Backface Culling", &coneCulling))
+            {
+                MyScene->SetClusterConeCulling(coneCulling);
+            }
             // Near plane slider
             if (ImGui::SliderFloat("Near Plane", &MyScene->camera->NEAR, 0.01f, MyScene->camera->FAR - 0.1f, "%.3f")) {
                 MyScene->camera->updateProjMtx();
@@ -254,10 +522,71 @@ int main()
             ImGui::SliderFloat("Collision Tolerance", &SpSolve->colTol, 0.00001f, 1.0f, "%.3f");
             ImGui::Checkbox("Enable Sim", &SpSolve->doSim);
             ImGui::Checkbox("Enable Collisions", &SpSolve->doCollisions);
+            const char* integrators[] = { "Symplectic Euler", "Implicit Euler", "Implicit Euler (Newton)" };
+            ImGui::Combo("Integrator", &SpSolve->integrator, integrators, IM_ARRAYSIZE(integrators));
+            if (SpSolve->integrator == SpringSolver::NEWTON)
+            {
+                ImGui::SameLine();
+                ImGui::Text("%u Newton iterations", SpSolve->getLastNewtonIterations());
+            }
+            const char* linearSolvers[] = { "Sparse LU", "Symmetric LDLT", "Block CG", "Block BiCGSTAB", "Matrix-Free CG" };
+            ImGui::Combo("Linear Solver", &SpSolve->linearSolver, linearSolvers, IM_ARRAYSIZE(linearSolvers));
+            if (SpSolve->linearSolver >= SpringSolver::BLOCK_CG)
+            {
+                ImGui::SameLine();
+                ImGui::Text("%u iterations", SpSolve->getLastIterations());
+            }
+            ImGui::Text("Cloth bodies: %zu, solver islands: %u", SpSolve->getBodies().size(), SpSolve->getNumIslands());
+            if (ImGui::Checkbox("Record Sim Cache", &g_RecordSim))
+            {
+                if (g_RecordSim) MyScene->StopSimCache();
+                if (!setSimRecording(g_RecordSim, defaultSimCachePath())) g_RecordSim = false;
+            }
+            if (auto writer = SpSolve->getRecorder())
+            {
+                ImGui::SameLine();
+                ImGui::Text("%u frames, %.1f MB", writer->getNumFrames(), writer->getBytesWritten() / (1024.0 * 1024.0));
+            }
+            // Playback replaces the solver on the cloth
+            bool playCache = MyScene->HasSimCache();
+            if (ImGui::Checkbox("Play Sim Cache", &playCache))
+            {
+                if (playCache)
+                {
+                    g_RecordSim = false;
+                    setSimRecording(false, "");
+                    SpSolve->doSim = false;
+                    MyScene->PlaySimCache(defaultSimCachePath(), 0);
+                }
+                else
+                {
+                    MyScene->StopSimCache();
+                    SpSolve->reset();
+                }
+            }
+            if (MyScene->HasSimCache())
+            {
+                bool paused = MyScene->IsSimCachePaused();
+                if (ImGui::Checkbox("Pause", &paused)) MyScene->SetSimCachePaused(paused);
+                int cacheFrame = int(MyScene->GetSimCacheFrame());
+                if (ImGui::SliderInt("Cache Frame", &cacheFrame, 0, int(MyScene->GetSimCacheNumFrames()) - 1))
+                {
+                    MyScene->SetSimCacheFrame(uint32_t(cacheFrame));
+                }
+            }
             /*ImGui::Text("This is a basic ImGui window.");
             ImGui::SliderFloat("float", &f, 0.0f, 1.0f);*/
             if (ImGui::Button("Button"))SpSolve->reset();
+            static const std::string checkpointPath = (std::filesystem::path(defaultSimCachePath()).parent_path() / "cloth.dkckpt").string();
+            if (ImGui::Button("Save Checkpoint")) SpSolve->saveCheckpoint(checkpointPath);
+            ImGui::SameLine();
+            if (ImGui::Button("Load Checkpoint")) SpSolve->loadCheckpoint(checkpointPath);
             if (ImGui::Button("Recalc Normals"))MyScene->models[0]->RecomputeNormals();
+            bool gpuNormals = MyScene->models[0]->GetNormalSource() == Mesh::NORMALS_GPU_FLAT;
+            if (ImGui::Checkbox("GPU Normals", &gpuNormals))
+            {
+                MyScene->models[0]->SetNormalSource(gpuNormals ? Mesh::NORMALS_GPU_FLAT : Mesh::NORMALS_CPU);
+            }
             ImGui::SameLine();
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)",
                 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
@@ -283,6 +612,7 @@ int main()
         // update buffer
         glfwSwapBuffers(window);
     }
+    setSimRecording(false, "");
     
     glfwTerminate();
     return 0;
@@ -290,9 +620,7 @@ int main()
 
 void framebuffer_size_clbk(GLFWwindow* window, int width, int height)
 {
-    glViewport(0, 0, width, height);
-    MyScene->camera->ASPECT_RATIO = static_cast<float>(width) / static_cast<float>(height);
-    MyScene->camera->updateProjMtx();
+    MyScene->SetViewportSize(width, height);
 }
 
 void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
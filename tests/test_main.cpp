@@ -3,8 +3,28 @@
 #include <filesystem>
 #include <random>
 #include <limits>
+#include <set>
+#include <array>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <atomic>
 #include "Octree.h"
 #include "Mesh.h"
+#include "Camera.h"
+#include "Frustum.h"
+#include "AssetCache.h"
+#include "TextureManager.h"
+#include "TextureCompression.h"
+#include "ThreadPool.h"
+#include "RenderQueue.h"
+#include "SimCacheWriter.h"
+#include "SimCacheReader.h"
+#include "SpringSolver.h"
+#include "BlockSparseMatrix.h"
+#include "KrylovSolvers.h"
+#include "SweepRunner.h"
+#include "HeadlessContext.h"
 
 
 TEST(MeshTests, MeshLoad) {
@@ -13,6 +33,310 @@ TEST(MeshTests, MeshLoad) {
     EXPECT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
 }
 
+TEST(MeshTests, BulkPositions) {
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "sphere.obj";
+    Mesh testMesh = Mesh();
+    ASSERT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
+    const uint32_t numVerts = testMesh.GetNumVerts();
+    Eigen::VectorXf positions = testMesh.GetPositions();
+    ASSERT_EQ(positions.size(), 3 * Eigen::Index(numVerts));
+    positions.array() += 1.0f;
+    testMesh.SetPositions(positions);
+    for (uint32_t i = 0; i < numVerts; i++)
+    {
+        EXPECT_EQ(testMesh.GetVertex(i), positions.segment<3>(3 * Eigen::Index(i)));
+    }
+}
+
+TEST(MeshTests, RecomputeNormals) {
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "plane.obj";
+    Mesh testMesh = Mesh();
+    ASSERT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
+    const uint32_t numVerts = testMesh.GetNumVerts();
+    // Bend the plane so the normals are not all the same
+    Eigen::VectorXf positions = testMesh.GetPositions();
+    for (uint32_t i = 0; i < numVerts; i++)
+    {
+        positions(3 * i + 1) += std::sin(positions(3 * i) * 3.0f);
+    }
+    testMesh.SetPositions(positions);
+
+    // Serial scatter reference, the way it used to be computed
+    auto reference = [&]() {
+        std::vector<Eigen::Vector3f> normals(numVerts, Eigen::Vector3f::Zero());
+        for (uint32_t t = 0; t < testMesh.GetNumTriangles(); t++)
+        {
+            const unsigned int* tri = testMesh.GetTriIndices(t);
+            Eigen::Vector3f v1 = testMesh.GetVertex(tri[0]), v2 = testMesh.GetVertex(tri[1]), v3 = testMesh.GetVertex(tri[2]);
+            Eigen::Vector3f n = (v2 - v1).cross(v3 - v1);
+            for (int c = 0; c < 3; c++) normals[tri[c]] += n;
+        }
+        for (auto& n : normals) n.normalize();
+        return normals;
+    };
+
+    testMesh.SetIncrementalNormals(true);
+    testMesh.RecomputeNormals();
+    auto expected = reference();
+    for (uint32_t i = 0; i < numVerts; i++)
+    {
+        EXPECT_TRUE(testMesh.GetNormals()[i].isApprox(expected[i], 1e-4f));
+    }
+
+    // Move a handful of vertices and let the incremental path patch the normals up
+    for (uint32_t i = 0; i < numVerts; i += 97)
+    {
+        testMesh.SetVertex(testMesh.GetVertex(i) + Eigen::Vector3f(0.0f, 0.3f, 0.0f), i);
+    }
+    testMesh.RecomputeNormals();
+    expected = reference();
+    for (uint32_t i = 0; i < numVerts; i++)
+    {
+        EXPECT_TRUE(testMesh.GetNormals()[i].isApprox(expected[i], 1e-4f));
+    }
+}
+
+TEST(MeshTests, GenerateLODs)
+{
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "sphere.obj";
+    Mesh testMesh;
+    ASSERT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
+    const uint32_t numTriangles = testMesh.GetNumTriangles();
+    ASSERT_GT(testMesh.GenerateLODs(4, 0.5f, 32), 0u);
+    // The LOD ranges must not show up as extra full-detail triangles
+    EXPECT_EQ(testMesh.GetNumTriangles(), numTriangles);
+
+    size_t prevIndices = 3 * size_t(numTriangles);
+    for (uint32_t level = 1; level <= testMesh.GetNumLODs(); level++)
+    {
+        size_t numIndices = 0;
+        for (const auto& entry : testMesh.m_lods[level - 1])
+        {
+            numIndices += entry.NumIndices;
+            // Every level indexes the original vertices
+            for (unsigned int i = 0; i < entry.NumIndices; i++)
+            {
+                EXPECT_LT(testMesh.GetTriIndices((entry.BaseIndex + i) / 3)[(entry.BaseIndex + i) % 3] + entry.BaseVertex, testMesh.GetNumVerts());
+            }
+        }
+        EXPECT_LT(numIndices, prevIndices);
+        EXPECT_GE(testMesh.GetLODError(level), testMesh.GetLODError(level - 1));
+        prevIndices = numIndices;
+    }
+
+    // Far away picks a coarse level, up close the full mesh; in between, hysteresis keeps the current one
+    EXPECT_EQ(testMesh.SelectLOD(1e-3f, 1.0f), testMesh.GetNumLODs());
+    EXPECT_EQ(testMesh.SelectLOD(1e6f, 1.0f), 0u);
+    const float err1 = testMesh.GetLODError(1);
+    EXPECT_EQ(testMesh.SelectLOD(0.9f / err1, 1.0f), 0u);
+}
+
+TEST(MeshTests, BuildClusters)
+{
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "plane.obj";
+    Mesh testMesh;
+    ASSERT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
+    const uint32_t numTriangles = testMesh.GetNumTriangles();
+    std::multiset<std::array<unsigned int, 3>> before;
+    for (uint32_t t = 0; t < numTriangles; t++)
+    {
+        const unsigned int* tri = testMesh.GetTriIndices(t);
+        before.insert({ tri[0], tri[1], tri[2] });
+    }
+    const uint32_t numClusters = testMesh.BuildClusters(64);
+    EXPECT_GE(numClusters, (numTriangles + 63) / 64);
+    // Same triangles, just regrouped
+    std::multiset<std::array<unsigned int, 3>> after;
+    for (uint32_t t = 0; t < numTriangles; t++)
+    {
+        const unsigned int* tri = testMesh.GetTriIndices(t);
+        after.insert({ tri[0], tri[1], tri[2] });
+    }
+    EXPECT_EQ(before, after);
+    EXPECT_EQ(testMesh.GetNumTriangles(), numTriangles);
+}
+
+TEST(BoundsTests, AABBAndFrustum)
+{
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "sphere.obj";
+    Mesh testMesh;
+    ASSERT_TRUE(testMesh.LoadFileTinyObj(modelPath.string().c_str(), false));
+    AABB local = testMesh.ComputeAABB();
+    ASSERT_FALSE(local.isEmpty());
+    for (uint32_t i = 0; i < testMesh.GetNumVerts(); i++)
+    {
+        Eigen::Vector3f p = testMesh.GetVertex(i);
+        EXPECT_TRUE((p.array() >= local.min.array()).all() && (p.array() <= local.max.array()).all());
+    }
+
+    // World bounds follow the model matrix without touching the vertices again
+    Eigen::Matrix4f mtx = Eigen::Matrix4f::Identity();
+    mtx.block<3, 1>(0, 3) = Eigen::Vector3f(10.0f, 0.0f, 0.0f);
+    testMesh.SetModelMtx(mtx);
+    EXPECT_TRUE(testMesh.GetWorldBounds().center().isApprox(local.center() + Eigen::Vector3f(10.0f, 0.0f, 0.0f), 1e-4f));
+
+    float tHit = -1.0f;
+    AABB unitBox(Eigen::Vector3f::Constant(-1.0f), Eigen::Vector3f::Constant(1.0f));
+    EXPECT_TRUE(unitBox.rayHit(Eigen::Vector3f(0.0f, 0.0f, 5.0f), Eigen::Vector3f(0.0f, 0.0f, -1.0f), tHit));
+    EXPECT_NEAR(tHit, 4.0f, 1e-5f);
+    EXPECT_FALSE(unitBox.rayHit(Eigen::Vector3f(0.0f, 3.0f, 5.0f), Eigen::Vector3f(0.0f, 0.0f, -1.0f), tHit));
+
+    // Camera at +5z looking down -z
+    Camera camera;
+    camera.FOV = 45.0f;
+    camera.ASPECT_RATIO = 1.0f;
+    camera.NEAR = 0.5f;
+    camera.FAR = 50.0f;
+    camera.updateProjMtx();
+    Eigen::Matrix4f view = Eigen::Matrix4f::Identity();
+    view(2, 3) = -5.0f;
+    Frustum frustum(camera.projectionMtx * view);
+    EXPECT_TRUE(frustum.intersects(unitBox));
+    EXPECT_FALSE(frustum.intersects(unitBox.transformed(mtx)));
+    EXPECT_FALSE(frustum.intersects(AABB(Eigen::Vector3f(-1.0f, -1.0f, 6.0f), Eigen::Vector3f(1.0f, 1.0f, 7.0f))));
+    EXPECT_FALSE(frustum.intersects(AABB(Eigen::Vector3f(-1.0f, -1.0f, -60.0f), Eigen::Vector3f(1.0f, 1.0f, -56.0f))));
+}
+
+TEST(RenderQueueTests, SortKeyAndBatchable)
+{
+    // Program outranks texture, texture outranks VAO
+    EXPECT_LT(RenderQueue::sortKey(1, 900, 900), RenderQueue::sortKey(2, 1, 1));
+    EXPECT_LT(RenderQueue::sortKey(1, 1, 900), RenderQueue::sortKey(1, 2, 1));
+    EXPECT_LT(RenderQueue::sortKey(1, 1, 1), RenderQueue::sortKey(1, 1, 2));
+
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "sphere.obj";
+    auto testMesh = std::make_shared<Mesh>();
+    ASSERT_TRUE(testMesh->LoadFileTinyObj(modelPath.string().c_str(), false));
+    testMesh->SetStatic(true);
+    // Not on the GPU yet, and without a shader
+    EXPECT_FALSE(RenderQueue::isBatchable(*testMesh));
+    RenderQueue queue;
+    queue.updateBatches({ testMesh });
+    EXPECT_EQ(queue.getNumBatches(), 0u);
+    EXPECT_FALSE(queue.isBatched(testMesh.get()));
+}
+
+TEST(ThreadPoolTests, ParallelForRunsOnlyItsOwnChunks)
+{
+    ThreadPool pool(1);
+    // Keep the only worker busy, with an unrelated task queued behind it
+    std::promise<void> release;
+    std::shared_future<void> released = release.get_future().share();
+    auto blocker = pool.enqueue([released]() { released.wait(); });
+    std::atomic<bool> unrelatedRanOnCaller{ false };
+    const std::thread::id caller = std::this_thread::get_id();
+    auto unrelated = pool.enqueue([&]() { unrelatedRanOnCaller = std::this_thread::get_id() == caller; });
+    // The caller has to run every chunk itself, and must not pick up the queued task
+    std::atomic<size_t> sum{ 0 };
+    pool.parallelFor(0, 1000, [&](size_t b, size_t e) { for (size_t i = b; i < e; i++) sum += i; }, 1);
+    EXPECT_EQ(sum.load(), 999u * 1000u / 2);
+    release.set_value();
+    blocker.get();
+    unrelated.get();
+    EXPECT_FALSE(unrelatedRanOnCaller.load());
+}
+
+TEST(AssetCacheTests, KeysAndEviction)
+{
+    auto assets = std::filesystem::path(ASSETS_DIR);
+    AssetKey a, b, c;
+    ASSERT_TRUE(AssetHash::makeKey((assets / "sphere.obj").string(), a));
+    ASSERT_TRUE(AssetHash::makeKey((assets / ".." / "assets" / "sphere.obj").string(), b));
+    ASSERT_TRUE(AssetHash::makeKey((assets / "plane.obj").string(), c));
+    EXPECT_EQ(a.str(), b.str());
+    EXPECT_NE(a.str(), c.str());
+    EXPECT_FALSE(AssetHash::makeKey((assets / "missing.obj").string(), c));
+
+    ResourceCache<int> cache(100);
+    auto held = std::make_shared<int>(1);
+    cache.insert("held", held, 60);
+    cache.insert("released", std::make_shared<int>(2), 30);
+    EXPECT_EQ(*cache.find("released"), 2);
+    // Going over budget can only evict what nobody else references
+    cache.insert("big", std::make_shared<int>(3), 50);
+    EXPECT_EQ(cache.find("held"), held);
+    EXPECT_EQ(cache.find("released"), nullptr);
+    EXPECT_LE(cache.getBytes(), 110u);
+}
+
+TEST(AssetLoaderTests, DecodeOffThread)
+{
+    // Decoding must not need GL, so it can run on a loader thread
+    auto texPath = (std::filesystem::path(ASSETS_DIR) / "SpiderTex.jpg").string();
+    TextureImage image;
+    bool decoded = ThreadPool::global().enqueue([&]() { return TextureManager::decodeTexture(texPath, image); }).get();
+    ASSERT_TRUE(decoded);
+    // Full mip chain down to 1x1, each level tightly packed
+    int width = image.width, height = image.height;
+    for (const auto& level : image.levels)
+    {
+        EXPECT_EQ(level.size(), size_t(width) * height * image.nChannels);
+        width = std::max(1, width / 2);
+        height = std::max(1, height / 2);
+    }
+    EXPECT_EQ(image.levels.back().size(), size_t(image.nChannels));
+}
+
+TEST(HeadlessContextTests, CreatesWithoutDisplay)
+{
+    // Must work with DISPLAY unset, as on a CI box; machines without any EGL driver skip
+    HeadlessContext context;
+    if (!context.create()) GTEST_SKIP() << "No EGL driver";
+    typedef const unsigned char* (*GetStringProc)(unsigned int);
+    auto getString = reinterpret_cast<GetStringProc>(HeadlessContext::getProcAddress("glGetString"));
+    ASSERT_NE(getString, nullptr);
+    const char* version = reinterpret_cast<const char*>(getString(0x1F02)); // GL_VERSION
+    ASSERT_NE(version, nullptr);
+    int major = 0, minor = 0;
+    ASSERT_EQ(std::sscanf(version, "%d.%d", &major, &minor), 2) << version;
+    EXPECT_GE(major * 10 + minor, 33) << version;
+    context.destroy();
+    EXPECT_FALSE(context.isValid());
+}
+
+TEST(TextureCompressionTests, RoundTrip)
+{
+    // A smooth gradient with odd sizes, so edge blocks get exercised, for every channel count
+    const int width = 37, height = 21;
+    for (int nChannels = 1; nChannels <= 4; nChannels++)
+    {
+        std::vector<unsigned char> pixels(size_t(width) * height * nChannels);
+        for (int y = 0; y < height; y++)
+            for (int x = 0; x < width; x++)
+                for (int c = 0; c < nChannels; c++)
+                    pixels[(size_t(y) * width + x) * nChannels + c] = (unsigned char)((x * 5 + y * 3 + c * 40) % 256);
+        std::vector<unsigned char> blocks, decoded;
+        TextureCompression::compressLevel(pixels.data(), width, height, nChannels, blocks);
+        const uint32_t format = TextureCompression::formatForChannels(nChannels);
+        ASSERT_EQ(blocks.size(), TextureCompression::compressedSize(format, width, height));
+        TextureCompression::decompressLevel(blocks.data(), width, height, format, decoded);
+        ASSERT_EQ(decoded.size(), pixels.size());
+        double err = 0.0;
+        for (size_t i = 0; i < pixels.size(); i++) err += std::abs(int(pixels[i]) - int(decoded[i]));
+        EXPECT_LT(err / pixels.size(), 8.0) << nChannels << " channels";
+    }
+
+    // Decoding with compression writes the transcode cache, and a second decode reads it back unchanged
+    auto cacheDir = std::filesystem::temp_directory_path() / "dkViewer_test_texcache";
+    std::filesystem::remove_all(cacheDir);
+    TextureCompression::setCacheDirectory(cacheDir.string());
+    auto texPath = (std::filesystem::path(ASSETS_DIR) / "SpiderTex.jpg").string();
+    TextureImage first, second;
+    ASSERT_TRUE(TextureManager::decodeTexture(texPath, first, true));
+    ASSERT_TRUE(TextureManager::decodeTexture(texPath, second, true));
+    EXPECT_NE(first.compressedFormat, 0u);
+    EXPECT_EQ(first.compressedFormat, second.compressedFormat);
+    EXPECT_EQ(first.levels, second.levels);
+    EXPECT_FALSE(std::filesystem::is_empty(cacheDir));
+    // A write that cannot land reports it, and leaves no temporary file behind
+    const auto blocked = cacheDir / "blocked";
+    std::filesystem::create_directories(blocked / "occupied");
+    EXPECT_FALSE(TextureCompression::writeKTX(blocked.string(), first));
+    for (const auto& entry : std::filesystem::directory_iterator(cacheDir))
+        EXPECT_EQ(entry.path().string().find(".tmp"), std::string::npos) << entry.path();
+    std::filesystem::remove_all(cacheDir);
+    TextureCompression::setCacheDirectory("");
+}
 
 std::vector<float> GeneratePointsInSphere(int N, float radius) {
     std::vector<float> points;
@@ -42,6 +366,475 @@ std::vector<float> GeneratePointsInSphere(int N, float radius) {
     return points;
 }
 
+// Per run, so parallel test runs (several build dirs, ctest -j) never write the same file
+static std::filesystem::path uniqueTempPath(const std::string& stem, const std::string& extension)
+{
+    return std::filesystem::temp_directory_path() / (stem + "_" + std::to_string(std::random_device{}()) + extension);
+}
+
+TEST(SimCacheTests, CodecAndWriter)
+{
+    std::vector<uint8_t> bytes(5000), coded, decoded(5000);
+    std::mt19937 rng(7);
+    for (auto& b : bytes) b = uint8_t(std::min(255.0, std::abs(std::normal_distribution<double>(0.0, 6.0)(rng))));
+    SimCache::ransEncode(bytes.data(), bytes.size(), coded);
+    EXPECT_LT(coded.size(), bytes.size());
+    ASSERT_TRUE(SimCache::ransDecode(coded.data(), coded.size(), decoded.data(), decoded.size()));
+    EXPECT_EQ(bytes, decoded);
+
+    // A waving sheet, then a jump far off the keyframe's grid
+    const uint32_t numVerts = 300;
+    const int numFrames = 50;
+    auto frameAt = [&](int f) {
+        std::vector<float> pos(3 * numVerts);
+        for (uint32_t i = 0; i < numVerts; i++)
+        {
+            pos[3 * i] = float(i % 20) * 0.1f;
+            pos[3 * i + 1] = 0.2f * std::sin(0.1f * f + 0.3f * float(i % 20)) + (f == 40 ? 100.0f : 0.0f);
+            pos[3 * i + 2] = float(i / 20) * 0.1f;
+        }
+        return pos;
+    };
+    const uint32_t bits[2] = { 16, 12 };
+    SimCache::FrameEncoder encoder(numVerts, 1, bits, 30, true);
+    SimCache::FrameDecoder decoder(numVerts, 1);
+    std::vector<float> out(3 * numVerts);
+    for (int f = 0; f < numFrames; f++)
+    {
+        const std::vector<float> pos = frameAt(f);
+        const float* channels[1] = { pos.data() };
+        std::vector<uint8_t> record;
+        const uint32_t flags = encoder.encode(channels, record);
+        EXPECT_EQ((flags & SimCache::KEYFRAME) != 0, f == 0 || f == 30 || f == 40 || f == 41) << f;
+        // Delta frames are a fraction of the raw floats
+        if (!(flags & SimCache::KEYFRAME))
+        {
+            EXPECT_LT(record.size(), pos.size() * sizeof(float) / 4);
+        }
+        float* outChannels[1] = { out.data() };
+        ASSERT_TRUE(decoder.decode(record.data(), record.size(), outChannels));
+        for (size_t i = 0; i < pos.size(); i++) ASSERT_NEAR(out[i], pos[i], 1e-3f * std::max(1.0f, std::abs(pos[i])));
+    }
+
+    // The writer's file ends with an index over every frame
+    auto path = uniqueTempPath("dkviewer_test", ".dksim");
+    SimCacheWriter writer;
+    SimCacheWriter::Options options;
+    options.maxQueuedFrames = 2;
+    ASSERT_TRUE(writer.open(path.string(), numVerts, 0.01f, options));
+    for (int f = 0; f < numFrames; f++) EXPECT_TRUE(writer.appendFrame(frameAt(f).data()));
+    ASSERT_TRUE(writer.close());
+    EXPECT_EQ(std::filesystem::file_size(path), writer.getBytesWritten());
+    std::ifstream file(path, std::ios::binary);
+    file.seekg(-int(sizeof(SimCache::Footer)), std::ios::end);
+    SimCache::Footer footer;
+    file.read(reinterpret_cast<char*>(&footer), sizeof(footer));
+    EXPECT_EQ(footer.numFrames, uint32_t(numFrames));
+    EXPECT_EQ(std::memcmp(footer.magic, SimCache::FOOTER_MAGIC, 4), 0);
+    file.close();
+    std::filesystem::remove(path);
+}
+
+TEST(SimCacheTests, FlatKeyframeLeavesRoom)
+{
+    // A sheet that starts perfectly flat and then falls: the keyframe grid must not be pinned to that plane
+    const uint32_t numVerts = 400;
+    const uint32_t bits[2] = { 16, 12 };
+    SimCache::FrameEncoder encoder(numVerts, 1, bits, 30, true);
+    for (int f = 0; f < 20; f++)
+    {
+        std::vector<float> pos(3 * numVerts);
+        for (uint32_t i = 0; i < numVerts; i++)
+        {
+            pos[3 * i] = float(i % 20) * 0.1f;
+            pos[3 * i + 1] = -0.01f * float(f);
+            pos[3 * i + 2] = float(i / 20) * 0.1f;
+        }
+        const float* channels[1] = { pos.data() };
+        std::vector<uint8_t> record;
+        const uint32_t flags = encoder.encode(channels, record);
+        EXPECT_EQ((flags & SimCache::KEYFRAME) != 0, f == 0) << f;
+    }
+}
+
+TEST(SimCacheTests, ReaderScrubbing)
+{
+    const uint32_t numVerts = 300;
+    const uint32_t numFrames = 100;
+    auto valueAt = [](uint32_t f, size_t i) { return std::sin(0.05f * float(f) + 0.01f * float(i)); };
+    auto path = uniqueTempPath("dkviewer_scrub_test", ".dksim");
+    {
+        SimCacheWriter writer;
+        SimCacheWriter::Options options;
+        options.keyframeInterval = 10;
+        options.velocities = true;
+        ASSERT_TRUE(writer.open(path.string(), numVerts, 0.01f, options));
+        std::vector<float> pos(3 * numVerts), vel(3 * numVerts);
+        for (uint32_t f = 0; f < numFrames; f++)
+        {
+            for (size_t i = 0; i < pos.size(); i++)
+            {
+                pos[i] = valueAt(f, i);
+                vel[i] = -valueAt(f, i);
+            }
+            ASSERT_TRUE(writer.appendFrame(pos.data(), vel.data()));
+        }
+        ASSERT_TRUE(writer.close());
+    }
+
+    SimCacheReader reader;
+    ASSERT_TRUE(reader.open(path.string()));
+    EXPECT_EQ(reader.getNumFrames(), numFrames);
+    EXPECT_EQ(reader.getNumVerts(), numVerts);
+    EXPECT_TRUE(reader.hasVelocities());
+    std::vector<float> pos(3 * numVerts), vel(3 * numVerts);
+    // Backwards, forwards, then sequentially over prefetched frames
+    std::vector<uint32_t> order = { 57, 3, 99, 98, 0, 45, 46, 47, 12 };
+    reader.prefetch(60, 30);
+    for (uint32_t f = 60; f < 90; f++) order.push_back(f);
+    for (uint32_t f : order)
+    {
+        ASSERT_TRUE(reader.readFrame(f, pos.data(), vel.data()));
+        for (size_t i = 0; i < pos.size(); i++)
+        {
+            ASSERT_NEAR(pos[i], valueAt(f, i), 1e-3f) << f;
+            ASSERT_NEAR(vel[i], -valueAt(f, i), 1e-2f) << f;
+        }
+    }
+    EXPECT_FALSE(reader.readFrame(numFrames, pos.data()));
+    reader.close();
+
+    // Without its footer, and with the last record cut short, the file still plays up to the damage
+    const auto fullSize = std::filesystem::file_size(path);
+    std::filesystem::resize_file(path, fullSize - sizeof(SimCache::Footer) - numFrames * sizeof(SimCache::IndexEntry) - 5);
+    ASSERT_TRUE(reader.open(path.string()));
+    EXPECT_EQ(reader.getNumFrames(), numFrames - 1);
+    ASSERT_TRUE(reader.readFrame(numFrames - 2, pos.data()));
+    EXPECT_NEAR(pos[7], valueAt(numFrames - 2, 7), 1e-3f);
+    reader.close();
+    std::filesystem::remove(path);
+}
+
+// The two corners of plane4.obj the demo cloth hangs from
+static const std::vector<uint32_t> g_PlaneCorners = { 263, 275 };
+
+TEST(SolverTests, CheckpointResumeIsBitExact)
+{
+    auto modelPath = std::filesystem::path(ASSETS_DIR) / "plane4.obj";
+    auto loadCloth = [&]() {
+        auto mesh = std::make_shared<Mesh>();
+        EXPECT_TRUE(mesh->LoadFileTinyObj(modelPath.string().c_str(), false));
+        return mesh;
+    };
+    auto cloth = loadCloth();
+    SpringSolver solver;
+    ASSERT_TRUE(solver.setup(cloth, g_PlaneCorners));
+    solver.doSim = true;
+    solver.dt = 0.01f;
+    for (int i = 0; i < 5; i++) solver.step();
+    std::vector<uint8_t> checkpoint;
+    solver.saveCheckpoint(checkpoint);
+    for (int i = 0; i < 5; i++) solver.step();
+    const Eigen::VectorXf expected = cloth->GetPositions();
+
+    // A fresh solver, with default parameters, on a freshly loaded copy of the mesh
+    // Resuming with other pins would silently diverge, so it is refused
+    SpringSolver repinned;
+    ASSERT_TRUE(repinned.setup(loadCloth(), std::vector<uint32_t>{ 263 }));
+    EXPECT_FALSE(repinned.loadCheckpoint(checkpoint.data(), checkpoint.size()));
+    SpringSolver unpinned;
+    ASSERT_TRUE(unpinned.setup(loadCloth()));
+    EXPECT_FALSE(unpinned.loadCheckpoint(checkpoint.data(), checkpoint.size()));
+
+    auto restoredCloth = loadCloth();
+    SpringSolver restored;
+    ASSERT_TRUE(restored.setup(restoredCloth, g_PlaneCorners));
+    EXPECT_FALSE(restored.loadCheckpoint(checkpoint.data(), checkpoint.size() - 1));
+    ASSERT_TRUE(restored.loadCheckpoint(checkpoint.data(), checkpoint.size()));
+    EXPECT_TRUE(restored.doSim);
+    EXPECT_EQ(restored.dt, 0.01f);
+    for (int i = 0; i < 5; i++) restored.step();
+    const Eigen::VectorXf resumed = restoredCloth->GetPositions();
+    ASSERT_EQ(resumed.size(), expected.size());
+    EXPECT_EQ(std::memcmp(resumed.data(), expected.data(), sizeof(float) * expected.size()), 0);
+}
+
+TEST(SolverTests, MultipleMeshesAndIslands)
+{
+    auto loadCloth = [&](float shift) {
+        auto mesh = std::make_shared<Mesh>();
+        EXPECT_TRUE(mesh->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+        mesh->SetPositions(mesh->GetPositions() + Eigen::Vector3f(shift, 0.0f, 0.0f).replicate(mesh->GetNumVerts(), 1));
+        return mesh;
+    };
+    auto single = loadCloth(0.0f);
+    SpringSolver reference;
+    ASSERT_TRUE(reference.setup(single, g_PlaneCorners));
+    auto first = loadCloth(0.0f);
+    auto second = loadCloth(1.0f);
+    SpringSolver solver;
+    EXPECT_EQ(solver.addMesh(first, g_PlaneCorners), 0u);
+    EXPECT_EQ(solver.addMesh(second, g_PlaneCorners), 1u);
+    EXPECT_EQ(solver.getNumIslands(), 2u);
+    EXPECT_EQ(solver.getNumVerts(), 2 * first->GetNumVerts());
+    for (SpringSolver* s : { &reference, &solver })
+    {
+        s->doSim = true;
+        s->dt = 0.01f;
+        for (int i = 0; i < 5; i++) s->step();
+    }
+    // Independent islands behave exactly like a solver of their own, and the results land in every mesh
+    const Eigen::VectorXf expected = single->GetPositions();
+    const Eigen::VectorXf firstPositions = first->GetPositions();
+    EXPECT_EQ(std::memcmp(firstPositions.data(), expected.data(), sizeof(float) * expected.size()), 0);
+    EXPECT_TRUE(second->GetPositions().isApprox(expected + Eigen::Vector3f(1.0f, 0.0f, 0.0f).replicate(single->GetNumVerts(), 1)));
+
+    // Coupling the two merges them into one island, the coupled bodies still land in their meshes
+    EXPECT_FALSE(solver.addAttachment(0, 0, 2, 0));
+    ASSERT_TRUE(solver.addAttachment(1, 0, 0, 0));
+    EXPECT_EQ(solver.getNumIslands(), 1u);
+    EXPECT_EQ(solver.getBodies()[1].island, 0u);
+    for (int i = 0; i < 5; i++) solver.step();
+    const uint32_t offset = solver.getBodies()[1].vertexOffset;
+    EXPECT_TRUE(solver.getPositions().allFinite());
+    EXPECT_EQ(second->GetPositions(), solver.getPositions().segment(3 * offset, 3 * second->GetNumVerts()));
+
+    // Only the caller decides what is pinned: a plain setup lets every vertex fall
+    SpringSolver unpinned;
+    auto loose = loadCloth(0.0f);
+    ASSERT_TRUE(unpinned.setup(loose, true));
+    unpinned.doSim = true;
+    unpinned.dt = 0.01f;
+    for (int i = 0; i < 5; i++) unpinned.step();
+    for (uint32_t corner : g_PlaneCorners)
+        EXPECT_LT(unpinned.getPositions()(3 * corner + 1), loose->GetPositions()(3 * corner + 1)) << corner;
+}
+
+TEST(SolverTests, ScalarPrecisions)
+{
+    auto cloth = std::make_shared<Mesh>();
+    ASSERT_TRUE(cloth->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+    SpringSolver single;
+    SpringSolverD full, mixed;
+    mixed.mixedPrecision = true;
+    single.setup(cloth, g_PlaneCorners, true);
+    full.setup(cloth, g_PlaneCorners, true);
+    mixed.setup(cloth, g_PlaneCorners, true);
+    single.doSim = full.doSim = mixed.doSim = true;
+    single.dt = 0.01f;
+    full.dt = mixed.dt = 0.01;
+    for (int i = 0; i < 10; i++)
+    {
+        single.step();
+        full.step();
+        mixed.step();
+    }
+    const Eigen::VectorXd reference = full.getPositions();
+    // Refinement recovers double accuracy from the float factorization
+    EXPECT_LT((Eigen::VectorXd(mixed.getPositions()) - reference).norm(), 1e-9 * reference.norm());
+    EXPECT_LT((single.getPositions().cast<double>() - reference).norm(), 1e-4 * reference.norm());
+    EXPECT_GT((single.getPositions().cast<double>() - reference).norm(), 0.0);
+
+    // Checkpoints only load into a solver of the same precision
+    std::vector<uint8_t> checkpoint;
+    full.saveCheckpoint(checkpoint);
+    EXPECT_FALSE(single.loadCheckpoint(checkpoint.data(), checkpoint.size()));
+    SpringSolverD restored;
+    restored.setup(cloth, g_PlaneCorners, true);
+    ASSERT_TRUE(restored.loadCheckpoint(checkpoint.data(), checkpoint.size()));
+    EXPECT_EQ(Eigen::VectorXd(restored.getPositions()), reference);
+
+    SweepRunner::Grid grid;
+    EXPECT_FALSE(SweepRunner::parseGrid("precision=half", grid));
+    ASSERT_TRUE(SweepRunner::parseGrid("k=10,30 precision=float,mixed", grid));
+    const std::vector<SweepRunner::Parameters> points = SweepRunner::expandGrid(grid);
+    ASSERT_EQ(points.size(), 4u);
+    EXPECT_EQ(points[1].precision, SweepRunner::MIXED);
+    EXPECT_EQ(points[1].k, 10.0f);
+}
+
+TEST(SolverTests, SymmetricSolveWithCachedAnalysis)
+{
+    const auto cacheDir = std::filesystem::temp_directory_path() / "dkViewer_test_solvercache";
+    std::filesystem::remove_all(cacheDir);
+    SymbolicCache::setCacheDirectory(cacheDir.string());
+    auto cloth = std::make_shared<Mesh>();
+    ASSERT_TRUE(cloth->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+    auto simulate = [&](int linearSolver) {
+        SpringSolver solver;
+        solver.linearSolver = linearSolver;
+        solver.setup(cloth, g_PlaneCorners, true);
+        solver.doSim = true;
+        solver.dt = 0.01f;
+        for (int i = 0; i < 10; i++) solver.step();
+        return Eigen::VectorXf(solver.getPositions());
+    };
+    const Eigen::VectorXf lu = simulate(SpringSolver::SPARSE_LU);
+    const Eigen::VectorXf computed = simulate(SpringSolver::LDLT);
+    ASSERT_EQ(std::distance(std::filesystem::directory_iterator(cacheDir), std::filesystem::directory_iterator()), 1);
+    const std::string cachePath = std::filesystem::directory_iterator(cacheDir)->path().string();
+    // Only the small velocity dependent damping term differs from the LU solve
+    EXPECT_LT((computed - lu).norm(), 1e-3f * lu.norm());
+    // The analysis read back from the cache gives the same factorization
+    const Eigen::VectorXf cached = simulate(SpringSolver::LDLT);
+    EXPECT_EQ(std::memcmp(cached.data(), computed.data(), sizeof(float) * computed.size()), 0);
+    SymbolicCache::Analysis analysis;
+    EXPECT_FALSE(SymbolicCache::read(cachePath, 1234, size_t(computed.size()), analysis));
+    // A damaged entry is ignored and replaced
+    std::filesystem::resize_file(cachePath, std::filesystem::file_size(cachePath) - 4);
+    const Eigen::VectorXf recomputed = simulate(SpringSolver::LDLT);
+    EXPECT_EQ(std::memcmp(recomputed.data(), computed.data(), sizeof(float) * computed.size()), 0);
+    SymbolicCache::setCacheDirectory("");
+    std::filesystem::remove_all(cacheDir);
+}
+
+TEST(SolverTests, BlockSparseIterativeSolve)
+{
+    // Random symmetric pattern of 3x3 blocks, made diagonally dominant so it is positive definite
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    const uint32_t numBlocks = 50;
+    std::vector<std::pair<uint32_t, uint32_t>> pattern;
+    for (int i = 0; i < 150; i++)
+    {
+        const uint32_t a = rng() % numBlocks, b = rng() % numBlocks;
+        pattern.emplace_back(a, b);
+        pattern.emplace_back(b, a);
+    }
+    BlockSparseMatrix3<double> A;
+    A.setPattern(numBlocks, pattern);
+    for (const auto& p : pattern)
+    {
+        if (p.first >= p.second) continue;
+        const Eigen::Matrix3d b = Eigen::Matrix3d::NullaryExpr([&]() { return dist(rng); });
+        A.block(size_t(A.findBlock(p.first, p.second))) = b;
+        A.block(size_t(A.findBlock(p.second, p.first))) = b.transpose();
+    }
+    for (uint32_t i = 0; i < numBlocks; i++) A.block(A.getDiagonalIndex(i)) += 20.0 * Eigen::Matrix3d::Identity();
+    EXPECT_EQ(A.findBlock(numBlocks, 0), -1);
+
+    const Eigen::SparseMatrix<double> scalar = A.toSparse();
+    const Eigen::VectorXd x = Eigen::VectorXd::NullaryExpr(3 * numBlocks, [&]() { return dist(rng); });
+    Eigen::VectorXd y;
+    A.multiply(x, y);
+    EXPECT_LT((y - scalar * x).norm(), 1e-12 * y.norm());
+
+    BlockJacobi<double> P;
+    P.compute(A);
+    Eigen::VectorXd solution = Eigen::VectorXd::Zero(x.size());
+    const uint32_t iterations = Krylov::conjugateGradient(A, P, y, solution, 100, 1e-10);
+    EXPECT_LT(iterations, 100u);
+    EXPECT_LT((solution - x).norm(), 1e-8 * x.norm());
+    solution.setZero();
+    EXPECT_LT(Krylov::biCGStab(A, P, y, solution, 100, 1e-10), 100u);
+    EXPECT_LT((solution - x).norm(), 1e-8 * x.norm());
+
+    // A rotation makes r0.v vanish on the first step: BiCGSTAB must not divide by it nor claim convergence
+    struct Rotation { void multiply(const Eigen::VectorXd& in, Eigen::VectorXd& out) const { out = Eigen::Vector2d(in[1], -in[0]); } };
+    struct Unpreconditioned { void apply(const Eigen::VectorXd& r, Eigen::VectorXd& z) const { z = r; } };
+    Eigen::VectorXd rotated = Eigen::VectorXd::Zero(2);
+    EXPECT_EQ(Krylov::biCGStab(Rotation{}, Unpreconditioned{}, Eigen::VectorXd(Eigen::Vector2d(1.0, 0.0)), rotated, 20, 1e-10), 20u);
+    EXPECT_TRUE(rotated.allFinite());
+
+    // The block solvers follow the direct ones on the cloth
+    auto cloth = std::make_shared<Mesh>();
+    ASSERT_TRUE(cloth->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+    auto simulate = [&](int linearSolver) {
+        SpringSolverD solver;
+        solver.linearSolver = linearSolver;
+        solver.iterativeTol = 1e-10;
+        solver.setup(cloth, g_PlaneCorners, true);
+        solver.doSim = true;
+        solver.dt = 0.01;
+        for (int i = 0; i < 10; i++) solver.step();
+        EXPECT_LT(solver.getLastIterations(), solver.maxIterations);
+        return Eigen::VectorXd(solver.getPositions());
+    };
+    const Eigen::VectorXd lu = simulate(SpringSolverD::SPARSE_LU);
+    EXPECT_LT((simulate(SpringSolverD::BLOCK_BICGSTAB) - lu).norm(), 1e-6 * lu.norm());
+    // The CG solves also drop the negative stiffness of the few compressed springs, so they only stay close to
+    // LDLT, which keeps it
+    const Eigen::VectorXd ldlt = simulate(SpringSolverD::LDLT);
+    const Eigen::VectorXd cg = simulate(SpringSolverD::BLOCK_CG);
+    EXPECT_LT((cg - ldlt).norm(), 1e-4 * lu.norm());
+    // Never forms the system, but solves the same one
+    EXPECT_LT((simulate(SpringSolverD::MATRIX_FREE_CG) - cg).norm(), 1e-6 * lu.norm());
+}
+
+TEST(SolverTests, NewtonLargeSteps)
+{
+    auto cloth = std::make_shared<Mesh>();
+    ASSERT_TRUE(cloth->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+    auto simulate = [&](int integrator, int linearSolver, double dt, int numSteps, SpringSolverD& solver) {
+        solver.integrator = integrator;
+        solver.linearSolver = linearSolver;
+        solver.iterativeTol = 1e-10;
+        solver.setup(cloth, g_PlaneCorners, true);
+        solver.doSim = true;
+        solver.dt = dt;
+        for (int i = 0; i < numSteps; i++) solver.step();
+        return Eigen::VectorXd(solver.getPositions());
+    };
+    // At tiny steps backward Euler lands close to symplectic Euler
+    SpringSolverD symplectic, newton;
+    const Eigen::VectorXd explicitPositions = simulate(SpringSolverD::SYMPLECTIC, SpringSolverD::SPARSE_LU, 0.001, 200, symplectic);
+    const Eigen::VectorXd minimized = simulate(SpringSolverD::NEWTON, SpringSolverD::MATRIX_FREE_CG, 0.001, 200, newton);
+    EXPECT_LT((minimized - explicitPositions).norm(), 1e-3 * explicitPositions.norm());
+    EXPECT_LE(newton.getLastNewtonIterations(), 3u);
+
+    // 20x the usual step stays stable and converges, and direct and matrix-free inner solves find the same minimum
+    SpringSolverD direct, matrixFree;
+    direct.newtonTol = matrixFree.newtonTol = 1e-6;
+    direct.maxNewtonIterations = matrixFree.maxNewtonIterations = 100;
+    const Eigen::VectorXd large = simulate(SpringSolverD::NEWTON, SpringSolverD::SPARSE_LU, 0.2, 5, direct);
+    EXPECT_TRUE(large.allFinite());
+    EXPECT_LT(direct.getMaxStretch(), 1.0);
+    EXPECT_LT(direct.getLastNewtonIterations(), direct.maxNewtonIterations);
+    EXPECT_LT((simulate(SpringSolverD::NEWTON, SpringSolverD::MATRIX_FREE_CG, 0.2, 5, matrixFree) - large).norm(), 1e-3 * large.norm());
+
+    // A scaled potential needs the Hessian scaled to match, or Newton loses its fast convergence
+    SpringSolverD scaled;
+    scaled.newtonTol = 1e-6;
+    scaled.maxNewtonIterations = 100;
+    scaled.globalScale = 0.25;
+    EXPECT_TRUE(simulate(SpringSolverD::NEWTON, SpringSolverD::SPARSE_LU, 0.2, 5, scaled).allFinite());
+    EXPECT_LE(scaled.getLastNewtonIterations(), direct.getLastNewtonIterations() + 2);
+}
+
+TEST(SolverTests, ParameterSweep)
+{
+    SweepRunner::Grid grid;
+    ASSERT_TRUE(SweepRunner::parseGrid("k=10,30 dt=0.005:0.01:2", grid));
+    EXPECT_FALSE(SweepRunner::parseGrid("stiffness=3", grid));
+    std::vector<SweepRunner::Parameters> points = SweepRunner::expandGrid(grid);
+    ASSERT_EQ(points.size(), 4u);
+    EXPECT_EQ(points[1].k, 10.0f);
+    EXPECT_EQ(points[1].dt, 0.01f);
+    EXPECT_EQ(points[3].beta_s, SpringSolver().beta_s);
+    // The same point twice must give the same answer, whatever ran next to it
+    points.push_back(points[0]);
+
+    auto cloth = std::make_shared<Mesh>();
+    ASSERT_TRUE(cloth->LoadFileTinyObj((std::filesystem::path(ASSETS_DIR) / "plane4.obj").string(), false));
+    const Eigen::VectorXf restPositions = cloth->GetPositions();
+    SweepRunner runner(cloth);
+    runner.setPinned(g_PlaneCorners);
+    std::atomic<size_t> progressCalls{ 0 };
+    const auto results = runner.run(points, 20, [&](size_t, size_t) { progressCalls++; });
+    ASSERT_EQ(results.size(), points.size());
+    EXPECT_EQ(progressCalls.load(), points.size());
+    for (const auto& result : results)
+    {
+        EXPECT_TRUE(result.stable);
+        EXPECT_EQ(result.steps, 20u);
+        EXPECT_GT(result.maxStretch, 0.0f);
+    }
+    EXPECT_EQ(results[0].energy, results[4].energy);
+    EXPECT_EQ(results[0].maxStretch, results[4].maxStretch);
+    // The shared mesh is never written
+    EXPECT_EQ(cloth->GetPositions(), restPositions);
+}
+
 TEST(OctreeTests, BasicOctree)
 {
     // Some basic data